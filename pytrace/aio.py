@@ -0,0 +1,115 @@
+"""asyncio integration, built on libtrace's event API.
+
+    async for packet in trace.aiter():
+        ...
+
+trace_event() says what a live input is waiting for instead of blocking:
+a file descriptor to become readable (IOWAIT), which is registered with
+loop.add_reader, or a delay (SLEEP), scheduled with loop.call_later. So
+one event loop can serve many captures, each in its own task, without a
+thread per capture. Note that trace_event() replays offline traces at the
+pace they were recorded, as libtrace does.
+
+Sources that are not read through libtrace directly (the native pcap
+reader, merges and other stages) cannot say what they are waiting for,
+and a stage wrapping a live input may block. So they are read in the
+loop's default executor, one packet per call, which keeps the loop free
+but costs a thread hop per packet; source.batches() is faster for those
+that are only files.
+"""
+
+import asyncio
+
+from _trace import ffi, lib
+from pytrace import Packet, TraceError
+
+
+class _Generation(object):
+    """Stands in for a PacketBatch as the owner of the Packets yielded,
+    so that they go stale when the next event reads into the packet.
+    It also keeps the packet, and the source its data may point into,
+    alive for as long as a Packet or view refers to it."""
+
+    def __init__(self, source, pkt):
+        self._source = source
+        self._pkt = pkt
+        self._generation = 0
+
+
+def _resolve(future):
+    if not future.done():
+        future.set_result(None)
+
+
+async def _readable(loop, fd):
+    future = loop.create_future()
+    loop.add_reader(fd, _resolve, future)
+    try:
+        await future
+    finally:
+        loop.remove_reader(fd)
+
+
+async def _sleep(loop, seconds):
+    future = loop.create_future()
+    handle = loop.call_later(seconds, _resolve, future)
+    try:
+        await future
+    finally:
+        handle.cancel()
+
+
+async def aiter(source, yield_every=64):
+    """Yield the packets of a PacketSource without blocking the event loop.
+
+    Each Packet goes stale when the next one is read. After yield_every
+    packets in a row that were ready straight away, the loop gets a turn
+    before reading on, so a busy capture cannot starve other tasks.
+    """
+    loop = asyncio.get_running_loop()
+    source._check_idle()
+    source.start()
+
+    pkt = lib.trace_create_packet()
+    if pkt == ffi.NULL:
+        raise MemoryError("Could not allocate packet")
+    pkt = ffi.gc(pkt, lib.trace_destroy_packet)
+    owner = _Generation(source, pkt)
+
+    if source._reader.trace == ffi.NULL:
+        # Not plain libtrace, so there is no trace_event() to ask
+        while True:
+            owner._generation += 1
+            # If this task is cancelled, the thread still finishes the read,
+            # so the source stays busy until it has
+            source._pending = loop.run_in_executor(
+                None, lib.pytrace_reader_read, source._reader, pkt)
+            size = await asyncio.shield(source._pending)
+            if size < 0:
+                raise TraceError.from_reader(source._reader)
+            if size == 0:
+                return
+            yield Packet(pkt, owner)
+
+    event = ffi.new("libtrace_eventobj_t *")
+    ready = 0
+
+    while True:
+        owner._generation += 1
+        kind = lib.pytrace_reader_event(source._reader, pkt, event)
+        if kind == lib.TRACE_EVENT_PACKET:
+            yield Packet(pkt, owner)
+            ready += 1
+            if ready >= yield_every:
+                ready = 0
+                await asyncio.sleep(0)
+        elif kind == lib.TRACE_EVENT_IOWAIT:
+            ready = 0
+            await _readable(loop, event.fd)
+        elif kind == lib.TRACE_EVENT_SLEEP:
+            ready = 0
+            await _sleep(loop, event.seconds)
+        else:
+            if event.size < 0:
+                raise TraceError.from_reader(source._reader)
+            return
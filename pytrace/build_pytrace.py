@@ -4,13 +4,60 @@ from cffi import FFI
 
 ffi = FFI()
 
-ffi.set_source("pytrace._trace",
-               "#include <libtrace.h>",
-               libraries=["c", "trace"],
-               )
+here = os.path.dirname(os.path.abspath(__file__))
+srcdir = os.path.join(here, "src")
+
+# libtrace.h refers to these system structures by value, so cffi needs to
+# know about them before the header is parsed.
+ffi.cdef("""
+struct in_addr { uint32_t s_addr; };
+struct in6_addr { ...; };
+struct sockaddr { ...; };
+struct timeval { ...; };
+""")
+
+with open(os.path.join(here, "libtrace.h")) as f:
+    ffi.cdef(f.read())
 
-with open(os.path.join(os.path.dirname(__file__), "libtrace.h")) as f:
+with open(os.path.join(srcdir, "pytrace.h")) as f:
     ffi.cdef(f.read())
 
+ffi.set_source("pytrace._trace",
+               """
+               #include <netinet/in.h>
+               #include <sys/socket.h>
+               #include <sys/time.h>
+               #include <libtrace.h>
+               #include "pytrace.h"
+               """,
+               sources=[
+                   os.path.join(srcdir, "reader.c"),
+                   os.path.join(srcdir, "filter.c"),
+                   os.path.join(srcdir, "batch.c"),
+                   os.path.join(srcdir, "columns.c"),
+                   os.path.join(srcdir, "readahead.c"),
+                   os.path.join(srcdir, "pcapfile.c"),
+                   os.path.join(srcdir, "split.c"),
+                   os.path.join(srcdir, "merge.c"),
+                   os.path.join(srcdir, "decode.c"),
+                   os.path.join(srcdir, "flows.c"),
+                   os.path.join(srcdir, "tcp.c"),
+                   os.path.join(srcdir, "defrag.c"),
+                   os.path.join(srcdir, "dedup.c"),
+                   os.path.join(srcdir, "classify.c"),
+                   os.path.join(srcdir, "decap.c"),
+                   os.path.join(srcdir, "layers.c"),
+                   os.path.join(srcdir, "headers.c"),
+                   os.path.join(srcdir, "sample.c"),
+                   os.path.join(srcdir, "windows.c"),
+                   os.path.join(srcdir, "sketch.c"),
+                   os.path.join(srcdir, "aes.c"),
+                   os.path.join(srcdir, "anon.c"),
+                   os.path.join(srcdir, "checksum.c"),
+               ],
+               include_dirs=[srcdir],
+               libraries=["c", "m", "trace", "pthread"],
+               )
+
 if __name__ == "__main__":
     ffi.compile()
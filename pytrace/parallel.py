@@ -0,0 +1,61 @@
+"""Parallel processing of a single large pcap file.
+
+The file is split into byte ranges that each start on a record boundary,
+and every range is handed to a separate worker process as its own Trace.
+"""
+
+import multiprocessing
+
+from _trace import ffi, lib
+from pytrace import Trace, TraceError, _pcap_path
+
+
+def split_pcap(path, parts):
+    """Split an uncompressed pcap file into parts (start, end) byte ranges.
+
+    Cuts are moved forward to the next offset from which a run of valid
+    record headers can be parsed. A range may come back empty if no
+    boundary was found near its cut; it is still returned so that results
+    line up with range numbers.
+    """
+    path = _pcap_path(path) or path
+    offsets = ffi.new("uint64_t[]", parts + 1)
+    error = ffi.new("char[256]")
+    if lib.pytrace_pcap_split(path, parts, offsets, error) == -1:
+        raise TraceError(-1, ffi.string(error))
+    return [(offsets[i], offsets[i + 1]) for i in range(parts)]
+
+
+def _run_range(job):
+    func, path, byte_range, mmap = job
+    return func(Trace(path, mmap=mmap, byte_range=byte_range))
+
+
+def map_ranges(func, path, parts=None, processes=None, mmap=True,
+               combine=None):
+    """Run func(trace) over K byte ranges of a pcap file in parallel.
+
+    func must be picklable (i.e. a module-level function) and is called in
+    a worker process with a Trace covering one range. The results are
+    returned as a list in file order, so time-ordered outputs can simply
+    be concatenated. If combine is given, the results are instead folded
+    together with it, again in file order.
+    """
+    if parts is None:
+        parts = processes or multiprocessing.cpu_count()
+    path = _pcap_path(path) or path
+    jobs = [(func, path, r, mmap) for r in split_pcap(path, parts)]
+
+    pool = multiprocessing.Pool(processes or parts)
+    try:
+        results = pool.map(_run_range, jobs)
+    finally:
+        pool.close()
+        pool.join()
+
+    if combine is None:
+        return results
+    total = results[0]
+    for result in results[1:]:
+        total = combine(total, result)
+    return total
@@ -0,0 +1,592 @@
+"""Field-level packet predicates compiled to native code.
+
+A predicate is a small boolean expression over decoded header fields, e.g.
+
+    inner.ip.dst in 10.0.0.0/8 and tcp.flags & SYN and not tcp.flags & ACK
+
+It is translated to C, built into a tiny extension module with cffi and
+cached on disk, so each distinct expression is compiled only once per
+machine. The result can test a PacketBatch natively, or be attached to a
+PacketSource with set_filter() so that non-matching packets are dropped
+inside the native read loop.
+
+Fields are taken from the outermost IP header, or from the innermost one
+when prefixed with "inner." (which is the same header for packets that are
+not tunnelled). GRE, VXLAN (UDP port 4789) and IP-in-IP are unwrapped, up
+to four levels deep.
+
+    ip.version ip.src ip.dst ip.proto ip.ttl ip.len
+    tcp.sport tcp.dport tcp.flags tcp.window
+    udp.sport udp.dport sport dport (TCP or UDP)
+    icmp.type icmp.code
+    vxlan.vni gre.proto gre.key frame.len frame.caplen
+
+A bare name (ip, ip6, tcp, udp, icmp, vxlan, gre, tunnel) tests for the
+presence of that header. Numbers compare with == != < <= > >=, test bits
+with &, and match lists with "in [1, 2, 3]". Addresses compare with == and
+!=, and "in" takes a prefix or a list of prefixes. The names SYN, FIN, RST,
+PSH, ACK, URG, ECE and CWR stand for the TCP flag bits. A test on a field
+whose header is missing is false.
+"""
+
+import errno
+import hashlib
+import importlib.machinery
+import importlib.util
+import os
+import re
+import shutil
+import socket
+import tempfile
+
+from cffi import FFI
+
+from _trace import ffi, lib
+
+# Bumped whenever the generated code changes, to invalidate the disk cache
+_CODE_VERSION = 1
+
+_TCP_FLAGS = {
+    "FIN": 0x01, "SYN": 0x02, "RST": 0x04, "PSH": 0x08,
+    "ACK": 0x10, "URG": 0x20, "ECE": 0x40, "CWR": 0x80,
+}
+
+# Numeric fields of an IP layer: name -> (C expression, presence test)
+_LAYER_FIELDS = {
+    "ip.version": ("L.ip", "1"),
+    "ip.proto": ("L.proto", "L.ip"),
+    "ip.ttl": ("L.ttl", "L.ip"),
+    "ip.len": ("L.ip_len", "L.ip"),
+    "tcp.sport": ("L.sport", "L.l4 == 6"),
+    "tcp.dport": ("L.dport", "L.l4 == 6"),
+    "tcp.flags": ("L.tcp_flags", "L.l4 == 6"),
+    "tcp.window": ("L.tcp_window", "L.l4 == 6"),
+    "udp.sport": ("L.sport", "L.l4 == 17"),
+    "udp.dport": ("L.dport", "L.l4 == 17"),
+    "sport": ("L.sport", "(L.l4 == 6 || L.l4 == 17)"),
+    "dport": ("L.dport", "(L.l4 == 6 || L.l4 == 17)"),
+    "icmp.type": ("L.icmp_type", "(L.l4 == 1 || L.l4 == 58)"),
+    "icmp.code": ("L.icmp_code", "(L.l4 == 1 || L.l4 == 58)"),
+}
+
+_ADDRESS_FIELDS = {"ip.src": "src", "ip.dst": "dst"}
+
+_LAYER_PRESENCE = {
+    "ip": "L.ip == 4",
+    "ip6": "L.ip == 6",
+    "tcp": "L.l4 == 6",
+    "udp": "L.l4 == 17",
+    "icmp": "(L.l4 == 1 || L.l4 == 58)",
+}
+
+# Fields of the packet as a whole
+_PACKET_FIELDS = {
+    "vxlan.vni": ("v->vni", "v->vxlan"),
+    "gre.proto": ("v->gre_proto", "v->gre"),
+    "gre.key": ("v->gre_key", "v->gre_has_key"),
+    "frame.len": ("v->wire_len", "1"),
+    "frame.caplen": ("v->cap_len", "1"),
+}
+
+_PACKET_PRESENCE = {
+    "vxlan": "v->vxlan",
+    "gre": "v->gre",
+    "tunnel": "(v->depth > 0)",
+}
+
+# Decoding shared by every predicate. It only relies on libtrace, so the
+# generated module does not need anything from pytrace._trace.
+_PRELUDE = r"""
+#include <arpa/inet.h>
+#include <string.h>
+#include <libtrace.h>
+
+struct layer {
+	int ip;			/* 0, 4 or 6 */
+	uint8_t src[16];
+	uint8_t dst[16];
+	uint32_t proto;
+	uint32_t ttl;
+	uint32_t ip_len;
+	uint32_t l4;		/* Protocol of a complete transport header */
+	uint32_t sport;
+	uint32_t dport;
+	uint32_t tcp_flags;
+	uint32_t tcp_window;
+	uint32_t icmp_type;
+	uint32_t icmp_code;
+};
+
+struct view {
+	struct layer outer;
+	struct layer inner;
+	int depth;
+	int vxlan;
+	uint32_t vni;
+	int gre;
+	uint32_t gre_proto;
+	int gre_has_key;
+	uint32_t gre_key;
+	uint32_t wire_len;
+	uint32_t cap_len;
+};
+
+static void *fill_layer(struct layer *l, void *l3, uint16_t ethertype,
+		uint32_t rem, uint8_t *proto, uint32_t *left)
+{
+	unsigned char *p;
+
+	memset(l, 0, sizeof(*l));
+	*left = rem;
+	if (ethertype == TRACE_ETHERTYPE_IP && rem >= sizeof(libtrace_ip_t)) {
+		libtrace_ip_t *ip = l3;
+
+		l->ip = 4;
+		memcpy(l->src, &ip->ip_src, 4);
+		memcpy(l->dst, &ip->ip_dst, 4);
+		l->ttl = ip->ip_ttl;
+		l->ip_len = ntohs(ip->ip_len);
+		p = trace_get_payload_from_ip(ip, proto, left);
+		l->proto = ip->ip_p;
+	} else if (ethertype == TRACE_ETHERTYPE_IPV6 &&
+			rem >= sizeof(libtrace_ip6_t)) {
+		libtrace_ip6_t *ip6 = l3;
+
+		l->ip = 6;
+		memcpy(l->src, &ip6->ip_src, 16);
+		memcpy(l->dst, &ip6->ip_dst, 16);
+		l->ttl = ip6->hlim;
+		l->ip_len = ntohs(ip6->plen) + sizeof(libtrace_ip6_t);
+		p = trace_get_payload_from_ip6(ip6, proto, left);
+		l->proto = *proto;
+	} else {
+		return NULL;
+	}
+	if (!p)
+		return NULL;
+
+	if (*proto == TRACE_IPPROTO_TCP && *left >= sizeof(libtrace_tcp_t)) {
+		libtrace_tcp_t *tcp = (libtrace_tcp_t *)p;
+
+		l->l4 = *proto;
+		l->sport = ntohs(tcp->source);
+		l->dport = ntohs(tcp->dest);
+		l->tcp_flags = p[13];
+		l->tcp_window = ntohs(tcp->window);
+	} else if (*proto == TRACE_IPPROTO_UDP &&
+			*left >= sizeof(libtrace_udp_t)) {
+		libtrace_udp_t *udp = (libtrace_udp_t *)p;
+
+		l->l4 = *proto;
+		l->sport = ntohs(udp->source);
+		l->dport = ntohs(udp->dest);
+	} else if ((*proto == TRACE_IPPROTO_ICMP ||
+			*proto == TRACE_IPPROTO_ICMPV6) && *left >= 2) {
+		l->l4 = *proto;
+		l->icmp_type = p[0];
+		l->icmp_code = p[1];
+	}
+	return p;
+}
+
+static void decode(const libtrace_packet_t *packet, struct view *v)
+{
+	uint16_t ethertype;
+	uint32_t rem, left;
+	uint8_t proto = 0;
+	void *l3, *l4;
+
+	memset(v, 0, sizeof(*v));
+	v->wire_len = trace_get_wire_length(packet);
+	v->cap_len = trace_get_capture_length(packet);
+
+	l3 = trace_get_layer3(packet, &ethertype, &rem);
+	if (!l3)
+		return;
+	l4 = fill_layer(&v->outer, l3, ethertype, rem, &proto, &left);
+	v->inner = v->outer;
+
+	while (l4 && v->depth < 4) {
+		struct layer inner;
+		unsigned char *next = NULL;
+		uint16_t type = 0;
+
+		if (proto == TRACE_IPPROTO_GRE && left >= 4) {
+			unsigned char *g = l4;
+			uint16_t flags = (g[0] << 8) | g[1];
+			uint32_t at = (flags & LIBTRACE_GRE_FLAG_CHECKSUM) ? 8 : 4;
+
+			v->gre = 1;
+			v->gre_proto = (g[2] << 8) | g[3];
+			if ((flags & LIBTRACE_GRE_FLAG_KEY) && left >= at + 4) {
+				v->gre_has_key = 1;
+				v->gre_key = ((uint32_t)g[at] << 24) |
+					(g[at + 1] << 16) | (g[at + 2] << 8) |
+					g[at + 3];
+			}
+			type = v->gre_proto;
+			next = trace_get_payload_from_gre(l4, &left);
+			if (next && type == 0x6558)
+				next = trace_get_payload_from_layer2(next,
+						TRACE_TYPE_ETH, &type, &left);
+		} else if (proto == TRACE_IPPROTO_UDP &&
+				v->inner.l4 == TRACE_IPPROTO_UDP) {
+			libtrace_vxlan_t *vx = trace_get_vxlan_from_udp(l4,
+					&left);
+
+			if (!vx)
+				break;
+			v->vxlan = 1;
+			v->vni = (vx->vni[0] << 16) | (vx->vni[1] << 8) |
+				vx->vni[2];
+			next = trace_get_payload_from_vxlan(vx, &left);
+			if (next)
+				next = trace_get_payload_from_layer2(next,
+						TRACE_TYPE_ETH, &type, &left);
+		} else if (proto == TRACE_IPPROTO_IPIP) {
+			next = l4;
+			type = TRACE_ETHERTYPE_IP;
+		} else if (proto == TRACE_IPPROTO_IPV6) {
+			next = l4;
+			type = TRACE_ETHERTYPE_IPV6;
+		}
+		if (!next)
+			break;
+
+		l4 = fill_layer(&inner, next, type, left, &proto, &left);
+		if (!inner.ip)
+			break;
+		v->inner = inner;
+		v->depth++;
+	}
+}
+
+static int addr_in(const struct layer *l, const uint8_t *addr, int version,
+		const uint8_t *net, int len)
+{
+	int bytes = len / 8, bits = len % 8;
+
+	if (l->ip != version || memcmp(addr, net, bytes) != 0)
+		return 0;
+	if (bits == 0)
+		return 1;
+	return ((addr[bytes] ^ net[bytes]) & (0xff00 >> bits)) == 0;
+}
+"""
+
+_FUNCTIONS = r"""
+static int predicate(const struct view *v)
+{
+	return %s;
+}
+
+int pytrace_predicate_match(const libtrace_packet_t *packet)
+{
+	struct view v;
+
+	decode(packet, &v);
+	return predicate(&v);
+}
+
+int pytrace_predicate_batch(libtrace_packet_t **packets, int count,
+		uint8_t *out)
+{
+	struct view v;
+	int i, n = 0;
+
+	for (i = 0; i < count; i++) {
+		decode(packets[i], &v);
+		out[i] = predicate(&v);
+		n += out[i];
+	}
+	return n;
+}
+"""
+
+_CDEF = """
+typedef struct libtrace_packet_t libtrace_packet_t;
+int pytrace_predicate_match(const libtrace_packet_t *packet);
+int pytrace_predicate_batch(libtrace_packet_t **packets, int count,
+                            uint8_t *out);
+"""
+
+_TOKEN = re.compile(r"""\s*(?:
+    (?P<op>==|!=|<=|>=|<|>|&|\(|\)|\[|\]|,)
+  | (?P<addr>[0-9a-fA-F:]*:[0-9a-fA-F:.]*(?:/\d+)?
+           |\d+\.\d+\.\d+\.\d+(?:/\d+)?)
+  | (?P<num>0[xX][0-9a-fA-F]+|\d+)
+  | (?P<name>[A-Za-z_][A-Za-z0-9_.]*)
+)""", re.VERBOSE)
+
+
+class PredicateError(ValueError):
+    """Raised for an expression that cannot be compiled."""
+
+
+def _tokenize(expr):
+    tokens = []
+    pos = 0
+    expr = expr.rstrip()
+    while pos < len(expr):
+        m = _TOKEN.match(expr, pos)
+        if m is None or m.end() == pos:
+            raise PredicateError("unexpected %r in predicate"
+                                 % (expr[pos:].strip()[:20], ))
+        kind = m.lastgroup
+        tokens.append((kind, m.group(kind)))
+        pos = m.end()
+    return tokens
+
+
+def _parse_net(text):
+    addr, _, length = text.partition("/")
+    for version, family, bits in ((4, socket.AF_INET, 32),
+                                  (6, socket.AF_INET6, 128)):
+        try:
+            packed = socket.inet_pton(family, addr)
+        except (socket.error, ValueError):
+            continue
+        if length and (not length.isdigit() or int(length) > bits):
+            break
+        return version, bytearray(packed), int(length) if length else bits
+    raise PredicateError("bad address %r" % (text, ))
+
+
+class _Compiler(object):
+    """Recursive descent from tokens to a C expression."""
+
+    def __init__(self, expr):
+        self.tokens = _tokenize(expr)
+        self.pos = 0
+        self.constants = []
+
+    def peek(self):
+        if self.pos < len(self.tokens):
+            return self.tokens[self.pos]
+        return (None, None)
+
+    def take(self, value=None):
+        token = self.peek()
+        if token[0] is None or (value is not None and token[1] != value):
+            raise PredicateError("expected %s" % (value or "more input", ))
+        self.pos += 1
+        return token
+
+    def compile(self):
+        code = self.disjunction()
+        if self.peek()[0] is not None:
+            raise PredicateError("unexpected %r" % (self.peek()[1], ))
+        return code
+
+    def disjunction(self):
+        parts = [self.conjunction()]
+        while self.peek() == ("name", "or"):
+            self.take()
+            parts.append(self.conjunction())
+        return parts[0] if len(parts) == 1 else \
+            "(%s)" % " || ".join(parts)
+
+    def conjunction(self):
+        parts = [self.negation()]
+        while self.peek() == ("name", "and"):
+            self.take()
+            parts.append(self.negation())
+        return parts[0] if len(parts) == 1 else \
+            "(%s)" % " && ".join(parts)
+
+    def negation(self):
+        if self.peek() == ("name", "not"):
+            self.take()
+            return "!(%s)" % self.negation()
+        return self.test()
+
+    def number(self):
+        kind, value = self.take()
+        if kind == "num":
+            return int(value, 0)
+        if kind == "name" and value in _TCP_FLAGS:
+            return _TCP_FLAGS[value]
+        raise PredicateError("expected a number, not %r" % (value, ))
+
+    def test(self):
+        kind, name = self.take()
+        if (kind, name) == ("op", "("):
+            code = self.disjunction()
+            self.take(")")
+            return code
+        if kind != "name":
+            raise PredicateError("expected a field, not %r" % (name, ))
+
+        layer = "v->outer"
+        if name.startswith("inner."):
+            layer = "v->inner"
+            name = name[len("inner."):]
+
+        if name in _ADDRESS_FIELDS:
+            return self.address(layer, _ADDRESS_FIELDS[name])
+        if name in _LAYER_FIELDS:
+            value, present = _LAYER_FIELDS[name]
+            return self.compare(value.replace("L.", layer + "."),
+                                present.replace("L.", layer + "."))
+        if name in _LAYER_PRESENCE:
+            return _LAYER_PRESENCE[name].replace("L.", layer + ".")
+        if layer == "v->outer" and name in _PACKET_FIELDS:
+            return self.compare(*_PACKET_FIELDS[name])
+        if layer == "v->outer" and name in _PACKET_PRESENCE:
+            return _PACKET_PRESENCE[name]
+        raise PredicateError("unknown field %r" % (name, ))
+
+    def compare(self, value, present):
+        kind, op = self.take()
+        if op == "in":
+            self.take("[")
+            values = [self.number()]
+            while self.peek() == ("op", ","):
+                self.take()
+                values.append(self.number())
+            self.take("]")
+            test = " || ".join("%s == %du" % (value, v) for v in values)
+        elif op == "&":
+            test = "(%s & %du) != 0" % (value, self.number())
+        elif kind == "op" and op in ("==", "!=", "<", "<=", ">", ">="):
+            test = "%s %s %du" % (value, op, self.number())
+        else:
+            raise PredicateError("expected a comparison, not %r" % (op, ))
+        return "(%s && (%s))" % (present, test)
+
+    def constant(self, packed):
+        self.constants.append(packed)
+        return "net%d" % (len(self.constants) - 1)
+
+    def address(self, layer, field):
+        kind, op = self.take()
+        if op == "in" and self.peek() == ("op", "["):
+            self.take()
+            nets = [self.take()[1]]
+            while self.peek() == ("op", ","):
+                self.take()
+                nets.append(self.take()[1])
+            self.take("]")
+        elif op in ("in", "==", "!="):
+            nets = [self.take()[1]]
+        else:
+            raise PredicateError("expected ==, != or in, not %r" % (op, ))
+
+        tests = []
+        for net in nets:
+            version, packed, length = _parse_net(net)
+            if op != "in" and "/" in net:
+                raise PredicateError("use 'in' to match a prefix")
+            tests.append("addr_in(&%s, %s.%s, %d, %s, %d)" % (
+                layer, layer, field, version, self.constant(packed),
+                length))
+        test = "(%s)" % " || ".join(tests)
+        if op == "!=":
+            # Like the other fields, there is no match without the layer
+            return "(%s.ip && !%s)" % (layer, test)
+        return test
+
+
+def _generate(expr):
+    compiler = _Compiler(expr)
+    body = compiler.compile()
+    lines = [_PRELUDE]
+    for i, packed in enumerate(compiler.constants):
+        packed = packed + bytearray(16 - len(packed))
+        lines.append("static const uint8_t net%d[16] = {%s};"
+                     % (i, ", ".join(str(b) for b in packed)))
+    lines.append(_FUNCTIONS % body)
+    return "\n".join(lines)
+
+
+def cache_dir():
+    """Where compiled predicates are kept: $PYTRACE_CACHE_DIR, or
+    ~/.cache/pytrace/predicates."""
+    path = os.environ.get("PYTRACE_CACHE_DIR")
+    if not path:
+        path = os.path.join(os.path.expanduser("~"), ".cache", "pytrace",
+                            "predicates")
+    return path
+
+
+def _load_extension(name, path):
+    spec = importlib.util.spec_from_file_location(name, path)
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+    return module
+
+
+_modules = {}
+
+
+def _build(source):
+    """Compile (or find in the cache) the module for some generated C."""
+    digest = hashlib.sha1(("%d\n%s" % (_CODE_VERSION, source))
+                          .encode("utf-8")).hexdigest()[:20]
+    name = "_pytrace_pred_" + digest
+    if name in _modules:
+        return _modules[name]
+
+    directory = cache_dir()
+    for suffix in importlib.machinery.EXTENSION_SUFFIXES:
+        path = os.path.join(directory, name + suffix)
+        if os.path.exists(path):
+            break
+    else:
+        try:
+            os.makedirs(directory)
+        except OSError as e:
+            if e.errno != errno.EEXIST:
+                raise
+        # Build in a directory of our own and rename the result into place,
+        # so that other processes never load a half-written module
+        tmpdir = tempfile.mkdtemp(prefix=name + ".", dir=directory)
+        try:
+            builder = FFI()
+            builder.cdef(_CDEF)
+            builder.set_source(name, source, libraries=["trace"])
+            built = builder.compile(tmpdir=tmpdir)
+            path = os.path.join(directory, os.path.basename(built))
+            os.rename(built, path)
+        finally:
+            shutil.rmtree(tmpdir, ignore_errors=True)
+
+    module = _modules[name] = _load_extension(name, path)
+    return module
+
+
+class Predicate(object):
+    """A compiled predicate; see the module documentation for the syntax."""
+
+    def __init__(self, expr):
+        self.expr = expr
+        self.source = _generate(expr)
+        self._module = _build(self.source)
+
+        # Hand the native entry point to pytrace._trace through an integer,
+        # since the two extension modules have separate FFI instances.
+        mffi, mlib = self._module.ffi, self._module.lib
+        address = mffi.cast("uintptr_t",
+                            mffi.addressof(mlib, "pytrace_predicate_match"))
+        match = ffi.cast("int (*)(const libtrace_packet_t *)", int(address))
+        f = lib.pytrace_filter_from_function(match)
+        if f == ffi.NULL:
+            raise MemoryError("Could not allocate filter")
+        self._filter = ffi.gc(f, lib.pytrace_filter_destroy)
+        self._out = None
+
+    def matches(self, batch):
+        """Test every packet of a PacketBatch; returns a list of bools."""
+        mffi = self._module.ffi
+        count = len(batch)
+        if self._out is None or len(self._out) < batch.capacity:
+            self._out = mffi.new("uint8_t[]", batch.capacity)
+        packets = mffi.cast("libtrace_packet_t **",
+                            int(ffi.cast("uintptr_t", batch._batch.packets)))
+        self._module.lib.pytrace_predicate_batch(packets, count, self._out)
+        return [bool(x) for x in self._out[0:count]]
+
+    def select(self, batch):
+        """The Packets of a PacketBatch that match."""
+        return [packet for packet, hit in zip(batch, self.matches(batch))
+                if hit]
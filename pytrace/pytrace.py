@@ -1,8 +1,970 @@
+import binascii
+import collections
+import os
+import socket
+import sys
+import weakref
+
+# Packet views rely on memoryview.toreadonly(), so that nothing can write
+# into libtrace's buffers or a mapped pcap file through them.
+if sys.version_info < (3, 8):
+    raise ImportError("pytrace needs Python 3.8 or later")
+
 from _trace import ffi, lib
 
+# Suffix of the sidecar time index kept next to a pcap file
+TIME_INDEX_SUFFIX = ".tidx"
 
-class Trace(object):
-    def __init__(self, uri):
+# Default PacketBatch.retain_headers limit: enough for Ethernet, a VLAN tag,
+# IPv6 and a TCP header with options
+MAX_HEADER = 128
+
+
+# Column name -> (PYTRACE_COL_* flag, C element type, NumPy dtype)
+COLUMNS = {
+    "timestamp": (lib.PYTRACE_COL_TIMESTAMP, "uint64_t", "u8"),
+    "wire_length": (lib.PYTRACE_COL_WIRE_LENGTH, "uint32_t", "u4"),
+    "capture_length": (lib.PYTRACE_COL_CAPTURE_LENGTH, "uint32_t", "u4"),
+    "ip_version": (lib.PYTRACE_COL_IP_VERSION, "uint8_t", "u1"),
+    "src_ip": (lib.PYTRACE_COL_SRC_IP, "uint32_t", "u4"),
+    "dst_ip": (lib.PYTRACE_COL_DST_IP, "uint32_t", "u4"),
+    "src_port": (lib.PYTRACE_COL_SRC_PORT, "uint16_t", "u2"),
+    "dst_port": (lib.PYTRACE_COL_DST_PORT, "uint16_t", "u2"),
+    "proto": (lib.PYTRACE_COL_PROTO, "uint8_t", "u1"),
+    "tcp_flags": (lib.PYTRACE_COL_TCP_FLAGS, "uint8_t", "u1"),
+    "src_addr": (lib.PYTRACE_COL_SRC_ADDR, "uint8_t[16]", ("u1", (16, ))),
+    "dst_addr": (lib.PYTRACE_COL_DST_ADDR, "uint8_t[16]", ("u1", (16, ))),
+    "vlan": (lib.PYTRACE_COL_VLAN, "uint16_t", "u2"),
+    "tunnel_type": (lib.PYTRACE_COL_TUNNEL_TYPE, "uint8_t", "u1"),
+    "tunnel_id": (lib.PYTRACE_COL_TUNNEL_ID, "uint32_t", "u4"),
+}
+
+# The columns of PacketSource.to_arrow by default. src_ip and dst_ip are
+# left out, as src_addr and dst_addr cover IPv6 too.
+ARROW_COLUMNS = [
+    "timestamp", "wire_length", "capture_length", "ip_version", "src_addr",
+    "dst_addr", "src_port", "dst_port", "proto", "tcp_flags", "vlan",
+    "tunnel_type", "tunnel_id",
+]
+
+
+# A flow reported by PacketSource.flows. Addresses are packed bytes (4 or 16
+# long); first and last are timestamps in seconds.
+Flow = collections.namedtuple("Flow", [
+    "ip_version", "src", "dst", "src_port", "dst_port", "proto",
+    "packets", "bytes", "first", "last",
+])
+
+# A run of reassembled bytes from one direction of a TCP connection, as
+# passed to the PacketSource.tcp_streams callback. stream is a number unique
+# to the direction; flags is a mask of the TCP_* values below; data is a
+# read-only memoryview; ts is the time of the latest segment in seconds.
+TcpChunk = collections.namedtuple("TcpChunk", [
+    "stream", "ip_version", "src", "dst", "src_port", "dst_port",
+    "flags", "ts", "data",
+])
+
+# The result of Packet.decap. Offsets are from the start of the packet's
+# layer2() view, or None; encaps lists (type, id, offset) outermost first,
+# with type one of the ENCAP_* names below.
+Decap = collections.namedtuple("Decap", [
+    "outer_l3", "inner_l3", "inner_l4", "encaps",
+    "ip_version", "src", "dst", "src_port", "dst_port", "proto",
+])
+
+# Offset of a missing layer in pytrace_layers_t
+LAYER_NONE = lib.PYTRACE_DECAP_NONE
+
+ENCAP_TYPES = {
+    lib.PYTRACE_ENCAP_VLAN: "vlan",
+    lib.PYTRACE_ENCAP_MPLS: "mpls",
+    lib.PYTRACE_ENCAP_PPPOE: "pppoe",
+    lib.PYTRACE_ENCAP_GRE: "gre",
+    lib.PYTRACE_ENCAP_VXLAN: "vxlan",
+    lib.PYTRACE_ENCAP_IPIP: "ipip",
+}
+
+# Key types for PacketSource.windows
+WINDOW_KEYS = {
+    "total": lib.PYTRACE_WINDOW_TOTAL,
+    "proto": lib.PYTRACE_WINDOW_PROTO,
+    "src_port": lib.PYTRACE_WINDOW_SRC_PORT,
+    "dst_port": lib.PYTRACE_WINDOW_DST_PORT,
+    "port": lib.PYTRACE_WINDOW_PORT,
+}
+
+# The key of packets without a transport header in PacketSource.windows
+WINDOW_OTHER = lib.PYTRACE_WINDOW_OTHER
+
+TCP_START = lib.PYTRACE_TCP_START
+TCP_GAP = lib.PYTRACE_TCP_GAP
+TCP_TRUNCATED = lib.PYTRACE_TCP_TRUNCATED
+TCP_FIN = lib.PYTRACE_TCP_FIN
+TCP_RST = lib.PYTRACE_TCP_RST
+TCP_CLOSED = lib.PYTRACE_TCP_CLOSED
+
+
+def _erf_to_seconds(ts):
+    return ts / float(1 << 32)
+
+
+def _column_mask(fields):
+    mask = 0
+    for name in fields:
+        if name not in COLUMNS:
+            raise ValueError("unknown column %r" % (name, ))
+        mask |= COLUMNS[name][0]
+    return mask
+
+
+def _detach_column(cols, name):
+    """Take an array out of a pytrace_columns_t, so that it is no longer
+    freed with it. Returns the array, now freed on garbage collection, and
+    its size in bytes."""
+    ptr = ffi.gc(getattr(cols, name), lib.pytrace_free)
+    setattr(cols, name, ffi.NULL)
+    return ptr, cols.count * ffi.sizeof(COLUMNS[name][1])
+
+
+def _arrow_types():
+    import pyarrow
+    return {
+        "timestamp": pyarrow.timestamp("ns", tz="UTC"),
+        "wire_length": pyarrow.uint32(),
+        "capture_length": pyarrow.uint32(),
+        "ip_version": pyarrow.uint8(),
+        "src_ip": pyarrow.uint32(),
+        "dst_ip": pyarrow.uint32(),
+        "src_port": pyarrow.uint16(),
+        "dst_port": pyarrow.uint16(),
+        "proto": pyarrow.uint8(),
+        "tcp_flags": pyarrow.uint8(),
+        "src_addr": pyarrow.binary(16),
+        "dst_addr": pyarrow.binary(16),
+        "vlan": pyarrow.uint16(),
+        "tunnel_type": pyarrow.uint8(),
+        "tunnel_id": pyarrow.uint32(),
+    }
+
+
+class TraceError(Exception):
+    """Raised when libtrace reports an error on a trace."""
+
+    @classmethod
+    def from_trace(cls, trace):
+        err = lib.trace_get_err(trace)
+        return cls(err.err_num, ffi.string(err.problem))
+
+    @classmethod
+    def from_output(cls, out):
+        err = lib.trace_get_err_output(out)
+        return cls(err.err_num, ffi.string(err.problem))
+
+    @classmethod
+    def from_reader(cls, reader):
+        error = ffi.string(reader.error)
+        if reader.trace != ffi.NULL and not error:
+            return cls.from_trace(reader.trace)
+        return cls(-1, error)
+
+
+def _pcap_path(uri):
+    """The file behind a pcapfile: URI (or a bare path), else None."""
+    if uri.startswith("pcapfile:"):
+        return uri[len("pcapfile:"):]
+    if ":" not in uri:
+        return uri
+    return None
+
+
+def build_time_index(path, interval=10000, index_path=None):
+    """Write a sidecar time index for an uncompressed pcap file.
+
+    The index records the timestamp and file offset of every interval-th
+    packet, and is what lets Trace.seek find a point in time with a binary
+    search rather than reading the whole file up to it. Returns the number
+    of checkpoints written.
+    """
+    if index_path is None:
+        index_path = path + TIME_INDEX_SUFFIX
+    error = ffi.new("char[256]")
+    count = lib.pytrace_tindex_build(path, index_path, interval, error)
+    if count < 0:
+        raise TraceError(-1, ffi.string(error))
+    return count
+
+
+class StalePacketError(Exception):
+    """Raised when a Packet is used after its owner has read into it again."""
+
+
+def _view(owner, ptr, length):
+    # The no-op destructor closes over owner, so the memoryview (through the
+    # cdata it wraps) keeps the packet's owner, and hence its buffer, alive.
+    ptr = ffi.gc(ptr, lambda _, owner=owner: None)
+    return memoryview(ffi.buffer(ptr, length)).toreadonly()
+
+
+class Packet(object):
+    """A view of one libtrace packet.
+
+    The underlying libtrace_packet_t belongs to whoever created this object
+    (usually a PacketBatch), and is only valid until that owner reads into
+    it again. After that, using the Packet raises StalePacketError.
+
+    The memoryview accessors (buffer, layer2, layer3, transport) point
+    straight into the packet's buffer without copying. A view keeps the
+    buffer allocated, but its contents are undefined once the owner has
+    read into the packet again; use bytes(view) to keep the data longer.
+    """
+
+    def __init__(self, pkt, owner=None):
+        self._pkt = pkt
+        self._owner = owner
+        self._generation = owner._generation if owner is not None else 0
+
+    def _check(self):
+        owner = self._owner
+        if owner is not None and owner._generation != self._generation:
+            raise StalePacketError("packet has been overwritten by a later "
+                                   "read")
+        return self._pkt
+
+    @property
+    def valid(self):
+        owner = self._owner
+        return owner is None or owner._generation == self._generation
+
+    def buffer(self):
+        """The captured bytes, starting from the first (link) header."""
+        pkt = self._check()
+        linktype = ffi.new("libtrace_linktype_t *")
+        remaining = ffi.new("uint32_t *")
+        ptr = lib.trace_get_packet_buffer(pkt, linktype, remaining)
+        if ptr == ffi.NULL:
+            return None
+        return _view(self._owner, ptr, remaining[0])
+
+    def layer2(self):
+        """The link layer header and everything after it, or None."""
+        pkt = self._check()
+        linktype = ffi.new("libtrace_linktype_t *")
+        remaining = ffi.new("uint32_t *")
+        ptr = lib.trace_get_layer2(pkt, linktype, remaining)
+        if ptr == ffi.NULL:
+            return None
+        return _view(self._owner, ptr, remaining[0])
+
+    def layer3(self):
+        """The network layer header and everything after it, or None."""
+        pkt = self._check()
+        ethertype = ffi.new("uint16_t *")
+        remaining = ffi.new("uint32_t *")
+        ptr = lib.trace_get_layer3(pkt, ethertype, remaining)
+        if ptr == ffi.NULL:
+            return None
+        return _view(self._owner, ptr, remaining[0])
+
+    def transport(self):
+        """The transport header and everything after it, or None."""
+        pkt = self._check()
+        proto = ffi.new("uint8_t *")
+        remaining = ffi.new("uint32_t *")
+        ptr = lib.trace_get_transport(pkt, proto, remaining)
+        if ptr == ffi.NULL:
+            return None
+        return _view(self._owner, ptr, remaining[0])
+
+    @property
+    def erf_timestamp(self):
+        return lib.trace_get_erf_timestamp(self._check())
+
+    @property
+    def seconds(self):
+        return lib.trace_get_seconds(self._check())
+
+    @property
+    def capture_length(self):
+        return lib.trace_get_capture_length(self._check())
+
+    @property
+    def wire_length(self):
+        return lib.trace_get_wire_length(self._check())
+
+    @property
+    def link_type(self):
+        return lib.trace_get_link_type(self._check())
+
+    def parse_layers(self):
+        """Locate every layer in one native call.
+
+        Returns a pytrace_layers_t struct whose fields (l2, l3, l4,
+        payload and their *_remaining lengths, ethertype, proto, ...) are
+        plain attributes. Offsets index into buffer(); missing layers have
+        the offset LAYER_NONE.
+        """
+        out = ffi.new("pytrace_layers_t *")
+        lib.pytrace_parse_layers(self._check(), out)
+        return out
+
+    def decap(self):
+        """Unwrap every tunnel and tag in one native call; see Decap."""
+        out = ffi.new("pytrace_decap_t *")
+        lib.pytrace_decap(self._check(), out)
+        return _decap(out[0])
+
+
+class PacketBatch(object):
+    """A set of preallocated packets filled in one call by Trace.read_batch.
+
+    Every fill overwrites the packets of the previous one, so Packet objects
+    taken from a batch go stale once the batch is passed back to
+    Trace.read_batch.
+    """
+
+    def __init__(self, capacity):
+        if capacity <= 0:
+            raise ValueError("capacity must be positive (got %r)"
+                             % (capacity, ))
+
+        batch = lib.pytrace_batch_create(capacity)
+        if batch == ffi.NULL:
+            raise MemoryError("Could not allocate packet batch")
+        self._batch = ffi.gc(batch, lib.pytrace_batch_destroy)
+        # Bumped on every fill so Packets can tell they have gone stale.
+        self._generation = 0
+
+    @classmethod
+    def _wrap(cls, batch, owner):
+        """Wrap a batch owned by some other native object (owner)."""
+        self = cls.__new__(cls)
+        self._batch = batch
+        self._owner = owner
+        self._generation = 0
+        return self
+
+    @property
+    def capacity(self):
+        return self._batch.capacity
+
+    def __len__(self):
+        return self._batch.count
+
+    def __getitem__(self, index):
+        count = self._batch.count
+        if index < 0:
+            index += count
+        if not 0 <= index < count:
+            raise IndexError("packet index out of range")
+        return Packet(self._batch.packets[index], self)
+
+    def __iter__(self):
+        packets = self._batch.packets
+        for i in range(self._batch.count):
+            yield Packet(packets[i], self)
+
+    def parse_layers(self, out=None):
+        """Packet.parse_layers for every packet, in a single call.
+
+        Returns a cdata array of pytrace_layers_t whose first len(self)
+        entries are filled. Passing back a previous result reuses it when
+        it is big enough.
+        """
+        count = self._batch.count
+        if out is None or len(out) < count:
+            out = ffi.new("pytrace_layers_t[]", max(count, 1))
+        lib.pytrace_parse_layers_batch(self._batch, out)
+        return out
+
+    def decap(self):
+        """Packet.decap for every packet, decoded in a single call."""
+        count = self._batch.count
+        if not count:
+            return []
+        out = ffi.new("pytrace_decap_t[]", count)
+        lib.pytrace_decap_batch(self._batch, out)
+        return [_decap(out[i]) for i in range(count)]
+
+    def retain_headers(self, max_header=MAX_HEADER):
+        """Keep the headers of every packet past the next fill.
+
+        Returns a RetainedPacket per packet. The headers (everything before
+        the transport payload, at most max_header bytes of it) are copied
+        natively into a single buffer shared by the whole batch, so keeping
+        them costs a small fraction of a copied packet.
+        """
+        count = self._batch.count
+        if not count:
+            return []
+        out = ffi.new("pytrace_header_t[]", count)
+        arena = ffi.new("unsigned char[]", count * max_header)
+        used = lib.pytrace_copy_headers(self._batch, out, arena, max_header)
+        # One copy of the used part; every packet is a view into it
+        data = memoryview(ffi.buffer(arena, used)[:])
+        ref = weakref.ref(self)
+        packets = self._batch.packets
+        return [RetainedPacket(out[i], data, packets[i], ref, self._generation)
+                for i in range(count)]
+
+
+class RetainedPacket(object):
+    """The headers and metadata of a packet, kept after its batch moves on.
+
+    headers is a read-only view of the copied bytes, starting from the
+    first (link) header like Packet.buffer. The rest of the capture is
+    only available from payload(), and only until the batch the packet
+    came from reads into it again; after that it raises StalePacketError.
+    Holding a RetainedPacket does not keep that batch alive.
+    """
+
+    # Many of these are kept at once, so skip the per-instance dict.
+    __slots__ = ("headers", "erf_timestamp", "capture_length",
+                 "wire_length", "link_type", "_pkt", "_owner",
+                 "_generation")
+
+    def __init__(self, header, data, pkt, owner, generation):
+        self.headers = data[header.offset:header.offset + header.length]
+        self.erf_timestamp = header.timestamp
+        self.capture_length = header.capture_length
+        self.wire_length = header.wire_length
+        self.link_type = header.link_type
+        self._pkt = pkt
+        self._owner = owner
+        self._generation = generation
+
+    @property
+    def seconds(self):
+        return _erf_to_seconds(self.erf_timestamp)
+
+    @property
+    def complete(self):
+        """True if headers holds the whole capture."""
+        return len(self.headers) == self.capture_length
+
+    @property
+    def valid(self):
+        owner = self._owner()
+        return owner is not None and owner._generation == self._generation
+
+    def packet(self):
+        """The original Packet, while it has not been overwritten."""
+        owner = self._owner()
+        if owner is None or owner._generation != self._generation:
+            raise StalePacketError(
+                "packet has been overwritten by a later read")
+        return Packet(self._pkt, owner)
+
+    def payload(self):
+        """The captured bytes after headers, as a view into the original
+        packet's buffer."""
+        if self.complete:
+            return memoryview(b"")
+        return self.packet().buffer()[len(self.headers):]
+
+
+class PacketSource(object):
+    """Batched and columnar reading, shared by every kind of input.
+
+    Subclasses provide start(), which must leave a native reader in
+    self._reader.
+    """
+
+    def __init__(self):
+        pkt = lib.trace_create_packet()
+        if pkt == ffi.NULL:
+            raise MemoryError("Could not allocate packet")
+        self._pkt = ffi.gc(pkt, lib.trace_destroy_packet)
+
+        self._reader = None
+        self._readahead = None
+        # A read running in an asyncio executor; see aio.aiter
+        self._pending = None
+        self._filter = ffi.NULL
+        self._sampler = ffi.NULL
+
+    def start(self):
+        raise NotImplementedError
+
+    def _set_reader(self, reader):
+        self._reader = ffi.gc(reader, lib.pytrace_reader_destroy)
+        self._reader.filter = self._filter
+        self._reader.sampler = self._sampler
+
+    def set_filter(self, expr):
+        """Only return packets matching a BPF filter expression.
+
+        The filter runs inside the native read loop, so rejected packets
+        never reach Python. Compiled filters are cached process-wide by
+        expression. expr may also be a predicate.Predicate. None removes
+        the filter.
+        """
+        # Keeps a Predicate (and so its native code) alive while in use
+        self._filter_owner = expr
+        if expr is None:
+            self._filter = ffi.NULL
+        elif hasattr(expr, "_filter"):
+            self._filter = expr._filter
+        else:
+            self._filter = lib.pytrace_filter_get(expr)
+            if self._filter == ffi.NULL:
+                raise MemoryError("Could not allocate filter")
+        if self._reader is not None:
+            self._reader.filter = self._filter
+
+    def set_sampling(self, rate, flows=False, seed=0):
+        """Keep only 1 in rate packets, or the packets of 1 in rate flows.
+
+        Sampling happens in the native read loop, after any filter, so
+        dropped packets never reach Python. Packet sampling keeps every
+        rate-th packet, starting from the one chosen by seed. Flow sampling
+        keeps whole flows (both directions) picked by a symmetric hash of
+        the 5-tuple, so every tap using the same seed picks the same
+        flows; packets that are not IP are dropped. A rate of None or 1
+        turns sampling off.
+        """
+        if rate is None or rate == 1:
+            self._sampler = ffi.NULL
+        else:
+            if rate <= 0:
+                raise ValueError("rate must be positive (got %r)" % (rate, ))
+            if flows:
+                mode = lib.PYTRACE_SAMPLE_FLOWS
+            else:
+                mode = lib.PYTRACE_SAMPLE_PACKETS
+            self._sampler = ffi.new("pytrace_sampler_t *")
+            lib.pytrace_sampler_init(self._sampler, mode, rate, seed)
+        if self._reader is not None:
+            self._reader.sampler = self._sampler
+
+    @property
+    def sampled(self):
+        """(seen, kept) packet counts of the current sampling, or None."""
+        if self._sampler == ffi.NULL:
+            return None
+        return (self._sampler.seen, self._sampler.kept)
+
+    def _check_idle(self):
+        if self._readahead is not None:
+            raise RuntimeError("trace is owned by a read-ahead thread")
+        if self._pending is not None and not self._pending.done():
+            raise RuntimeError("trace is still being read by an executor")
+
+    def read_batch(self, n=1024, batch=None):
+        """Read up to n packets with a single call into libtrace.
+
+        Passing back the batch returned by a previous call reuses its
+        packets instead of allocating new ones. An empty batch means the
+        end of the trace has been reached.
+        """
+        if batch is None:
+            batch = PacketBatch(n)
+        self._check_idle()
+        self.start()
+        batch._generation += 1
+        # Packets refer back to state owned by the source (the libtrace
+        # trace, a pcap mapping, the inputs of a merge...).
+        batch._source = self
+        count = lib.pytrace_read_batch(self._reader, batch._batch)
+        if count == 0 and batch._batch.status < 0:
+            raise TraceError.from_reader(self._reader)
+        return batch
+
+    def batches(self, n=1024, readahead=0):
+        """Iterate over the whole trace one reused PacketBatch at a time.
+
+        With readahead > 0, a native thread keeps up to that many batches
+        filled in the background (without holding the GIL), which overlaps
+        decompression inside libtrace with the caller's processing. Each
+        yielded batch goes stale when the next one is requested.
+
+        If iteration with readahead stops before the end of the trace, the
+        batches already read ahead are dropped, so a later read resumes up
+        to readahead batches past the last packet yielded.
+        """
+        if readahead > 0:
+            for batch in self._readahead_batches(n, readahead):
+                yield batch
+            return
+
+        batch = PacketBatch(n)
+        while True:
+            self.read_batch(batch=batch)
+            if not len(batch):
+                return
+            yield batch
+
+    def aiter(self, yield_every=64):
+        """Iterate over the trace from asyncio: async for pkt in aiter().
+
+        Live inputs are waited on through trace_event and the event loop
+        rather than by blocking, so many captures can share one loop.
+        Other sources are read in the loop's executor. See the aio module.
+        """
+        from aio import aiter
+        return aiter(self, yield_every)
+
+    def _readahead_batches(self, n, depth):
+        self._check_idle()
+        self.start()
+        ra = lib.pytrace_readahead_start(self._reader, depth, n)
+        if ra == ffi.NULL:
+            raise MemoryError("Could not start read-ahead")
+        ra = ffi.gc(ra, lib.pytrace_readahead_destroy)
+        self._readahead = ra
+
+        wrappers = {}
+        try:
+            while True:
+                ptr = lib.pytrace_readahead_next(ra)
+                if ptr.count == 0:
+                    if ptr.status < 0:
+                        raise TraceError.from_reader(self._reader)
+                    return
+                key = int(ffi.cast("uintptr_t", ptr))
+                batch = wrappers.get(key)
+                if batch is None:
+                    batch = wrappers[key] = PacketBatch._wrap(ptr, ra)
+                    batch._source = self
+                batch._generation += 1
+                yield batch
+        finally:
+            lib.pytrace_readahead_stop(ra)
+            self._readahead = None
+
+    def to_columns(self, fields=None, limit=0):
+        """Decode the rest of the trace into a dict of NumPy arrays.
+
+        fields is a list of names from COLUMNS (all of them by default).
+        The whole pass runs in C; the arrays it fills are handed to NumPy
+        without copying. limit caps the number of packets decoded.
+        """
+        import numpy
+
+        if fields is None:
+            fields = sorted(COLUMNS)
+        mask = _column_mask(fields)
+
+        self._check_idle()
+        cols = lib.pytrace_columns_create(mask, 0)
+        if cols == ffi.NULL:
+            raise MemoryError("Could not allocate columns")
+        cols = ffi.gc(cols, lib.pytrace_columns_destroy)
+
+        self.start()
+        status = lib.pytrace_columns_read(self._reader, self._pkt, cols, limit)
+        if status == -1:
+            raise TraceError.from_reader(self._reader)
+        if status == -2:
+            raise MemoryError("Could not grow columns")
+
+        result = {}
+        for name in fields:
+            if name in result:
+                continue
+            # Detach the array so the NumPy array owns it from now on.
+            ptr, size = _detach_column(cols, name)
+            result[name] = numpy.frombuffer(ffi.buffer(ptr, size),
+                                            dtype=COLUMNS[name][2])
+        return result
+
+    def to_arrow(self, fields=None, rows=1 << 20):
+        """Decode the rest of the trace into Arrow record batches.
+
+        Yields a pyarrow.RecordBatch for every rows packets (the last may
+        be shorter), with the columns named in fields (ARROW_COLUMNS by
+        default). Decoding runs in C, as for to_columns, and each batch
+        takes over the native arrays it was decoded into without copying,
+        so memory use is bounded by the batches the caller keeps.
+
+        timestamp is a nanosecond UTC timestamp; src_addr and dst_addr are
+        16 byte binaries holding IPv4 as ::ffff:a.b.c.d. Fields a packet
+        does not have are 0 rather than null.
+        """
+        import pyarrow
+
+        if fields is None:
+            fields = ARROW_COLUMNS
+        fields = list(collections.OrderedDict.fromkeys(fields))
+        mask = _column_mask(fields)
+        types = _arrow_types()
+
+        self._check_idle()
+        cols = lib.pytrace_columns_create(mask, rows)
+        if cols == ffi.NULL:
+            raise MemoryError("Could not allocate columns")
+        cols = ffi.gc(cols, lib.pytrace_columns_destroy)
+
+        self.start()
+        while True:
+            status = lib.pytrace_columns_read(self._reader, self._pkt, cols,
+                                              rows)
+            if status == -1:
+                raise TraceError.from_reader(self._reader)
+            if status == -2:
+                raise MemoryError("Could not grow columns")
+
+            count = cols.count
+            if count:
+                arrays = []
+                for name in fields:
+                    ptr, size = _detach_column(cols, name)
+                    if name == "timestamp":
+                        lib.pytrace_erf_to_ns(ptr, count)
+                    buf = pyarrow.foreign_buffer(
+                        int(ffi.cast("uintptr_t", ptr)), size, base=ptr)
+                    arrays.append(pyarrow.Array.from_buffers(
+                        types[name], count, [None, buf]))
+                yield pyarrow.RecordBatch.from_arrays(arrays, names=fields)
+            if status == 0:
+                return
+            if lib.pytrace_columns_reset(cols) == -1:
+                raise MemoryError("Could not allocate columns")
+
+    def to_parquet(self, path, fields=None, row_group_size=1 << 20,
+                   compression="zstd"):
+        """Write the rest of the trace to a Parquet file.
+
+        Each row group holds row_group_size packets, decoded and written
+        one at a time by to_arrow, so a trace of any size converts in
+        constant memory. Returns the number of rows written.
+        """
+        import pyarrow
+        import pyarrow.parquet
+
+        if fields is None:
+            fields = ARROW_COLUMNS
+        fields = list(collections.OrderedDict.fromkeys(fields))
+        _column_mask(fields)
+        types = _arrow_types()
+        schema = pyarrow.schema([(name, types[name]) for name in fields])
+
+        rows = 0
+        with pyarrow.parquet.ParquetWriter(path, schema,
+                                           compression=compression) as w:
+            for batch in self.to_arrow(fields, row_group_size):
+                w.write_batch(batch, row_group_size=row_group_size)
+                rows += batch.num_rows
+        return rows
+
+    def flows(self, idle_timeout=60.0, capacity=65536, chunk=1024):
+        """Aggregate the rest of the input into 5-tuple flows.
+
+        Packets are counted into a native hash table keyed on (source,
+        destination, ports, protocol). A flow is yielded once it has seen no
+        packets for idle_timeout seconds of trace time, and every remaining
+        flow is yielded at the end of the input, oldest first.
+        """
+        self._check_idle()
+        ft = lib.pytrace_flowtable_create(capacity,
+                                          int(idle_timeout * (1 << 32)))
+        if ft == ffi.NULL:
+            raise MemoryError("Could not allocate flow table")
+        ft = ffi.gc(ft, lib.pytrace_flowtable_destroy)
+
+        self.start()
+        out = ffi.new("pytrace_flow_t[]", chunk)
+        status = ffi.new("int *")
+        while True:
+            n = lib.pytrace_flowtable_read(ft, self._reader, self._pkt, out,
+                                           chunk, status)
+            for i in range(n):
+                yield _flow(out[i])
+            if status[0] == -1:
+                raise TraceError.from_reader(self._reader)
+            if status[0] == -2:
+                raise MemoryError("Could not grow flow table")
+            if status[0] == 0:
+                break
+
+        while True:
+            n = lib.pytrace_flowtable_flush(ft, out, chunk)
+            if n == 0:
+                return
+            for i in range(n):
+                yield _flow(out[i])
+
+    def tcp_streams(self, callback, stream_cap=1 << 20, total_cap=1 << 28,
+                    idle_timeout=60.0, packets=4096, chunks=1024):
+        """Reassemble the TCP payload in the rest of the input.
+
+        Each direction of a connection is a separate stream. callback is
+        called with a list of TcpChunk for every batch of up to `packets`
+        packets that produced output; chunks of one stream arrive in
+        sequence order. Segments that arrive early are buffered natively,
+        up to stream_cap bytes per stream and total_cap bytes overall;
+        past either cap the hole is skipped and the next chunk of that
+        stream carries TCP_GAP. A chunk flagged TCP_TRUNCATED lost the end
+        of its segment to the snap length, and the next one carries on
+        after the whole segment. A stream ends with a zero length chunk
+        flagged TCP_FIN, TCP_RST or TCP_CLOSED (idle for idle_timeout
+        seconds, or still open at the end of the input).
+
+        The data views share one buffer per batch and stay valid after the
+        callback returns.
+        """
+        self._check_idle()
+        tcp = lib.pytrace_tcp_create(stream_cap, total_cap,
+                                     int(idle_timeout * (1 << 32)))
+        if tcp == ffi.NULL:
+            raise MemoryError("Could not allocate TCP reassembler")
+        tcp = ffi.gc(tcp, lib.pytrace_tcp_destroy)
+
+        self.start()
+        status = ffi.new("int *")
+        while True:
+            n = lib.pytrace_tcp_read(tcp, self._reader, self._pkt, packets,
+                                     chunks, status)
+            if status[0] == -2:
+                raise MemoryError("Could not buffer TCP segments")
+            if n:
+                callback(_tcp_chunks(tcp, n))
+            if status[0] == -1:
+                raise TraceError.from_reader(self._reader)
+            if status[0] == 0:
+                break
+
+        n = lib.pytrace_tcp_flush(tcp)
+        if n < 0:
+            raise MemoryError("Could not buffer TCP segments")
+        if n:
+            callback(_tcp_chunks(tcp, n))
+
+    def windows(self, width=1.0, step=None, key="total", packets=65536,
+                rows=4096):
+        """Count packets and bytes over fixed windows of trace time.
+
+        Windows are width seconds long and start every step seconds
+        (step defaults to width, giving tumbling windows), aligned to
+        multiples of step. key is one of WINDOW_KEYS: "total" counts
+        every packet under key 0, "proto" counts per IP protocol, and the
+        port keys count per (proto << 16 | port). Packets without a
+        transport header are counted under WINDOW_OTHER.
+
+        The counting runs natively. Closed windows are yielded as NumPy
+        record arrays with fields start and end (ERF timestamps), key,
+        packets and bytes, ordered by time and then key, as reading goes;
+        windows without packets are left out. At the end of the input
+        every open window is closed.
+        """
+        import numpy
+
+        if key not in WINDOW_KEYS:
+            raise ValueError("unknown window key %r" % (key, ))
+        if step is None:
+            step = width
+        # Only step is converted to ERF units, so that a width such as 0.3
+        # is still a whole number of 0.1 steps after rounding
+        slots = round(width / step) if step > 0 else 0
+        if slots < 1 or abs(width / step - slots) > 1e-6 * slots:
+            raise ValueError("width must be a positive multiple of step")
+        step = int(step * (1 << 32))
+        if step <= 0:
+            raise ValueError("step is too small")
+        width = slots * step
+
+        self._check_idle()
+        w = lib.pytrace_windows_create(WINDOW_KEYS[key], width, step)
+        if w == ffi.NULL:
+            raise MemoryError("Could not allocate window aggregator")
+        w = ffi.gc(w, lib.pytrace_windows_destroy)
+
+        dtype = numpy.dtype({
+            "names": ["start", "end", "key", "packets", "bytes"],
+            "formats": ["u8", "u8", "u4", "u8", "u8"],
+            "offsets": [ffi.offsetof("pytrace_window_t", name)
+                        for name in ("start", "end", "key", "packets",
+                                     "bytes")],
+            "itemsize": ffi.sizeof("pytrace_window_t"),
+        })
+
+        def result(n):
+            buf = ffi.buffer(lib.pytrace_windows_rows(w), n * dtype.itemsize)
+            array = numpy.frombuffer(buf, dtype=dtype).copy()
+            return array.view(numpy.recarray)
+
+        self.start()
+        status = ffi.new("int *")
+        while True:
+            n = lib.pytrace_windows_read(w, self._reader, self._pkt, packets,
+                                         rows, status)
+            if status[0] == -2:
+                raise MemoryError("Could not grow window counters")
+            if n:
+                yield result(n)
+            if status[0] == -1:
+                raise TraceError.from_reader(self._reader)
+            if status[0] == 0:
+                break
+
+        n = lib.pytrace_windows_flush(w)
+        if n < 0:
+            raise MemoryError("Could not grow window counters")
+        if n:
+            yield result(n)
+
+
+def _tcp_chunks(tcp, n):
+    length = ffi.new("uint64_t *")
+    data = lib.pytrace_tcp_data(tcp, length)
+    # One copy of the whole batch; every chunk is a view into it
+    data = memoryview(ffi.buffer(data, length[0])[:]) if length[0] else None
+    chunks = lib.pytrace_tcp_chunks(tcp)
+    result = []
+    for i in range(n):
+        c = chunks[i]
+        size = 4 if c.ip_version == 4 else 16
+        if c.length:
+            view = data[c.offset:c.offset + c.length]
+        else:
+            view = memoryview(b"")
+        result.append(TcpChunk(c.stream, c.ip_version,
+                               ffi.buffer(c.src, size)[:],
+                               ffi.buffer(c.dst, size)[:],
+                               c.src_port, c.dst_port, c.flags,
+                               _erf_to_seconds(c.ts), view))
+    return result
+
+
+def _offset(value):
+    return None if value == lib.PYTRACE_DECAP_NONE else value
+
+
+def _decap(d):
+    size = 4 if d.ip_version == 4 else 16 if d.ip_version == 6 else 0
+    encaps = [(ENCAP_TYPES[e.type], e.id, e.offset)
+              for e in d.encaps[0:d.nencaps]]
+    return Decap(_offset(d.outer_l3), _offset(d.inner_l3),
+                 _offset(d.inner_l4), encaps, d.ip_version,
+                 ffi.buffer(d.src, size)[:], ffi.buffer(d.dst, size)[:],
+                 d.src_port, d.dst_port, d.proto)
+
+
+def _flow(f):
+    size = 4 if f.ip_version == 4 else 16
+    return Flow(f.ip_version,
+                ffi.buffer(f.src, size)[:], ffi.buffer(f.dst, size)[:],
+                f.src_port, f.dst_port, f.proto, f.packets, f.bytes,
+                _erf_to_seconds(f.first), _erf_to_seconds(f.last))
+
+
+class Trace(PacketSource):
+    """An input trace.
+
+    With mmap=True, an uncompressed pcap file (a pcapfile: URI or a bare
+    path) is mapped into memory and read natively, so packets point into
+    the page cache instead of being copied into libtrace's 64 KB packet
+    buffers. Other inputs are read through libtrace as usual.
+
+    byte_range=(start, end) restricts reading to the records of a pcap file
+    that start within that range of offsets (see parallel.split_pcap). It
+    implies the native pcap reader.
+
+    snaplen limits how many bytes of each packet are captured (libtrace's
+    TRACE_OPTION_SNAPLEN); the wire length is still reported in full. The
+    native pcap reader skips the rest of each record.
+    """
+
+    def __init__(self, uri, mmap=False, byte_range=None, snaplen=None):
         if not isinstance(uri, str):
             raise TypeError("uri must be string (got %r)" % (uri, ))
 
@@ -11,7 +973,598 @@ class Trace(object):
             raise MemoryError("Could not allocate trace")
         self._trace = ffi.gc(trace, lib.trace_destroy)
 
-        pkt = lib.trace_create_packet()
-        if pkt == ffi.NULL:
-            raise MemoryError("Could not allocate packet")
-        self._pkt = ffi.gc(pkt, lib.trace_destroy_packet)
+        if snaplen is not None:
+            if snaplen <= 0:
+                raise ValueError("snaplen must be positive (got %r)"
+                                 % (snaplen, ))
+            if lib.trace_config(trace, lib.TRACE_OPTION_SNAPLEN,
+                                ffi.new("int *", snaplen)) == -1:
+                raise TraceError.from_trace(trace)
+
+        PacketSource.__init__(self)
+        self._uri = uri
+        self._mmap = mmap
+        self._range = byte_range
+        self._snaplen = snaplen
+        self._started = False
+
+    def _open_pcap(self, path):
+        """Switch to the native pcap reader. Returns False if path is not
+        an uncompressed pcap file."""
+        flags = lib.PYTRACE_PCAP_MMAP if self._mmap else 0
+        error = ffi.new("char[256]")
+        reader = lib.pytrace_pcap_open(path, flags, error)
+        if reader == ffi.NULL:
+            return False
+        if self._snaplen is not None:
+            lib.pytrace_pcap_set_snaplen(reader, self._snaplen)
+        self._set_reader(reader)
+        # The pcap reader stands in for libtrace's own input, which
+        # therefore never needs to be started.
+        self._started = True
+        return True
+
+    def start(self):
+        if self._started:
+            return
+        if self._range is not None:
+            path = _pcap_path(self._uri)
+            if path is None or not self._open_pcap(path):
+                raise TraceError(-1, "%s: byte ranges need an uncompressed "
+                                 "pcap file" % (self._uri, ))
+            start, end = self._range
+            if lib.pytrace_pcap_set_range(self._reader, start, end) == -1:
+                raise TraceError.from_reader(self._reader)
+            return
+        if self._mmap:
+            path = _pcap_path(self._uri)
+            if path is not None and self._open_pcap(path):
+                return
+        if lib.trace_is_err(self._trace):
+            raise TraceError.from_trace(self._trace)
+        if lib.trace_start(self._trace) == -1:
+            raise TraceError.from_trace(self._trace)
+        self._started = True
+
+        if self._reader is None:
+            reader = lib.pytrace_reader_from_trace(self._trace)
+            if reader == ffi.NULL:
+                raise MemoryError("Could not allocate reader")
+            self._set_reader(reader)
+
+    def seek(self, seconds, index_path=None):
+        """Position the trace at the first packet at or after seconds.
+
+        For uncompressed pcap files with a time index (see
+        build_time_index), this binary searches the index and reads the
+        file directly from the nearest checkpoint. Without an index, the
+        native pcap reader (mmap or byte_range) scans from the start, and
+        anything else falls back to trace_seek_seconds.
+        """
+        self._check_idle()
+        path = _pcap_path(self._uri)
+        if index_path is None and path is not None:
+            index_path = path + TIME_INDEX_SUFFIX
+        if index_path is None or not os.path.exists(index_path):
+            self.start()
+            if self._reader.trace == ffi.NULL:
+                # libtrace was never started; seek the native reader
+                ts = int(seconds * (1 << 32))
+                if lib.pytrace_pcap_seek(self._reader, 0, ts) == -1:
+                    raise TraceError.from_reader(self._reader)
+            elif lib.trace_seek_seconds(self._trace, seconds) == -1:
+                raise TraceError.from_trace(self._trace)
+            return
+
+        error = ffi.new("char[256]")
+        index = lib.pytrace_tindex_load(index_path, path, error)
+        if index == ffi.NULL:
+            raise TraceError(-1, ffi.string(error))
+        index = ffi.gc(index, lib.pytrace_tindex_destroy)
+
+        if self._range is not None:
+            # Opens the pcap reader restricted to the range
+            self.start()
+        if self._reader is None or self._reader.trace != ffi.NULL:
+            if not self._open_pcap(path):
+                raise TraceError(-1, "%s: not an uncompressed pcap file"
+                                 % (path, ))
+
+        ts = int(seconds * (1 << 32))
+        offset = lib.pytrace_tindex_lookup(index, ts)
+        if lib.pytrace_pcap_seek(self._reader, offset, ts) == -1:
+            raise TraceError.from_reader(self._reader)
+
+
+class MergedTrace(PacketSource):
+    """Several input traces interleaved in timestamp order.
+
+    The merge runs natively: each input is read in batches of batch_size
+    packets and a min-heap on their next timestamps picks the packet to
+    return. Keyword arguments other than batch_size are passed on to each
+    Trace.
+    """
+
+    def __init__(self, uris, batch_size=256, **kwargs):
+        if not uris:
+            raise ValueError("at least one uri is needed")
+        PacketSource.__init__(self)
+        self._inputs = [Trace(uri, **kwargs) for uri in uris]
+        self._batch_size = batch_size
+
+    def start(self):
+        if self._reader is not None:
+            return
+        for trace in self._inputs:
+            trace.start()
+        readers = ffi.new("pytrace_reader_t *[]",
+                          [trace._reader for trace in self._inputs])
+        reader = lib.pytrace_merge_create(readers, len(self._inputs),
+                                          self._batch_size)
+        if reader == ffi.NULL:
+            raise MemoryError("Could not allocate merged reader")
+        self._set_reader(reader)
+
+
+class DefragmentedTrace(PacketSource):
+    """Another source with its IPv4 and IPv6 fragments reassembled.
+
+    Fragments are held in a native cache until their datagram is complete,
+    which then comes out as a single raw IP packet stamped with the time of
+    its last fragment. Everything else passes through unchanged, as do
+    fragments that cannot be reassembled (for example ones cut short by the
+    snap length).
+
+    Incomplete datagrams are dropped timeout seconds after their first
+    fragment, when the cache would exceed max_bytes of fragment data (oldest
+    first), and a source address may have at most max_per_source of them
+    pending (0 for no limit).
+
+    source is a PacketSource or a URI to open as a Trace.
+    """
+
+    def __init__(self, source, timeout=30.0, max_bytes=64 << 20,
+                 max_per_source=64):
+        PacketSource.__init__(self)
+        if isinstance(source, str):
+            source = Trace(source)
+        self._source = source
+        self._timeout = timeout
+        self._max_bytes = max_bytes
+        self._max_per_source = max_per_source
+
+    def start(self):
+        if self._reader is not None:
+            return
+        self._source.start()
+        reader = lib.pytrace_defrag_create(self._source._reader,
+                                           self._max_bytes,
+                                           self._max_per_source,
+                                           int(self._timeout * (1 << 32)))
+        if reader == ffi.NULL:
+            raise MemoryError("Could not allocate defragmenter")
+        self._set_reader(reader)
+
+    @property
+    def stats(self):
+        """Counters as a dict: fragments, reassembled, expired, evicted,
+        invalid and passed."""
+        stats = ffi.new("pytrace_defrag_stats_t *")
+        if self._reader is not None:
+            lib.pytrace_defrag_stats(self._reader, stats)
+        return dict((name, getattr(stats, name)) for name in
+                    ("fragments", "reassembled", "expired", "evicted",
+                     "invalid", "passed"))
+
+
+class DedupedTrace(PacketSource):
+    """Another source with duplicated packets removed.
+
+    A packet is dropped when one with the same layer 3 header and payload
+    was seen less than window seconds before or after it, ignoring the link
+    layer and the fields routers change (IPv4 TTL and checksum, IPv6 hop
+    limit). This catches the copies a SPAN port sends when it mirrors both
+    directions of a link, before any of the reading methods see them.
+    The hashes of the last capacity packets are remembered.
+
+    source is a PacketSource or a URI to open as a Trace.
+    """
+
+    def __init__(self, source, window=0.01, capacity=65536):
+        PacketSource.__init__(self)
+        if isinstance(source, str):
+            source = Trace(source)
+        self._source = source
+        self._window = window
+        self._capacity = capacity
+
+    def start(self):
+        if self._reader is not None:
+            return
+        self._source.start()
+        reader = lib.pytrace_dedup_create(self._source._reader,
+                                          self._capacity,
+                                          int(self._window * (1 << 32)))
+        if reader == ffi.NULL:
+            raise MemoryError("Could not allocate deduplicator")
+        self._set_reader(reader)
+
+    @property
+    def stats(self):
+        """Counters as a dict: packets, duplicates and unhashed."""
+        stats = ffi.new("pytrace_dedup_stats_t *")
+        if self._reader is not None:
+            lib.pytrace_dedup_stats(self._reader, stats)
+        return dict((name, getattr(stats, name)) for name in
+                    ("packets", "duplicates", "unhashed"))
+
+
+class Anonymizer(object):
+    """Prefix-preserving (CryptoPAn) anonymisation of IP addresses.
+
+    key is 32 secret bytes; the same key always gives the same mapping, and
+    addresses that share an n bit prefix map to addresses that share an n
+    bit prefix. Packets are rewritten in place: the outermost IPv4 or IPv6
+    source and destination, with the IP, TCP, UDP and ICMPv6 checksums
+    patched to match. Addresses inside tunnels or ICMP errors are not
+    touched.
+
+    AES runs on the CPU's AES instructions when it has them (see
+    hardware), and pad bits are cached per /16, /24 and /32 (IPv4) or /32,
+    /48, /64 and /128 (IPv6) prefix, so most addresses cost few or no
+    encryptions.
+    """
+
+    def __init__(self, key):
+        if not isinstance(key, bytes) or len(key) != 32:
+            raise ValueError("key must be 32 bytes")
+        anon = lib.pytrace_anon_create(key)
+        if anon == ffi.NULL:
+            raise MemoryError("Could not allocate anonymizer")
+        self._anon = ffi.gc(anon, lib.pytrace_anon_destroy)
+
+    @property
+    def hardware(self):
+        """True if AES runs on the CPU's AES instructions."""
+        return bool(lib.pytrace_anon_hardware(self._anon))
+
+    @property
+    def stats(self):
+        """Counters as a dict: packets, rewritten, encryptions and hits."""
+        stats = ffi.new("pytrace_anon_stats_t *")
+        lib.pytrace_anon_stats(self._anon, stats)
+        return dict((name, getattr(stats, name)) for name in
+                    ("packets", "rewritten", "encryptions", "hits"))
+
+    def address(self, text):
+        """The anonymised form of an address given as a string."""
+        version, family = (6, socket.AF_INET6) if ":" in text \
+            else (4, socket.AF_INET)
+        packed = socket.inet_pton(family, text)
+        out = ffi.new("uint8_t[16]")
+        lib.pytrace_anon_address(self._anon, packed, out, version)
+        return socket.inet_ntop(family, ffi.buffer(out, len(packed))[:])
+
+    def apply(self, batch):
+        """Rewrite the packets of a PacketBatch in place; returns how many
+        had an IP header."""
+        return lib.pytrace_anon_batch(self._anon, batch._batch)
+
+
+class AnonymizedTrace(PacketSource):
+    """Another source with its addresses anonymised by an Anonymizer.
+
+    anonymizer is an Anonymizer or a 32 byte key; source is a PacketSource
+    or a URI to open as a Trace.
+    """
+
+    def __init__(self, source, anonymizer):
+        PacketSource.__init__(self)
+        if isinstance(source, str):
+            source = Trace(source)
+        if not isinstance(anonymizer, Anonymizer):
+            anonymizer = Anonymizer(anonymizer)
+        self._source = source
+        self.anonymizer = anonymizer
+
+    def start(self):
+        if self._reader is not None:
+            return
+        self._source.start()
+        reader = lib.pytrace_anon_reader_create(self._source._reader,
+                                                self.anonymizer._anon)
+        if reader == ffi.NULL:
+            raise MemoryError("Could not allocate anonymizing reader")
+        self._set_reader(reader)
+
+
+class TraceOutput(object):
+    """An output trace, written a PacketBatch at a time."""
+
+    def __init__(self, uri):
+        if not isinstance(uri, str):
+            raise TypeError("uri must be string (got %r)" % (uri, ))
+
+        out = lib.trace_create_output(uri)
+        if out == ffi.NULL:
+            raise MemoryError("Could not allocate output trace")
+        self._out = ffi.gc(out, lib.trace_destroy_output)
+        if lib.trace_is_err_output(out):
+            raise TraceError.from_output(out)
+        self._started = False
+
+    def start(self):
+        if self._started:
+            return
+        if lib.trace_start_output(self._out) == -1:
+            raise TraceError.from_output(self._out)
+        self._started = True
+
+    def write(self, batch):
+        """Write every packet of a PacketBatch; returns how many."""
+        self.start()
+        n = lib.pytrace_write_batch(self._out, batch._batch)
+        if n == -1:
+            raise TraceError.from_output(self._out)
+        return n
+
+    def close(self):
+        """Flush and close the output; it cannot be written to again."""
+        if self._out is not None:
+            lib.trace_destroy_output(ffi.gc(self._out, None))
+            self._out = None
+
+
+class ChecksumValidator(object):
+    """Checks the IPv4, TCP, UDP and ICMP checksums of whole batches.
+
+    This is what trace_checksum_layer3 and trace_checksum_transport do for
+    one packet, but natively and a batch at a time, with a vectorised sum.
+    check() gives the PYTRACE_CHECKSUM_* flags of each packet, and stats
+    counts every checksum checked and failed across all calls, for example
+    to find captures damaged by NIC checksum offload.
+    """
+
+    _STATS = ("packets", "ip_checked", "ip_failed", "tcp_checked",
+              "tcp_failed", "udp_checked", "udp_failed", "icmp_checked",
+              "icmp_failed", "truncated")
+
+    def __init__(self):
+        self._stats = ffi.new("pytrace_checksum_stats_t *")
+
+    @property
+    def stats(self):
+        """Counters as a dict: packets, ip/tcp/udp/icmp _checked and
+        _failed, and truncated (datagrams too incomplete to check)."""
+        return dict((name, getattr(self._stats, name))
+                    for name in self._STATS)
+
+    def check(self, batch, out=None):
+        """Check a PacketBatch. Returns a cdata uint8_t array of flags
+        whose first len(batch) entries are filled; passing back a previous
+        result reuses it when it is big enough."""
+        count = len(batch)
+        if out is None or len(out) < count:
+            out = ffi.new("uint8_t[]", max(count, 1))
+        lib.pytrace_checksum_batch(batch._batch, out, self._stats)
+        return out
+
+    def run(self, source, n=1024, readahead=0):
+        """Check the rest of a PacketSource; returns stats."""
+        out = None
+        for batch in source.batches(n, readahead):
+            out = self.check(batch, out)
+        return self.stats
+
+
+def anonymize(source, uri, key, n=1024, readahead=0):
+    """Copy a source to the output trace at uri with its addresses
+    anonymised (see Anonymizer), a batch at a time; returns the
+    Anonymizer's stats."""
+    if isinstance(source, str):
+        source = Trace(source)
+    anonymizer = key if isinstance(key, Anonymizer) else Anonymizer(key)
+    out = TraceOutput(uri)
+    try:
+        for batch in source.batches(n, readahead):
+            anonymizer.apply(batch)
+            out.write(batch)
+    finally:
+        out.close()
+    return anonymizer.stats
+
+
+# Protocol keywords understood by the native matcher: name -> (ip_version,
+# proto). A version of 0 means either.
+_MATCH_PROTOS = {
+    "ip": (4, None),
+    "ip6": (6, None),
+    "tcp": (0, 6),
+    "udp": (0, 17),
+    "sctp": (0, 132),
+    "icmp": (4, 1),
+    "icmp6": (6, 58),
+}
+
+
+def _parse_address(text):
+    """(ip_version, packed address, prefix length) or None."""
+    addr, _, length = text.partition("/")
+    for version, family, bits in ((4, socket.AF_INET, 32),
+                                  (6, socket.AF_INET6, 128)):
+        try:
+            packed = socket.inet_pton(family, addr)
+        except (socket.error, ValueError):
+            continue
+        if not length:
+            return version, packed, bits
+        if not length.isdigit() or int(length) > bits:
+            return None
+        length = int(length)
+        # BPF rejects nets with host bits set; leave those to it
+        value = int(binascii.hexlify(packed), 16)
+        if value & ((1 << (bits - length)) - 1):
+            return None
+        return version, packed, length
+    return None
+
+
+def _parse_match(expr):
+    """Translate a BPF expression into a pytrace_match_t, if it is just a
+    conjunction of protocol, host, net and port primitives. Returns None
+    for anything else, which is then run as a real BPF filter."""
+    match = ffi.new("pytrace_match_t *")
+    tests = 0
+    version = 0
+
+    terms = expr.replace("&&", " and ").split(" and ")
+    for term in terms:
+        words = term.split()
+        if not words:
+            return None
+        if len(words) == 1 and words[0] in _MATCH_PROTOS:
+            want, proto = _MATCH_PROTOS[words[0]]
+            if proto is not None:
+                if tests & lib.PYTRACE_MATCH_PROTO:
+                    return None
+                tests |= lib.PYTRACE_MATCH_PROTO
+                match.proto = proto
+        else:
+            # "tcp port 80" is shorthand for "tcp and port 80"
+            qualified = words[0] in ("tcp", "udp", "sctp")
+            if qualified and len(words) > 1:
+                if tests & lib.PYTRACE_MATCH_PROTO:
+                    return None
+                tests |= lib.PYTRACE_MATCH_PROTO
+                match.proto = _MATCH_PROTOS[words.pop(0)][1]
+            want = 0
+            direction = None
+            if words[0] in ("src", "dst"):
+                direction = words.pop(0)
+            if len(words) != 2:
+                return None
+            kind, value = words
+            if kind == "port":
+                if not value.isdigit() or int(value) > 0xffff:
+                    return None
+                flag, field = {
+                    None: (lib.PYTRACE_MATCH_PORT, "port"),
+                    "src": (lib.PYTRACE_MATCH_SRC_PORT, "src_port"),
+                    "dst": (lib.PYTRACE_MATCH_DST_PORT, "dst_port"),
+                }[direction]
+                if tests & flag:
+                    return None
+                tests |= flag
+                setattr(match, field, int(value))
+                continue
+            if kind not in ("host", "net") or qualified:
+                return None
+            parsed = _parse_address(value)
+            if parsed is None or (kind == "host" and "/" in value):
+                return None
+            want, packed, length = parsed
+            flag, field = {
+                None: (lib.PYTRACE_MATCH_NET, "net"),
+                "src": (lib.PYTRACE_MATCH_SRC_NET, "src"),
+                "dst": (lib.PYTRACE_MATCH_DST_NET, "dst"),
+            }[direction]
+            if tests & flag:
+                return None
+            tests |= flag
+            ffi.memmove(getattr(match, field), packed, len(packed))
+            setattr(match, field + "_len", length)
+
+        if want:
+            if version and version != want:
+                return None
+            version = want
+
+    if version:
+        tests |= lib.PYTRACE_MATCH_VERSION
+        match.ip_version = version
+    match.tests = tests
+    return match
+
+
+class Classifier(object):
+    """Tests packets against many BPF expressions in a single pass.
+
+    Expressions that are only protocol, host, net and port primitives
+    joined with "and" (e.g. "src net 10.1.0.0/16 and tcp port 443") are
+    matched natively against a 5-tuple decoded once per packet. Other
+    expressions run as ordinary BPF filters, as do all of them for packets
+    that BPF would decode differently from libtrace: tagged frames, later
+    IPv4 fragments, IPv6 with extension headers, and anything not IP. So
+    the results are always those of BPF.
+
+    Per-filter packet and byte counters accumulate across calls.
+    """
+
+    def __init__(self, filters):
+        self.filters = list(filters)
+        if not self.filters:
+            raise ValueError("at least one filter is needed")
+        c = lib.pytrace_classifier_create(len(self.filters))
+        if c == ffi.NULL:
+            raise MemoryError("Could not allocate classifier")
+        self._c = ffi.gc(c, lib.pytrace_classifier_destroy)
+
+        # Which filters run natively, for diagnostics
+        self.native = []
+        for i, expr in enumerate(self.filters):
+            f = lib.pytrace_filter_get(expr)
+            if f == ffi.NULL:
+                raise MemoryError("Could not allocate filter")
+            lib.pytrace_classifier_set_filter(self._c, i, f)
+            match = _parse_match(expr)
+            if match is not None:
+                lib.pytrace_classifier_set_match(self._c, i, match)
+            self.native.append(match is not None)
+
+        self._words = lib.pytrace_classifier_words(self._c)
+        self._masks = None
+
+    def _run(self, batch, masks):
+        if lib.pytrace_classifier_batch(self._c, batch._batch, masks) == -1:
+            raise TraceError(-1, "Could not apply a classifier filter")
+
+    def classify(self, batch):
+        """Classify a PacketBatch, returning one int per packet whose bit
+        i is set if the packet matched filters[i]."""
+        words = self._words
+        needed = batch.capacity * words
+        if self._masks is None or len(self._masks) < needed:
+            self._masks = ffi.new("uint64_t[]", needed)
+        self._run(batch, self._masks)
+
+        count = len(batch)
+        if words == 1:
+            return self._masks[0:count]
+        values = self._masks[0:count * words]
+        result = []
+        for i in range(0, count * words, words):
+            mask = 0
+            for j in range(words):
+                mask |= values[i + j] << (64 * j)
+            result.append(mask)
+        return result
+
+    def count(self, batch):
+        """Only update the counters with a PacketBatch."""
+        self._run(batch, ffi.NULL)
+
+    def run(self, source, n=1024, readahead=0):
+        """Count the rest of a PacketSource; returns self.counts."""
+        for batch in source.batches(n, readahead):
+            self.count(batch)
+        return self.counts
+
+    @property
+    def counts(self):
+        """A list of (packets, bytes) per filter."""
+        packets = lib.pytrace_classifier_packets(self._c)
+        octets = lib.pytrace_classifier_bytes(self._c)
+        return [(packets[i], octets[i]) for i in range(len(self.filters))]
+
+    def reset(self):
+        lib.pytrace_classifier_reset(self._c)
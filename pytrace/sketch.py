@@ -0,0 +1,245 @@
+"""Fixed-memory sketches of the 5-tuples in a trace.
+
+CountMin estimates the packets or bytes of any key, HyperLogLog the number
+of distinct keys, and TopK tracks the keys with the most packets or bytes,
+optionally with an estimate of the distinct values of other fields per key
+(e.g. destinations per source). A key is made of some of the fields src,
+dst, sport, dport and proto, with addresses optionally cut to a prefix:
+
+    by_prefix = CountMin("src", prefix=24)
+    talkers = TopK(100, "src", weight="bytes", distinct="dst")
+    sketch.run(Trace(uri), [by_prefix, talkers])
+
+Sketches are updated natively a whole PacketBatch at a time, decoding each
+packet once for all of them. Sketches with the same parameters, for
+example built from different files, can be merged, and dumps()/loads()
+turn them into bytes and back (for the same byte order only).
+"""
+
+import collections
+import socket
+
+from _trace import ffi, lib
+
+_FIELDS = {
+    "src": lib.PYTRACE_SKETCH_SRC,
+    "dst": lib.PYTRACE_SKETCH_DST,
+    "sport": lib.PYTRACE_SKETCH_SRC_PORT,
+    "dport": lib.PYTRACE_SKETCH_DST_PORT,
+    "proto": lib.PYTRACE_SKETCH_PROTO,
+}
+
+_WEIGHTS = {
+    "packets": lib.PYTRACE_SKETCH_PACKETS,
+    "bytes": lib.PYTRACE_SKETCH_BYTES,
+}
+
+# A sketch key. Addresses are packed bytes (4 or 16 long), or None when
+# they are not part of the key; so are the other fields.
+SketchKey = collections.namedtuple("SketchKey", [
+    "src", "dst", "sport", "dport", "proto",
+])
+
+# An entry of TopK.top. count overestimates the true weight by at most
+# error; distinct is the estimate for the sketch's distinct fields.
+TopEntry = collections.namedtuple("TopEntry", [
+    "key", "count", "error", "distinct",
+])
+
+
+def _fields(names):
+    if isinstance(names, str):
+        names = names.replace(",", " ").split()
+    mask = 0
+    for name in names:
+        if name not in _FIELDS:
+            raise ValueError("unknown sketch field %r" % (name, ))
+        mask |= _FIELDS[name]
+    return mask
+
+
+def _address(value):
+    """Packed bytes for an address given as a string or already packed."""
+    if isinstance(value, (bytes, bytearray)) and len(value) in (4, 16):
+        return bytes(value)
+    family = socket.AF_INET6 if ":" in value else socket.AF_INET
+    return socket.inet_pton(family, value)
+
+
+def _key(src=None, dst=None, sport=None, dport=None, proto=None):
+    key = ffi.new("pytrace_sketch_key_t *")
+    versions = set()
+    if src is not None:
+        packed = _address(src)
+        ffi.memmove(key.src, packed, len(packed))
+        versions.add(len(packed))
+    if dst is not None:
+        packed = _address(dst)
+        ffi.memmove(key.dst, packed, len(packed))
+        versions.add(len(packed))
+    if len(versions) > 1:
+        raise ValueError("src and dst must be the same IP version")
+    if versions:
+        key.ip_version = 4 if versions.pop() == 4 else 6
+    key.src_port = sport or 0
+    key.dst_port = dport or 0
+    key.proto = proto or 0
+    return key
+
+
+def _unkey(key, fields):
+    size = 4 if key.ip_version == 4 else 16
+    values = [ffi.buffer(key.src, size)[:], ffi.buffer(key.dst, size)[:],
+              key.src_port, key.dst_port, key.proto]
+    flags = [lib.PYTRACE_SKETCH_SRC, lib.PYTRACE_SKETCH_DST,
+             lib.PYTRACE_SKETCH_SRC_PORT, lib.PYTRACE_SKETCH_DST_PORT,
+             lib.PYTRACE_SKETCH_PROTO]
+    return SketchKey(*[value if fields & flag else None
+                       for flag, value in zip(flags, values)])
+
+
+class Sketch(object):
+    """Behaviour shared by every kind of sketch."""
+
+    def __init__(self, kind, key, weight="packets", prefix=32, prefix6=128,
+                 seed=0, **params):
+        if weight not in _WEIGHTS:
+            raise ValueError("unknown weight %r" % (weight, ))
+        config = ffi.new("pytrace_sketch_config_t *")
+        config.kind = kind
+        config.key = _fields(key)
+        config.weight = _WEIGHTS[weight]
+        config.prefix4 = prefix
+        config.prefix6 = prefix6
+        config.seed = seed
+        for name, value in params.items():
+            setattr(config, name, value)
+        s = lib.pytrace_sketch_create(config)
+        if s == ffi.NULL:
+            raise ValueError("invalid sketch parameters")
+        self._s = ffi.gc(s, lib.pytrace_sketch_destroy)
+
+    @property
+    def total(self):
+        """The total weight of every packet added."""
+        return lib.pytrace_sketch_total(self._s)
+
+    def update(self, batch):
+        """Add the IP packets of a PacketBatch."""
+        update([self], batch)
+
+    def run(self, source, n=1024, readahead=0):
+        """Add the rest of a PacketSource; returns self."""
+        run(source, [self], n, readahead)
+        return self
+
+    def merge(self, other):
+        """Add another sketch with the same parameters into this one."""
+        ret = lib.pytrace_sketch_merge(self._s, other._s)
+        if ret == -1:
+            raise ValueError("cannot merge sketches with different parameters")
+        if ret == -2:
+            raise MemoryError("Could not merge sketches")
+        return self
+
+    def dumps(self):
+        """The sketch as bytes, for loads()."""
+        size = lib.pytrace_sketch_size(self._s)
+        out = ffi.new("unsigned char[]", size)
+        lib.pytrace_sketch_save(self._s, out)
+        return ffi.buffer(out, size)[:]
+
+    @staticmethod
+    def loads(data):
+        """Rebuild a sketch saved by dumps(), of whichever kind it was."""
+        s = lib.pytrace_sketch_load(data, len(data))
+        if s == ffi.NULL:
+            raise ValueError("not a valid sketch")
+        s = ffi.gc(s, lib.pytrace_sketch_destroy)
+        cls = _KINDS[lib.pytrace_sketch_config(s).kind]
+        self = cls.__new__(cls)
+        self._s = s
+        return self
+
+
+class CountMin(Sketch):
+    """Estimates the weight of any key; never underestimates, and
+    overestimates by at most about e / width of the total with
+    probability 1 - exp(-depth)."""
+
+    def __init__(self, key="src", weight="packets", width=2048, depth=4,
+                 prefix=32, prefix6=128, seed=0):
+        Sketch.__init__(self, lib.PYTRACE_SKETCH_COUNT_MIN, key, weight,
+                        prefix, prefix6, seed, width=width, depth=depth)
+
+    def estimate(self, **key):
+        """The weight of the key given by src, dst, sport, dport and proto
+        keywords; addresses are strings or packed bytes."""
+        return lib.pytrace_sketch_query(self._s, _key(**key))
+
+
+class HyperLogLog(Sketch):
+    """Estimates the number of distinct keys, to within about
+    1.04 / sqrt(2 ** precision)."""
+
+    def __init__(self, key="src", precision=14, prefix=32, prefix6=128,
+                 seed=0):
+        Sketch.__init__(self, lib.PYTRACE_SKETCH_HLL, key, "packets",
+                        prefix, prefix6, seed, precision=precision)
+
+    def distinct(self):
+        return lib.pytrace_sketch_distinct(self._s)
+
+
+class TopK(Sketch):
+    """Tracks the k keys with the largest weight (SpaceSaving).
+
+    Any key whose weight is above total / k is guaranteed to be tracked.
+    With distinct set to some fields, each entry also estimates how many
+    distinct values of those fields were seen with its key, using
+    2 ** precision bytes per entry; that count restarts whenever an entry
+    is taken over by another key.
+    """
+
+    def __init__(self, k=100, key="src", weight="bytes", distinct=None,
+                 precision=8, prefix=32, prefix6=128, seed=0):
+        Sketch.__init__(self, lib.PYTRACE_SKETCH_TOP_K, key, weight,
+                        prefix, prefix6, seed, width=k,
+                        distinct=_fields(distinct or ()),
+                        precision=precision)
+
+    def estimate(self, **key):
+        """The count of a tracked key (see CountMin.estimate), else 0."""
+        return lib.pytrace_sketch_query(self._s, _key(**key))
+
+    def top(self, n=None):
+        """The tracked keys as TopEntry tuples, largest first."""
+        config = lib.pytrace_sketch_config(self._s)
+        out = ffi.new("pytrace_sketch_entry_t[]", config.width)
+        count = lib.pytrace_sketch_top(self._s, out)
+        if n is not None:
+            count = min(count, n)
+        return [TopEntry(_unkey(out[i].key, config.key), out[i].count,
+                         out[i].error, out[i].distinct)
+                for i in range(count)]
+
+
+_KINDS = {
+    lib.PYTRACE_SKETCH_COUNT_MIN: CountMin,
+    lib.PYTRACE_SKETCH_HLL: HyperLogLog,
+    lib.PYTRACE_SKETCH_TOP_K: TopK,
+}
+
+
+def update(sketches, batch):
+    """Add the IP packets of a PacketBatch to several sketches at once."""
+    handles = ffi.new("pytrace_sketch_t *[]", [s._s for s in sketches])
+    return lib.pytrace_sketch_update(handles, len(sketches), batch._batch)
+
+
+def run(source, sketches, n=1024, readahead=0):
+    """Add the rest of a PacketSource to several sketches in one pass."""
+    handles = ffi.new("pytrace_sketch_t *[]", [s._s for s in sketches])
+    for batch in source.batches(n, readahead):
+        lib.pytrace_sketch_update(handles, len(sketches), batch._batch)
+    return sketches
@@ -0,0 +1,184 @@
+/*
+ * AES-128 encryption.
+ *
+ * The portable version works a byte at a time from the S-box, as in
+ * FIPS-197. On x86 CPUs that have the AES-NI instructions, which is
+ * checked at run time, blocks are instead encrypted with AESENC, several
+ * at a time so that the instructions overlap. Both use the same expanded
+ * key, since AESENC takes the standard round keys as they are.
+ */
+
+#include <string.h>
+
+#include "aes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AES_X86 1
+#include <wmmintrin.h>
+#endif
+
+static const uint8_t sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5,
+	0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0,
+	0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc,
+	0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a,
+	0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0,
+	0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b,
+	0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85,
+	0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5,
+	0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17,
+	0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88,
+	0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c,
+	0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9,
+	0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6,
+	0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e,
+	0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94,
+	0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68,
+	0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+/* Multiply by x in GF(2^8) */
+static uint8_t xtime(uint8_t b)
+{
+	return (b << 1) ^ (b & 0x80 ? 0x1b : 0);
+}
+
+static void encrypt_soft(const struct aes128 *aes, const uint8_t *in,
+		uint8_t *out)
+{
+	uint8_t s[16], t[16];
+	int round, c, i;
+
+	for (i = 0; i < 16; i++)
+		s[i] = in[i] ^ aes->round_keys[0][i];
+
+	for (round = 1; round <= 10; round++) {
+		/* SubBytes and ShiftRows: byte r of column c comes from
+		 * column c + r */
+		for (c = 0; c < 4; c++) {
+			for (i = 0; i < 4; i++)
+				t[c * 4 + i] = sbox[s[((c + i) & 3) * 4 + i]];
+		}
+
+		if (round < 10) {
+			for (c = 0; c < 4; c++) {
+				uint8_t *col = &t[c * 4];
+				uint8_t all = col[0] ^ col[1] ^ col[2] ^ col[3];
+				uint8_t first = col[0];
+
+				col[0] ^= all ^ xtime(col[0] ^ col[1]);
+				col[1] ^= all ^ xtime(col[1] ^ col[2]);
+				col[2] ^= all ^ xtime(col[2] ^ col[3]);
+				col[3] ^= all ^ xtime(col[3] ^ first);
+			}
+		}
+
+		for (i = 0; i < 16; i++)
+			s[i] = t[i] ^ aes->round_keys[round][i];
+	}
+	memcpy(out, s, 16);
+}
+
+#ifdef AES_X86
+
+__attribute__((target("aes,sse2")))
+static void encrypt_hard(const struct aes128 *aes, const uint8_t *in,
+		uint8_t *out, size_t n)
+{
+	__m128i k[11], b[4];
+	size_t i, j;
+	int r;
+
+	for (r = 0; r < 11; r++)
+		k[r] = _mm_loadu_si128((const __m128i *)aes->round_keys[r]);
+
+	/* Four blocks at a time keep the AES unit busy */
+	for (i = 0; i + 4 <= n; i += 4) {
+		for (j = 0; j < 4; j++)
+			b[j] = _mm_xor_si128(_mm_loadu_si128(
+					(const __m128i *)(in + (i + j) * 16)),
+					k[0]);
+		for (r = 1; r < 10; r++) {
+			for (j = 0; j < 4; j++)
+				b[j] = _mm_aesenc_si128(b[j], k[r]);
+		}
+		for (j = 0; j < 4; j++)
+			_mm_storeu_si128((__m128i *)(out + (i + j) * 16),
+					_mm_aesenclast_si128(b[j], k[10]));
+	}
+	for (; i < n; i++) {
+		b[0] = _mm_xor_si128(_mm_loadu_si128(
+				(const __m128i *)(in + i * 16)), k[0]);
+		for (r = 1; r < 10; r++)
+			b[0] = _mm_aesenc_si128(b[0], k[r]);
+		_mm_storeu_si128((__m128i *)(out + i * 16),
+				_mm_aesenclast_si128(b[0], k[10]));
+	}
+}
+
+static int cpu_has_aes(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("aes") != 0;
+}
+
+#else
+
+static int cpu_has_aes(void)
+{
+	return 0;
+}
+
+#endif
+
+void aes128_init(struct aes128 *aes, const uint8_t *key)
+{
+	uint8_t rcon = 1;
+	int i, r;
+
+	memcpy(aes->round_keys[0], key, 16);
+	for (r = 1; r <= 10; r++) {
+		const uint8_t *prev = aes->round_keys[r - 1];
+		uint8_t *next = aes->round_keys[r];
+
+		/* RotWord, SubWord and the round constant */
+		next[0] = prev[0] ^ sbox[prev[13]] ^ rcon;
+		next[1] = prev[1] ^ sbox[prev[14]];
+		next[2] = prev[2] ^ sbox[prev[15]];
+		next[3] = prev[3] ^ sbox[prev[12]];
+		for (i = 4; i < 16; i++)
+			next[i] = prev[i] ^ next[i - 4];
+		rcon = xtime(rcon);
+	}
+	aes->hardware = cpu_has_aes();
+}
+
+void aes128_encrypt_blocks(const struct aes128 *aes, const uint8_t *in,
+		uint8_t *out, size_t n)
+{
+	size_t i;
+
+#ifdef AES_X86
+	if (aes->hardware) {
+		encrypt_hard(aes, in, out, n);
+		return;
+	}
+#endif
+	for (i = 0; i < n; i++)
+		encrypt_soft(aes, in + i * 16, out + i * 16);
+}
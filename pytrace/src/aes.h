@@ -0,0 +1,27 @@
+/*
+ * AES-128 block encryption, for the anonymisation stage.
+ *
+ * Unlike pytrace.h, this header is never passed to cffi.
+ */
+
+#ifndef PYTRACE_AES_H
+#define PYTRACE_AES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** An expanded AES-128 key */
+struct aes128 {
+	uint8_t round_keys[11][16];
+	int hardware;		/* Encrypt with the AES instructions */
+};
+
+/* Expand a 16 byte key, and decide whether the CPU's AES instructions can
+ * be used for it */
+void aes128_init(struct aes128 *aes, const uint8_t *key);
+
+/* Encrypt n independent 16 byte blocks (ECB); in and out may be the same */
+void aes128_encrypt_blocks(const struct aes128 *aes, const uint8_t *in,
+		uint8_t *out, size_t n);
+
+#endif
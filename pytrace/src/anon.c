@@ -0,0 +1,317 @@
+/*
+ * Prefix-preserving address anonymisation (CryptoPAn).
+ *
+ * Bit i of an anonymised address is bit i of the original XORed with the
+ * top bit of AES(first i bits of the address, followed by a secret pad).
+ * Two addresses that share a prefix therefore map to addresses that share
+ * a prefix of the same length, but that costs one AES block per address
+ * bit. Since the pad bits for a prefix depend on nothing but the prefix,
+ * they are memoised at a few prefix lengths (/16, /24 and /32 for IPv4;
+ * /32, /48, /64 and /128 for IPv6), each in a direct-mapped cache, so a new
+ * address within a known /24 only costs 8 blocks, and a known address
+ * costs none.
+ *
+ * Packets are rewritten in place, with the IP header checksum and the
+ * TCP, UDP or ICMPv6 checksum (which cover the addresses through the
+ * pseudo header) patched incrementally as in RFC 1624.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+#include "aes.h"
+#include "decode.h"
+
+#define CACHE_SIZE	16384
+#define MAX_LEVELS	4
+
+static const int levels4[] = { 16, 24, 32 };
+static const int levels6[] = { 32, 48, 64, 128 };
+
+struct cache_entry {
+	uint8_t prefix[16];	/* The address cut to the level's length */
+	uint8_t otp[16];	/* Pad bits within the level, others zero */
+	uint8_t bits;		/* 32 or 128, or 0 if the entry is empty */
+};
+
+struct pytrace_anon_t {
+	struct aes128 aes;
+	uint8_t pad[16];
+	struct cache_entry *cache[MAX_LEVELS];
+	pytrace_anon_stats_t stats;
+};
+
+pytrace_anon_t *pytrace_anon_create(const uint8_t *key)
+{
+	pytrace_anon_t *a;
+	int i;
+
+	a = calloc(1, sizeof(*a));
+	if (!a)
+		return NULL;
+	for (i = 0; i < MAX_LEVELS; i++) {
+		a->cache[i] = calloc(CACHE_SIZE, sizeof(*a->cache[i]));
+		if (!a->cache[i]) {
+			pytrace_anon_destroy(a);
+			return NULL;
+		}
+	}
+	aes128_init(&a->aes, key);
+	aes128_encrypt_blocks(&a->aes, key + 16, a->pad, 1);
+	return a;
+}
+
+void pytrace_anon_destroy(pytrace_anon_t *a)
+{
+	int i;
+
+	if (!a)
+		return;
+	for (i = 0; i < MAX_LEVELS; i++)
+		free(a->cache[i]);
+	free(a);
+}
+
+int pytrace_anon_hardware(const pytrace_anon_t *a)
+{
+	return a->aes.hardware;
+}
+
+void pytrace_anon_stats(const pytrace_anon_t *a, pytrace_anon_stats_t *stats)
+{
+	*stats = a->stats;
+}
+
+/* Copy the first bits of an address, zeroing the rest */
+static void prefix_of(const uint8_t *addr, int bits, uint8_t *out)
+{
+	int full = bits / 8, rem = bits % 8;
+
+	memset(out, 0, 16);
+	memcpy(out, addr, full);
+	if (rem)
+		out[full] = addr[full] & (0xff << (8 - rem));
+}
+
+/* Work out the pad bits from start up to end with one AES block each */
+static void pad_bits(pytrace_anon_t *a, const uint8_t *addr, int start,
+		int end, uint8_t *otp)
+{
+	uint8_t blocks[128 * 16];
+	int i, n = end - start;
+
+	/* The loop fills all n blocks, but gcc cannot tell */
+	memset(blocks, 0, n * 16);
+	for (i = start; i < end; i++) {
+		uint8_t *b = blocks + (i - start) * 16;
+		int full = i / 8, rem = i % 8;
+
+		memcpy(b, a->pad, 16);
+		memcpy(b, addr, full);
+		if (rem)
+			b[full] = (addr[full] & (0xff << (8 - rem))) |
+				(a->pad[full] & (0xff >> rem));
+	}
+	aes128_encrypt_blocks(&a->aes, blocks, blocks, n);
+	for (i = start; i < end; i++) {
+		if (blocks[(i - start) * 16] & 0x80)
+			otp[i / 8] |= 0x80 >> (i % 8);
+	}
+	a->stats.encryptions += n;
+}
+
+void pytrace_anon_address(pytrace_anon_t *a, const uint8_t *in,
+		uint8_t *out, int ip_version)
+{
+	const int *levels = ip_version == 4 ? levels4 : levels6;
+	int nlevels = ip_version == 4 ? 3 : 4;
+	int len = ip_version == 4 ? 4 : 16;
+	uint8_t otp[16], prefix[16];
+	struct cache_entry *e;
+	int i, j, start = 0;
+
+	memset(otp, 0, sizeof(otp));
+	for (j = 0; j < nlevels; j++) {
+		prefix_of(in, levels[j], prefix);
+		e = &a->cache[j][hash_bytes(prefix, len, len * 8 + j) &
+			(CACHE_SIZE - 1)];
+		if (e->bits != len * 8 || memcmp(e->prefix, prefix, len) != 0) {
+			memcpy(e->prefix, prefix, sizeof(prefix));
+			memset(e->otp, 0, sizeof(e->otp));
+			pad_bits(a, in, start, levels[j], e->otp);
+			e->bits = len * 8;
+		} else {
+			a->stats.hits++;
+		}
+		for (i = 0; i < len; i++)
+			otp[i] |= e->otp[i];
+		start = levels[j];
+	}
+	for (i = 0; i < len; i++)
+		out[i] = in[i] ^ otp[i];
+}
+
+/* Patch a ones' complement checksum for some 16-bit words that changed */
+static void checksum_fix(uint8_t *check, const uint8_t *old,
+		const uint8_t *new, int len)
+{
+	uint32_t sum = ~((check[0] << 8) | check[1]) & 0xffff;
+	int i;
+
+	for (i = 0; i < len; i += 2) {
+		sum += ~((old[i] << 8) | old[i + 1]) & 0xffff;
+		sum += (new[i] << 8) | new[i + 1];
+	}
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	sum = ~sum & 0xffff;
+	check[0] = sum >> 8;
+	check[1] = sum & 0xff;
+}
+
+/* Fix the transport checksum, which covers the addresses through the
+ * pseudo header */
+static void transport_fix(libtrace_packet_t *packet, const uint8_t *old,
+		const uint8_t *new, int len)
+{
+	uint32_t remaining, offset;
+	uint8_t proto, *l4;
+
+	l4 = trace_get_transport(packet, &proto, &remaining);
+	if (!l4)
+		return;
+	switch (proto) {
+	case TRACE_IPPROTO_TCP:
+		offset = 16;
+		break;
+	case TRACE_IPPROTO_UDP:
+		offset = 6;
+		break;
+	case TRACE_IPPROTO_ICMPV6:
+		offset = 2;
+		break;
+	default:
+		return;
+	}
+	if (remaining < offset + 2)
+		return;
+
+	if (proto == TRACE_IPPROTO_UDP) {
+		/* Zero means there is no checksum; a real zero is sent as
+		 * 0xffff */
+		if (l4[offset] == 0 && l4[offset + 1] == 0)
+			return;
+		checksum_fix(l4 + offset, old, new, len);
+		if (l4[offset] == 0 && l4[offset + 1] == 0)
+			l4[offset] = l4[offset + 1] = 0xff;
+		return;
+	}
+	checksum_fix(l4 + offset, old, new, len);
+}
+
+int pytrace_anon_packet(pytrace_anon_t *a, libtrace_packet_t *packet)
+{
+	uint8_t old[32], new[32];
+	uint32_t remaining;
+	uint16_t ethertype;
+	void *l3;
+	int len;
+
+	a->stats.packets++;
+	l3 = trace_get_layer3(packet, &ethertype, &remaining);
+	if (!l3)
+		return 0;
+
+	if (ethertype == TRACE_ETHERTYPE_IP &&
+			remaining >= sizeof(libtrace_ip_t)) {
+		libtrace_ip_t *ip = l3;
+
+		len = 8;
+		memcpy(old, &ip->ip_src, 4);
+		memcpy(old + 4, &ip->ip_dst, 4);
+		pytrace_anon_address(a, old, new, 4);
+		pytrace_anon_address(a, old + 4, new + 4, 4);
+		memcpy(&ip->ip_src, new, 4);
+		memcpy(&ip->ip_dst, new + 4, 4);
+		checksum_fix((uint8_t *)&ip->ip_sum, old, new, len);
+	} else if (ethertype == TRACE_ETHERTYPE_IPV6 &&
+			remaining >= sizeof(libtrace_ip6_t)) {
+		libtrace_ip6_t *ip6 = l3;
+
+		len = 32;
+		memcpy(old, &ip6->ip_src, 16);
+		memcpy(old + 16, &ip6->ip_dst, 16);
+		pytrace_anon_address(a, old, new, 6);
+		pytrace_anon_address(a, old + 16, new + 16, 6);
+		memcpy(&ip6->ip_src, new, 16);
+		memcpy(&ip6->ip_dst, new + 16, 16);
+	} else {
+		return 0;
+	}
+
+	transport_fix(packet, old, new, len);
+	a->stats.rewritten++;
+	return 1;
+}
+
+int pytrace_anon_batch(pytrace_anon_t *a, const pytrace_batch_t *batch)
+{
+	int i, n = 0;
+
+	for (i = 0; i < batch->count; i++)
+		n += pytrace_anon_packet(a, batch->packets[i]);
+	return n;
+}
+
+/* A reader that anonymises the packets of another as they pass through */
+struct anon_reader {
+	pytrace_reader_t base;
+	pytrace_reader_t *input;
+	pytrace_anon_t *anon;
+};
+
+static int anon_reader_read(pytrace_reader_t *reader,
+		libtrace_packet_t *packet)
+{
+	struct anon_reader *r = (struct anon_reader *)reader;
+	pytrace_reader_t *input = r->input;
+	int len;
+
+	len = pytrace_reader_read(input, packet);
+	if (len > 0) {
+		pytrace_anon_packet(r->anon, packet);
+	} else if (len < 0) {
+		if (input->trace && !input->error[0]) {
+			libtrace_err_t err = trace_get_err(input->trace);
+			snprintf(r->base.error, sizeof(r->base.error), "%s",
+					err.problem);
+		} else {
+			snprintf(r->base.error, sizeof(r->base.error), "%s",
+					input->error);
+		}
+	}
+	return len;
+}
+
+static void anon_reader_destroy(pytrace_reader_t *reader)
+{
+	free(reader);
+}
+
+pytrace_reader_t *pytrace_anon_reader_create(pytrace_reader_t *input,
+		pytrace_anon_t *anon)
+{
+	struct anon_reader *r;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->base.read = anon_reader_read;
+	r->base.destroy = anon_reader_destroy;
+	r->input = input;
+	r->anon = anon;
+	return &r->base;
+}
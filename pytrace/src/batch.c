@@ -0,0 +1,81 @@
+/*
+ * Batched packet reading and writing.
+ *
+ * A batch owns a fixed array of libtrace packets that are reused across
+ * reads, so the per-packet cost is just the read itself.
+ */
+
+#include <stdlib.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+
+pytrace_batch_t *pytrace_batch_create(int capacity)
+{
+	pytrace_batch_t *batch;
+	int i;
+
+	if (capacity <= 0)
+		return NULL;
+
+	batch = calloc(1, sizeof(*batch));
+	if (!batch)
+		return NULL;
+
+	batch->packets = calloc(capacity, sizeof(*batch->packets));
+	if (!batch->packets) {
+		free(batch);
+		return NULL;
+	}
+	batch->capacity = capacity;
+
+	for (i = 0; i < capacity; i++) {
+		batch->packets[i] = trace_create_packet();
+		if (!batch->packets[i]) {
+			pytrace_batch_destroy(batch);
+			return NULL;
+		}
+	}
+	return batch;
+}
+
+void pytrace_batch_destroy(pytrace_batch_t *batch)
+{
+	int i;
+
+	if (!batch)
+		return;
+	for (i = 0; i < batch->capacity; i++) {
+		if (batch->packets[i])
+			trace_destroy_packet(batch->packets[i]);
+	}
+	free(batch->packets);
+	free(batch);
+}
+
+int pytrace_read_batch(pytrace_reader_t *reader, pytrace_batch_t *batch)
+{
+	int status = 1;
+	int n = 0;
+
+	while (n < batch->capacity) {
+		status = pytrace_reader_read(reader, batch->packets[n]);
+		if (status <= 0)
+			break;
+		n++;
+	}
+	batch->count = n;
+	batch->status = status;
+	return n;
+}
+
+int pytrace_write_batch(libtrace_out_t *out, const pytrace_batch_t *batch)
+{
+	int i;
+
+	for (i = 0; i < batch->count; i++) {
+		if (trace_write_packet(out, batch->packets[i]) < 0)
+			return -1;
+	}
+	return batch->count;
+}
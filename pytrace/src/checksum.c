@@ -0,0 +1,259 @@
+/*
+ * Bulk validation of IPv4, TCP, UDP and ICMP checksums.
+ *
+ * Every checksum is checked by summing the covered bytes, checksum field
+ * included, and testing for 0xffff. The Internet checksum is independent
+ * of byte order (RFC 1071), so the bytes are summed as host order words
+ * without swapping, and 32 bits at a time into a 64-bit total. On x86 the
+ * sum is vectorised: SSE2 widens eight 16-bit words into 32-bit lanes per
+ * step, and AVX2, when the CPU has it, sixteen.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CHECKSUM_X86 1
+#include <immintrin.h>
+#endif
+
+/* Bytes summed into 32-bit lanes before they are added up, small enough
+ * that no lane can overflow */
+#define CHUNK		65536
+
+#define IPPROTO_FRAGMENT6	44
+
+static uint64_t sum_scalar(const uint8_t *p, size_t len)
+{
+	uint64_t sum = 0;
+	uint32_t w32;
+	uint16_t w16;
+
+	while (len >= 4) {
+		memcpy(&w32, p, 4);
+		sum += w32;
+		p += 4;
+		len -= 4;
+	}
+	if (len >= 2) {
+		memcpy(&w16, p, 2);
+		sum += w16;
+		p += 2;
+		len -= 2;
+	}
+	if (len) {
+		/* The odd byte is padded with a zero after it */
+		w16 = 0;
+		memcpy(&w16, p, 1);
+		sum += w16;
+	}
+	return sum;
+}
+
+#ifdef CHECKSUM_X86
+
+__attribute__((target("sse2")))
+static uint64_t sum_sse2(const uint8_t *p, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	uint32_t lanes[4];
+	uint64_t sum = 0;
+	size_t i, n;
+
+	while (len >= 16) {
+		__m128i acc = zero;
+
+		n = (len < CHUNK ? len : CHUNK) & ~(size_t)15;
+		for (i = 0; i < n; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+
+			acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+			acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+		}
+		_mm_storeu_si128((__m128i *)lanes, acc);
+		sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		p += n;
+		len -= n;
+	}
+	return sum + sum_scalar(p, len);
+}
+
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(const uint8_t *p, size_t len)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	uint32_t lanes[8];
+	uint64_t sum = 0;
+	size_t i, n;
+	int j;
+
+	while (len >= 32) {
+		__m256i acc = zero;
+
+		n = (len < CHUNK ? len : CHUNK) & ~(size_t)31;
+		for (i = 0; i < n; i += 32) {
+			__m256i v = _mm256_loadu_si256(
+					(const __m256i *)(p + i));
+
+			acc = _mm256_add_epi32(acc,
+					_mm256_unpacklo_epi16(v, zero));
+			acc = _mm256_add_epi32(acc,
+					_mm256_unpackhi_epi16(v, zero));
+		}
+		_mm256_storeu_si256((__m256i *)lanes, acc);
+		for (j = 0; j < 8; j++)
+			sum += lanes[j];
+		p += n;
+		len -= n;
+	}
+	return sum + sum_scalar(p, len);
+}
+
+static uint64_t (*choose_sum(void))(const uint8_t *, size_t)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return sum_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return sum_sse2;
+	return sum_scalar;
+}
+
+#else
+
+static uint64_t (*choose_sum(void))(const uint8_t *, size_t)
+{
+	return sum_scalar;
+}
+
+#endif
+
+static uint64_t (*sum_bytes)(const uint8_t *, size_t);
+
+static uint16_t fold(uint64_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/* The words of the TCP/UDP pseudo header other than the addresses, which
+ * are the same for IPv4 and (with a length below 64K) IPv6 */
+static uint64_t pseudo_sum(uint8_t proto, uint32_t len)
+{
+	return htons(proto) + htons(len & 0xffff) + htons(len >> 16);
+}
+
+static void count(uint8_t proto, int good, pytrace_checksum_stats_t *stats)
+{
+	switch (proto) {
+	case TRACE_IPPROTO_TCP:
+		stats->tcp_checked++;
+		stats->tcp_failed += !good;
+		break;
+	case TRACE_IPPROTO_UDP:
+		stats->udp_checked++;
+		stats->udp_failed += !good;
+		break;
+	default:
+		stats->icmp_checked++;
+		stats->icmp_failed += !good;
+		break;
+	}
+}
+
+int pytrace_checksum_packet(libtrace_packet_t *packet,
+		pytrace_checksum_stats_t *stats)
+{
+	uint32_t remaining, l4_remaining, l4_len;
+	uint64_t sum;
+	uint16_t ethertype;
+	uint8_t *l3, *l4, *end, proto;
+	int status = 0, good;
+
+	if (!sum_bytes)
+		sum_bytes = choose_sum();
+
+	stats->packets++;
+	l3 = trace_get_layer3(packet, &ethertype, &remaining);
+	if (!l3)
+		return 0;
+
+	if (ethertype == TRACE_ETHERTYPE_IP && remaining >= 20) {
+		libtrace_ip_t *ip = (libtrace_ip_t *)l3;
+		uint32_t hlen = ip->ip_hl * 4;
+
+		if (hlen < 20 || hlen > remaining)
+			return 0;
+		good = fold(sum_bytes(l3, hlen)) == 0xffff;
+		status |= good ? PYTRACE_CHECKSUM_L3_GOOD :
+			PYTRACE_CHECKSUM_L3_BAD;
+		stats->ip_checked++;
+		stats->ip_failed += !good;
+
+		/* Only a whole datagram can be checked */
+		if (ntohs(ip->ip_off) & 0x3fff)
+			goto truncated;
+		end = l3 + ntohs(ip->ip_len);
+		sum = sum_scalar((uint8_t *)&ip->ip_src, 8);
+	} else if (ethertype == TRACE_ETHERTYPE_IPV6 && remaining >= 40) {
+		libtrace_ip6_t *ip6 = (libtrace_ip6_t *)l3;
+
+		/* Fragment headers after other extension headers are not
+		 * spotted, so such fragments will fail */
+		if (ip6->nxt == IPPROTO_FRAGMENT6)
+			goto truncated;
+		end = l3 + 40 + ntohs(ip6->plen);
+		sum = sum_scalar((uint8_t *)&ip6->ip_src, 32);
+	} else {
+		return 0;
+	}
+
+	l4 = trace_get_transport(packet, &proto, &l4_remaining);
+	if (!l4)
+		return status;
+	if (proto != TRACE_IPPROTO_TCP && proto != TRACE_IPPROTO_UDP &&
+			proto != TRACE_IPPROTO_ICMP &&
+			proto != TRACE_IPPROTO_ICMPV6)
+		return status;
+	if (end <= l4 || (uint32_t)(end - l4) > l4_remaining)
+		goto truncated;
+	l4_len = end - l4;
+
+	if (proto == TRACE_IPPROTO_ICMP) {
+		/* Unlike the others, ICMP for IPv4 has no pseudo header */
+		sum = 0;
+	} else {
+		/* A zero UDP checksum over IPv4 means there is none */
+		if (proto == TRACE_IPPROTO_UDP &&
+				ethertype == TRACE_ETHERTYPE_IP &&
+				l4_len >= 8 && l4[6] == 0 && l4[7] == 0)
+			return status;
+		sum += pseudo_sum(proto, l4_len);
+	}
+	good = fold(sum + sum_bytes(l4, l4_len)) == 0xffff;
+	status |= good ? PYTRACE_CHECKSUM_L4_GOOD : PYTRACE_CHECKSUM_L4_BAD;
+	count(proto, good, stats);
+	return status;
+
+truncated:
+	stats->truncated++;
+	return status | PYTRACE_CHECKSUM_TRUNCATED;
+}
+
+int pytrace_checksum_batch(const pytrace_batch_t *batch, uint8_t *status,
+		pytrace_checksum_stats_t *stats)
+{
+	int i, n = 0;
+
+	for (i = 0; i < batch->count; i++) {
+		status[i] = pytrace_checksum_packet(batch->packets[i], stats);
+		if (status[i] & (PYTRACE_CHECKSUM_L3_BAD |
+					PYTRACE_CHECKSUM_L4_BAD))
+			n++;
+	}
+	return n;
+}
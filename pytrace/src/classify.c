@@ -0,0 +1,252 @@
+/*
+ * Classification of packets against many rules in one pass.
+ *
+ * Running N BPF programs per packet means N walks over the same headers.
+ * Most reporting rules are just prefixes, ports and protocols, so those
+ * are tested against a 5-tuple decoded once per packet; only rules that
+ * need the full BPF language are run through libtrace.
+ *
+ * libtrace decodes more than BPF does: it looks through VLAN and MPLS tags
+ * and IPv6 extension headers, and has no transport header for a later
+ * fragment. A native match is only used for packets that both see the same
+ * way, plain IP at the link type's usual offset; every other packet is
+ * tested with the rule's BPF filter instead.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+#include "decode.h"
+
+struct rule {
+	pytrace_filter_t *filter;
+	int native;		/* Whether match may be used instead */
+	pytrace_match_t match;
+};
+
+struct pytrace_classifier_t {
+	int nrules;
+	int words;
+	struct rule *rules;
+	uint64_t *packets;
+	uint64_t *bytes;
+};
+
+pytrace_classifier_t *pytrace_classifier_create(int nrules)
+{
+	pytrace_classifier_t *c;
+
+	if (nrules <= 0)
+		return NULL;
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	c->nrules = nrules;
+	c->words = (nrules + 63) / 64;
+	c->rules = calloc(nrules, sizeof(*c->rules));
+	c->packets = calloc(nrules, sizeof(*c->packets));
+	c->bytes = calloc(nrules, sizeof(*c->bytes));
+	if (!c->rules || !c->packets || !c->bytes) {
+		pytrace_classifier_destroy(c);
+		return NULL;
+	}
+	return c;
+}
+
+void pytrace_classifier_destroy(pytrace_classifier_t *c)
+{
+	if (!c)
+		return;
+	free(c->rules);
+	free(c->packets);
+	free(c->bytes);
+	free(c);
+}
+
+void pytrace_classifier_set_match(pytrace_classifier_t *c, int rule,
+		const pytrace_match_t *match)
+{
+	c->rules[rule].native = 1;
+	c->rules[rule].match = *match;
+}
+
+void pytrace_classifier_set_filter(pytrace_classifier_t *c, int rule,
+		pytrace_filter_t *filter)
+{
+	c->rules[rule].filter = filter;
+}
+
+int pytrace_classifier_words(const pytrace_classifier_t *c)
+{
+	return c->words;
+}
+
+static int prefix_match(const uint8_t *addr, const uint8_t *net, int len)
+{
+	int bytes = len / 8, bits = len % 8;
+
+	if (memcmp(addr, net, bytes) != 0)
+		return 0;
+	if (bits == 0)
+		return 1;
+	return ((addr[bytes] ^ net[bytes]) & (0xff00 >> bits)) == 0;
+}
+
+static int has_ports(uint8_t proto)
+{
+	return proto == TRACE_IPPROTO_TCP || proto == TRACE_IPPROTO_UDP ||
+		proto == TRACE_IPPROTO_SCTP;
+}
+
+/* Whether BPF would decode the packet as libtrace does */
+static int plain_ip(libtrace_packet_t *packet)
+{
+	libtrace_linktype_t linktype;
+	uint32_t remaining;
+	uint16_t ethertype;
+	uint8_t *l2, *l3;
+
+	l2 = trace_get_layer2(packet, &linktype, &remaining);
+	l3 = trace_get_layer3(packet, &ethertype, &remaining);
+	if (!l2 || !l3)
+		return 0;
+
+	/* Tags would move the network header along */
+	switch (linktype) {
+	case TRACE_TYPE_ETH:
+		if (l3 - l2 != 14)
+			return 0;
+		break;
+	case TRACE_TYPE_LINUX_SLL:
+		if (l3 - l2 != 16)
+			return 0;
+		break;
+	case TRACE_TYPE_NONE:
+		if (l3 != l2)
+			return 0;
+		break;
+	default:
+		return 0;
+	}
+
+	if (ethertype == TRACE_ETHERTYPE_IP &&
+			remaining >= sizeof(libtrace_ip_t)) {
+		libtrace_ip_t *ip = (libtrace_ip_t *)l3;
+
+		/* BPF still sees the protocol of a later fragment */
+		return (ntohs(ip->ip_off) & 0x1fff) == 0;
+	}
+	if (ethertype == TRACE_ETHERTYPE_IPV6 &&
+			remaining >= sizeof(libtrace_ip6_t)) {
+		libtrace_ip6_t *ip6 = (libtrace_ip6_t *)l3;
+
+		/* BPF takes the first next header as the protocol */
+		switch (ip6->nxt) {
+		case 0:		/* Hop-by-hop options */
+		case 43:	/* Routing */
+		case 44:	/* Fragment */
+		case 50:	/* ESP */
+		case 51:	/* AH */
+		case 60:	/* Destination options */
+			return 0;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+static int match_key(const pytrace_match_t *m, const struct flow_key *key)
+{
+	uint32_t tests = m->tests;
+
+	if ((tests & PYTRACE_MATCH_VERSION) && key->ip_version != m->ip_version)
+		return 0;
+	if ((tests & PYTRACE_MATCH_PROTO) && key->proto != m->proto)
+		return 0;
+	if ((tests & PYTRACE_MATCH_SRC_NET) &&
+			!prefix_match(key->src, m->src, m->src_len))
+		return 0;
+	if ((tests & PYTRACE_MATCH_DST_NET) &&
+			!prefix_match(key->dst, m->dst, m->dst_len))
+		return 0;
+	if ((tests & PYTRACE_MATCH_NET) &&
+			!prefix_match(key->src, m->net, m->net_len) &&
+			!prefix_match(key->dst, m->net, m->net_len))
+		return 0;
+
+	if (!(tests & (PYTRACE_MATCH_SRC_PORT | PYTRACE_MATCH_DST_PORT |
+			PYTRACE_MATCH_PORT)))
+		return 1;
+	if (!has_ports(key->proto))
+		return 0;
+	if ((tests & PYTRACE_MATCH_SRC_PORT) && key->src_port != m->src_port)
+		return 0;
+	if ((tests & PYTRACE_MATCH_DST_PORT) && key->dst_port != m->dst_port)
+		return 0;
+	if ((tests & PYTRACE_MATCH_PORT) && key->src_port != m->port &&
+			key->dst_port != m->port)
+		return 0;
+	return 1;
+}
+
+int pytrace_classifier_batch(pytrace_classifier_t *c,
+		const pytrace_batch_t *batch, uint64_t *masks)
+{
+	struct flow_key key;
+	int i, r, ret;
+
+	for (i = 0; i < batch->count; i++) {
+		libtrace_packet_t *packet = batch->packets[i];
+		uint64_t *mask = masks ? masks + (size_t)i * c->words : NULL;
+		size_t wire = trace_get_wire_length(packet);
+		int plain = -1, decoded = -1;
+
+		if (mask)
+			memset(mask, 0, c->words * sizeof(*mask));
+
+		for (r = 0; r < c->nrules; r++) {
+			const struct rule *rule = &c->rules[r];
+
+			/* Decode lazily: a classifier made only of BPF
+			 * filters never needs the key */
+			if (rule->native && plain < 0)
+				plain = plain_ip(packet);
+			if (rule->native && plain) {
+				if (decoded < 0)
+					decoded = decode_flow_key(packet, &key);
+				ret = decoded && match_key(&rule->match, &key);
+			} else {
+				ret = pytrace_filter_apply(rule->filter,
+						packet);
+				if (ret < 0)
+					return -1;
+			}
+			if (!ret)
+				continue;
+			c->packets[r]++;
+			c->bytes[r] += wire;
+			if (mask)
+				mask[r / 64] |= (uint64_t)1 << (r % 64);
+		}
+	}
+	return 0;
+}
+
+const uint64_t *pytrace_classifier_packets(const pytrace_classifier_t *c)
+{
+	return c->packets;
+}
+
+const uint64_t *pytrace_classifier_bytes(const pytrace_classifier_t *c)
+{
+	return c->bytes;
+}
+
+void pytrace_classifier_reset(pytrace_classifier_t *c)
+{
+	memset(c->packets, 0, c->nrules * sizeof(*c->packets));
+	memset(c->bytes, 0, c->nrules * sizeof(*c->bytes));
+}
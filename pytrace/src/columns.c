@@ -0,0 +1,279 @@
+/*
+ * Columnar decoding.
+ *
+ * Walks a trace in one native loop and stores the commonly analysed
+ * header fields of every packet in contiguous arrays, laid out so that
+ * NumPy and Arrow can use them as they are.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+
+/* Grow (or first allocate) one column so it can hold capacity rows of
+ * width elements each. */
+#define GROW_N(cols, name, capacity, width) do { \
+	if ((cols)->name || (cols)->fields & col_##name) { \
+		void *p = realloc((cols)->name, \
+				(capacity) * (width) * sizeof(*(cols)->name)); \
+		if (!p) \
+			return -1; \
+		(cols)->name = p; \
+	} \
+} while (0)
+
+#define GROW(cols, name, capacity) GROW_N(cols, name, capacity, 1)
+
+enum {
+	col_timestamp = PYTRACE_COL_TIMESTAMP,
+	col_wire_length = PYTRACE_COL_WIRE_LENGTH,
+	col_capture_length = PYTRACE_COL_CAPTURE_LENGTH,
+	col_ip_version = PYTRACE_COL_IP_VERSION,
+	col_src_ip = PYTRACE_COL_SRC_IP,
+	col_dst_ip = PYTRACE_COL_DST_IP,
+	col_src_port = PYTRACE_COL_SRC_PORT,
+	col_dst_port = PYTRACE_COL_DST_PORT,
+	col_proto = PYTRACE_COL_PROTO,
+	col_tcp_flags = PYTRACE_COL_TCP_FLAGS,
+	col_src_addr = PYTRACE_COL_SRC_ADDR,
+	col_dst_addr = PYTRACE_COL_DST_ADDR,
+	col_vlan = PYTRACE_COL_VLAN,
+	col_tunnel_type = PYTRACE_COL_TUNNEL_TYPE,
+	col_tunnel_id = PYTRACE_COL_TUNNEL_ID
+};
+
+static int columns_reserve(pytrace_columns_t *cols, size_t capacity)
+{
+	if (capacity <= cols->capacity)
+		return 0;
+
+	GROW(cols, timestamp, capacity);
+	GROW(cols, wire_length, capacity);
+	GROW(cols, capture_length, capacity);
+	GROW(cols, ip_version, capacity);
+	GROW(cols, src_ip, capacity);
+	GROW(cols, dst_ip, capacity);
+	GROW(cols, src_port, capacity);
+	GROW(cols, dst_port, capacity);
+	GROW(cols, proto, capacity);
+	GROW(cols, tcp_flags, capacity);
+	GROW_N(cols, src_addr, capacity, 16);
+	GROW_N(cols, dst_addr, capacity, 16);
+	GROW(cols, vlan, capacity);
+	GROW(cols, tunnel_type, capacity);
+	GROW(cols, tunnel_id, capacity);
+	cols->capacity = capacity;
+	return 0;
+}
+
+pytrace_columns_t *pytrace_columns_create(uint32_t fields, size_t capacity)
+{
+	pytrace_columns_t *cols;
+
+	cols = calloc(1, sizeof(*cols));
+	if (!cols)
+		return NULL;
+	cols->fields = fields;
+	if (capacity < 1024)
+		capacity = 1024;
+	if (columns_reserve(cols, capacity) < 0) {
+		pytrace_columns_destroy(cols);
+		return NULL;
+	}
+	return cols;
+}
+
+void pytrace_columns_destroy(pytrace_columns_t *cols)
+{
+	if (!cols)
+		return;
+	free(cols->timestamp);
+	free(cols->wire_length);
+	free(cols->capture_length);
+	free(cols->ip_version);
+	free(cols->src_ip);
+	free(cols->dst_ip);
+	free(cols->src_port);
+	free(cols->dst_port);
+	free(cols->proto);
+	free(cols->tcp_flags);
+	free(cols->src_addr);
+	free(cols->dst_addr);
+	free(cols->vlan);
+	free(cols->tunnel_type);
+	free(cols->tunnel_id);
+	free(cols);
+}
+
+int pytrace_columns_reset(pytrace_columns_t *cols)
+{
+	size_t capacity = cols->capacity;
+
+	cols->count = 0;
+	cols->capacity = 0;
+	return columns_reserve(cols, capacity);
+}
+
+void pytrace_free(void *ptr)
+{
+	free(ptr);
+}
+
+void pytrace_erf_to_ns(uint64_t *timestamps, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		uint64_t ts = timestamps[i];
+
+		timestamps[i] = (ts >> 32) * 1000000000ULL +
+			(((ts & 0xffffffffULL) * 1000000000ULL) >> 32);
+	}
+}
+
+/* Store an address as 16 bytes, with IPv4 mapped into IPv6 (::ffff:a.b.c.d)
+ * and all zeros for none */
+static void store_addr(uint8_t *out, const void *addr, int ip_version)
+{
+	memset(out, 0, 16);
+	if (ip_version == 4) {
+		out[10] = out[11] = 0xff;
+		memcpy(out + 12, addr, 4);
+	} else if (ip_version == 6) {
+		memcpy(out, addr, 16);
+	}
+}
+
+/* Fill the VLAN and tunnel columns of a row from its encapsulations */
+static void store_encaps(pytrace_columns_t *cols, size_t n,
+		libtrace_packet_t *packet)
+{
+	pytrace_decap_t d;
+	uint16_t vlan = 0;
+	uint8_t type = 0;
+	uint32_t id = 0;
+	int i;
+
+	pytrace_decap(packet, &d);
+	for (i = 0; i < d.nencaps; i++) {
+		if (d.encaps[i].type == PYTRACE_ENCAP_VLAN) {
+			if (!vlan)
+				vlan = d.encaps[i].id;
+		} else if (!type) {
+			type = d.encaps[i].type;
+			id = d.encaps[i].id;
+		}
+	}
+	if (cols->fields & PYTRACE_COL_VLAN)
+		cols->vlan[n] = vlan;
+	if (cols->fields & PYTRACE_COL_TUNNEL_TYPE)
+		cols->tunnel_type[n] = type;
+	if (cols->fields & PYTRACE_COL_TUNNEL_ID)
+		cols->tunnel_id[n] = id;
+}
+
+static void columns_append(pytrace_columns_t *cols, libtrace_packet_t *packet)
+{
+	size_t n = cols->count;
+	uint32_t fields = cols->fields;
+	uint8_t proto = 0;
+	uint32_t remaining = 0;
+	uint16_t ethertype = 0;
+	void *l3 = NULL;
+	void *l4;
+	const void *src = NULL, *dst = NULL;
+	int version = 0;
+
+	if (fields & PYTRACE_COL_TIMESTAMP)
+		cols->timestamp[n] = trace_get_erf_timestamp(packet);
+	if (fields & PYTRACE_COL_WIRE_LENGTH)
+		cols->wire_length[n] = trace_get_wire_length(packet);
+	if (fields & PYTRACE_COL_CAPTURE_LENGTH)
+		cols->capture_length[n] = trace_get_capture_length(packet);
+
+	if (fields & (PYTRACE_COL_IP_VERSION | PYTRACE_COL_SRC_IP |
+				PYTRACE_COL_DST_IP | PYTRACE_COL_SRC_ADDR |
+				PYTRACE_COL_DST_ADDR)) {
+		l3 = trace_get_layer3(packet, &ethertype, &remaining);
+		if (l3 && ethertype == TRACE_ETHERTYPE_IP &&
+				remaining < sizeof(libtrace_ip_t))
+			l3 = NULL;
+		if (l3 && ethertype == TRACE_ETHERTYPE_IPV6 &&
+				remaining < sizeof(libtrace_ip6_t))
+			l3 = NULL;
+		if (l3 && ethertype == TRACE_ETHERTYPE_IP) {
+			version = 4;
+			src = &((libtrace_ip_t *)l3)->ip_src;
+			dst = &((libtrace_ip_t *)l3)->ip_dst;
+		} else if (l3 && ethertype == TRACE_ETHERTYPE_IPV6) {
+			version = 6;
+			src = &((libtrace_ip6_t *)l3)->ip_src;
+			dst = &((libtrace_ip6_t *)l3)->ip_dst;
+		}
+	}
+	if (fields & PYTRACE_COL_IP_VERSION)
+		cols->ip_version[n] = version;
+	if (fields & PYTRACE_COL_SRC_IP) {
+		cols->src_ip[n] = (l3 && ethertype == TRACE_ETHERTYPE_IP) ?
+			ntohl(((libtrace_ip_t *)l3)->ip_src.s_addr) : 0;
+	}
+	if (fields & PYTRACE_COL_DST_IP) {
+		cols->dst_ip[n] = (l3 && ethertype == TRACE_ETHERTYPE_IP) ?
+			ntohl(((libtrace_ip_t *)l3)->ip_dst.s_addr) : 0;
+	}
+	if (fields & PYTRACE_COL_SRC_ADDR)
+		store_addr(cols->src_addr + n * 16, src, version);
+	if (fields & PYTRACE_COL_DST_ADDR)
+		store_addr(cols->dst_addr + n * 16, dst, version);
+
+	if (fields & PYTRACE_COL_SRC_PORT)
+		cols->src_port[n] = trace_get_source_port(packet);
+	if (fields & PYTRACE_COL_DST_PORT)
+		cols->dst_port[n] = trace_get_destination_port(packet);
+
+	if (fields & (PYTRACE_COL_PROTO | PYTRACE_COL_TCP_FLAGS)) {
+		l4 = trace_get_transport(packet, &proto, &remaining);
+		if (!l4)
+			proto = 0;
+		if (fields & PYTRACE_COL_PROTO)
+			cols->proto[n] = proto;
+		if (fields & PYTRACE_COL_TCP_FLAGS) {
+			/* The flag bits live in the 14th byte of the header */
+			cols->tcp_flags[n] = (l4 && proto == TRACE_IPPROTO_TCP
+					&& remaining >= 14) ?
+				((uint8_t *)l4)[13] : 0;
+		}
+	}
+
+	if (fields & (PYTRACE_COL_VLAN | PYTRACE_COL_TUNNEL_TYPE |
+				PYTRACE_COL_TUNNEL_ID))
+		store_encaps(cols, n, packet);
+
+	cols->count = n + 1;
+}
+
+int pytrace_columns_read(pytrace_reader_t *reader, libtrace_packet_t *packet,
+		pytrace_columns_t *cols, size_t limit)
+{
+	size_t appended = 0;
+	int status;
+
+	while (limit == 0 || appended < limit) {
+		if (cols->count == cols->capacity &&
+				columns_reserve(cols, cols->capacity * 2) < 0)
+			return -2;
+
+		status = pytrace_reader_read(reader, packet);
+		if (status == 0)
+			return 0;
+		if (status < 0)
+			return -1;
+
+		columns_append(cols, packet);
+		appended++;
+	}
+	return 1;
+}
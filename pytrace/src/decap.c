@@ -0,0 +1,205 @@
+/*
+ * One-call decapsulation down to the innermost IP header.
+ *
+ * libtrace has a helper to step over each kind of header, but chaining
+ * them from Python costs a boundary crossing per hop. This walks the
+ * whole stack natively and records where every layer starts.
+ */
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+
+#define ETHERTYPE_VLAN		0x8100
+#define ETHERTYPE_QINQ		0x88a8
+#define ETHERTYPE_MPLS		0x8847
+#define ETHERTYPE_PPPOE		0x8864
+#define ETHERTYPE_TEB		0x6558	/* Transparent Ethernet bridging */
+
+#define ENCAP_MAX	8
+
+static uint16_t get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static int push(pytrace_decap_t *out, uint32_t type, uint32_t id,
+		const unsigned char *base, const unsigned char *p)
+{
+	pytrace_encap_t *e;
+
+	if (out->nencaps == ENCAP_MAX)
+		return 0;
+	e = &out->encaps[out->nencaps++];
+	e->type = type;
+	e->id = id;
+	e->offset = p - base;
+	return 1;
+}
+
+/* Step over an Ethernet header carried inside a tunnel */
+static unsigned char *inner_ethernet(unsigned char *p, uint16_t *type,
+		uint32_t *rem)
+{
+	if (!p)
+		return NULL;
+	return trace_get_payload_from_layer2(p, TRACE_TYPE_ETH, type, rem);
+}
+
+/* Record a complete IP header and return its payload */
+static unsigned char *ip_header(pytrace_decap_t *out, unsigned char *base,
+		unsigned char *p, uint16_t type, uint8_t *proto, uint32_t *rem)
+{
+	if (*rem < (type == TRACE_ETHERTYPE_IP ? sizeof(libtrace_ip_t) :
+			sizeof(libtrace_ip6_t)))
+		return NULL;
+
+	out->inner_l3 = p - base;
+	out->inner_ethertype = type;
+	if (out->outer_l3 == PYTRACE_DECAP_NONE) {
+		out->outer_l3 = out->inner_l3;
+		out->outer_ethertype = type;
+	}
+
+	memset(out->src, 0, sizeof(out->src));
+	memset(out->dst, 0, sizeof(out->dst));
+	out->src_port = 0;
+	out->dst_port = 0;
+	if (type == TRACE_ETHERTYPE_IP) {
+		libtrace_ip_t *ip = (libtrace_ip_t *)p;
+
+		out->ip_version = 4;
+		memcpy(out->src, &ip->ip_src, 4);
+		memcpy(out->dst, &ip->ip_dst, 4);
+		p = trace_get_payload_from_ip(ip, proto, rem);
+	} else {
+		libtrace_ip6_t *ip6 = (libtrace_ip6_t *)p;
+
+		out->ip_version = 6;
+		memcpy(out->src, &ip6->ip_src, 16);
+		memcpy(out->dst, &ip6->ip_dst, 16);
+		p = trace_get_payload_from_ip6(ip6, proto, rem);
+	}
+	out->proto = *proto;
+	return p;
+}
+
+int pytrace_decap(const libtrace_packet_t *packet, pytrace_decap_t *out)
+{
+	libtrace_linktype_t linktype;
+	unsigned char *base, *p;
+	uint16_t type = 0;
+	uint32_t rem;
+	uint8_t proto = 0;
+
+	memset(out, 0, sizeof(*out));
+	out->outer_l3 = PYTRACE_DECAP_NONE;
+	out->inner_l3 = PYTRACE_DECAP_NONE;
+	out->inner_l4 = PYTRACE_DECAP_NONE;
+
+	base = trace_get_layer2(packet, &linktype, &rem);
+	if (!base)
+		return 0;
+	p = trace_get_payload_from_layer2(base, linktype, &type, &rem);
+
+	while (p) {
+		switch (type) {
+		case ETHERTYPE_VLAN:
+		case ETHERTYPE_QINQ:
+			if (rem < 2 || !push(out, PYTRACE_ENCAP_VLAN,
+					get16(p) & 0xfff, base, p))
+				return out->ip_version != 0;
+			p = trace_get_payload_from_vlan(p, &type, &rem);
+			continue;
+		case ETHERTYPE_MPLS:
+			if (rem < 4 || !push(out, PYTRACE_ENCAP_MPLS,
+					get32(p) >> 12, base, p))
+				return out->ip_version != 0;
+			p = trace_get_payload_from_mpls(p, &type, &rem);
+			/* 0 means an Ethernet pseudowire follows */
+			if (type == 0)
+				p = inner_ethernet(p, &type, &rem);
+			continue;
+		case ETHERTYPE_PPPOE:
+			if (rem < 4 || !push(out, PYTRACE_ENCAP_PPPOE,
+					get16(p + 2), base, p))
+				return out->ip_version != 0;
+			p = trace_get_payload_from_pppoe(p, &type, &rem);
+			continue;
+		case TRACE_ETHERTYPE_IP:
+		case TRACE_ETHERTYPE_IPV6:
+			break;
+		default:
+			return out->ip_version != 0;
+		}
+
+		p = ip_header(out, base, p, type, &proto, &rem);
+		if (!p)
+			break;
+
+		if (proto == TRACE_IPPROTO_GRE && rem >= 4) {
+			uint16_t flags = get16(p);
+			uint32_t at = (flags & LIBTRACE_GRE_FLAG_CHECKSUM) ? 8 : 4;
+			uint32_t key = 0;
+
+			if ((flags & LIBTRACE_GRE_FLAG_KEY) && rem >= at + 4)
+				key = get32(p + at);
+			if (!push(out, PYTRACE_ENCAP_GRE, key, base, p))
+				break;
+			type = get16(p + 2);
+			p = trace_get_payload_from_gre((libtrace_gre_t *)p, &rem);
+			if (type == ETHERTYPE_TEB)
+				p = inner_ethernet(p, &type, &rem);
+			continue;
+		}
+		if (proto == TRACE_IPPROTO_UDP) {
+			uint32_t left = rem;
+			libtrace_vxlan_t *vx;
+
+			vx = trace_get_vxlan_from_udp((libtrace_udp_t *)p, &left);
+			if (vx) {
+				if (!push(out, PYTRACE_ENCAP_VXLAN,
+						get32(vx->vni) >> 8, base,
+						(unsigned char *)vx))
+					break;
+				rem = left;
+				p = trace_get_payload_from_vxlan(vx, &rem);
+				p = inner_ethernet(p, &type, &rem);
+				continue;
+			}
+		}
+		if (proto == TRACE_IPPROTO_IPIP || proto == TRACE_IPPROTO_IPV6) {
+			if (!push(out, PYTRACE_ENCAP_IPIP, 0, base, p))
+				break;
+			type = proto == TRACE_IPPROTO_IPIP ? TRACE_ETHERTYPE_IP :
+				TRACE_ETHERTYPE_IPV6;
+			continue;
+		}
+
+		/* Not a tunnel, so this is the innermost transport header */
+		out->inner_l4 = p - base;
+		if ((proto == TRACE_IPPROTO_TCP || proto == TRACE_IPPROTO_UDP ||
+				proto == TRACE_IPPROTO_SCTP) && rem >= 4) {
+			out->src_port = get16(p);
+			out->dst_port = get16(p + 2);
+		}
+		break;
+	}
+	return out->ip_version != 0;
+}
+
+int pytrace_decap_batch(const pytrace_batch_t *batch, pytrace_decap_t *out)
+{
+	int i, n = 0;
+
+	for (i = 0; i < batch->count; i++)
+		n += pytrace_decap(batch->packets[i], &out[i]);
+	return n;
+}
@@ -0,0 +1,96 @@
+/*
+ * Shared decoding helpers.
+ */
+
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <libtrace.h>
+#include "decode.h"
+
+int decode_flow_key(const libtrace_packet_t *packet, struct flow_key *key)
+{
+	struct sockaddr_storage ss;
+	struct sockaddr *sa = (struct sockaddr *)&ss;
+	uint8_t proto = 0;
+	uint32_t remaining;
+
+	memset(key, 0, sizeof(*key));
+
+	if (!trace_get_source_address(packet, sa))
+		return 0;
+	if (sa->sa_family == AF_INET) {
+		memcpy(key->src, &((struct sockaddr_in *)sa)->sin_addr, 4);
+		key->ip_version = 4;
+	} else if (sa->sa_family == AF_INET6) {
+		memcpy(key->src, &((struct sockaddr_in6 *)sa)->sin6_addr, 16);
+		key->ip_version = 6;
+	} else {
+		return 0;
+	}
+
+	if (!trace_get_destination_address(packet, sa))
+		return 0;
+	if (sa->sa_family == AF_INET)
+		memcpy(key->dst, &((struct sockaddr_in *)sa)->sin_addr, 4);
+	else if (sa->sa_family == AF_INET6)
+		memcpy(key->dst, &((struct sockaddr_in6 *)sa)->sin6_addr, 16);
+
+	if (trace_get_transport(packet, &proto, &remaining))
+		key->proto = proto;
+	key->src_port = trace_get_source_port(packet);
+	key->dst_port = trace_get_destination_port(packet);
+	return 1;
+}
+
+/* The finaliser from MurmurHash3 */
+static inline uint64_t mix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed)
+{
+	const uint8_t *p = data;
+	uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+	uint64_t w;
+
+	while (len >= 8) {
+		memcpy(&w, p, 8);
+		h = mix64(h ^ w) + 0x9e3779b97f4a7c15ULL;
+		p += 8;
+		len -= 8;
+	}
+	w = 0;
+	memcpy(&w, p, len);
+	return mix64(h ^ w);
+}
+
+uint64_t flow_key_hash(const struct flow_key *key, uint64_t seed)
+{
+	return hash_bytes(key, sizeof(*key), seed);
+}
+
+uint64_t flow_key_symmetric_hash(const struct flow_key *key, uint64_t seed)
+{
+	struct flow_key k;
+	int order;
+
+	order = memcmp(key->src, key->dst, sizeof(key->src));
+	if (order < 0 || (order == 0 && key->src_port <= key->dst_port))
+		return flow_key_hash(key, seed);
+
+	/* Put the lower endpoint first */
+	k = *key;
+	memcpy(k.src, key->dst, sizeof(k.src));
+	memcpy(k.dst, key->src, sizeof(k.dst));
+	k.src_port = key->dst_port;
+	k.dst_port = key->src_port;
+	return flow_key_hash(&k, seed);
+}
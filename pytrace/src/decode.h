@@ -0,0 +1,39 @@
+/*
+ * Internal decoding helpers shared by the native packet stages.
+ *
+ * Unlike pytrace.h, this header is never passed to cffi.
+ */
+
+#ifndef PYTRACE_DECODE_H
+#define PYTRACE_DECODE_H
+
+#include <stdint.h>
+
+#include <libtrace.h>
+
+/** A 5-tuple laid out so that two keys can be compared with memcmp().
+ * IPv4 addresses occupy the first 4 bytes of src/dst; unused bytes and
+ * the padding are always zero. */
+struct flow_key {
+	uint8_t src[16];
+	uint8_t dst[16];
+	uint16_t src_port;	/* Host byte order */
+	uint16_t dst_port;	/* Host byte order */
+	uint8_t proto;
+	uint8_t ip_version;	/* 4 or 6 */
+	uint8_t pad[2];
+};
+
+/* Extract the 5-tuple of a packet. Returns 0 if the packet is not IP. */
+int decode_flow_key(const libtrace_packet_t *packet, struct flow_key *key);
+
+/* Hash a 5-tuple */
+uint64_t flow_key_hash(const struct flow_key *key, uint64_t seed);
+
+/* Hash a 5-tuple so that both directions of a flow hash the same */
+uint64_t flow_key_symmetric_hash(const struct flow_key *key, uint64_t seed);
+
+/* Hash an arbitrary run of bytes */
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed);
+
+#endif
@@ -0,0 +1,201 @@
+/*
+ * Removal of duplicated packets, such as those a SPAN port sends twice.
+ *
+ * Each packet is identified by a hash of its layer 3 header and payload,
+ * with the fields a router may change on the way (the IPv4 TTL and
+ * checksum, the IPv6 hop limit) zeroed first, so that copies taken on
+ * either side of a hop still match. The link layer is ignored entirely.
+ * The hashes of recent packets are kept in a fixed ring, indexed by a
+ * chained hash table; a packet is dropped if the same hash was seen less
+ * than the window ago. Once the ring is full the oldest hash is forgotten.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+#include "decode.h"
+
+/* The largest IPv4 header */
+#define IPV4_HEADER_MAX	60
+#define IPV6_HEADER_LEN	40
+
+struct recent {
+	uint64_t hash;
+	uint64_t ts;
+	int32_t next;		/* Hash chain, or -1 */
+};
+
+struct dedup {
+	pytrace_reader_t base;
+	pytrace_reader_t *input;
+	uint64_t window;
+
+	struct recent *ring;
+	uint32_t capacity;
+	uint32_t count;
+	uint32_t head;		/* The slot to fill next */
+	int32_t *buckets;
+	uint32_t nbuckets;	/* Always a power of two */
+
+	pytrace_dedup_stats_t stats;
+};
+
+/* Hash a packet's layer 3 header and payload without its mutable fields.
+ * Returns 0 if the packet has no layer 3 header. */
+static int dedup_hash(const libtrace_packet_t *packet, uint64_t *hash)
+{
+	unsigned char header[IPV4_HEADER_MAX];
+	uint16_t ethertype;
+	uint32_t remaining, total, len = 0;
+	unsigned char *l3;
+
+	l3 = trace_get_layer3(packet, &ethertype, &remaining);
+	if (!l3)
+		return 0;
+	total = remaining;
+
+	if (ethertype == TRACE_ETHERTYPE_IP && remaining >= 20) {
+		len = (l3[0] & 0x0f) * 4;
+		if (len < 20 || len > remaining)
+			len = 20;
+		memcpy(header, l3, len);
+		header[8] = 0;			/* TTL */
+		header[10] = header[11] = 0;	/* Checksum */
+		total = (l3[2] << 8) | l3[3];
+	} else if (ethertype == TRACE_ETHERTYPE_IPV6 &&
+			remaining >= IPV6_HEADER_LEN) {
+		len = IPV6_HEADER_LEN;
+		memcpy(header, l3, len);
+		header[7] = 0;			/* Hop limit */
+		total = IPV6_HEADER_LEN + ((l3[4] << 8) | l3[5]);
+	}
+
+	/* Stop at the end of the datagram: link layer padding after it
+	 * differs between copies with and without a VLAN tag */
+	if (total > remaining)
+		total = remaining;
+	if (total < len)
+		total = len;
+
+	*hash = hash_bytes(header, len, ethertype);
+	*hash = hash_bytes(l3 + len, total - len, *hash);
+	return 1;
+}
+
+static void ring_unlink(struct dedup *d, uint32_t slot)
+{
+	int32_t *p = &d->buckets[d->ring[slot].hash & (d->nbuckets - 1)];
+
+	while (*p != (int32_t)slot)
+		p = &d->ring[*p].next;
+	*p = d->ring[slot].next;
+}
+
+/* Returns 1 if the packet repeats a recent one, otherwise remembers it and
+ * returns 0 */
+static int dedup_check(struct dedup *d, uint64_t hash, uint64_t ts)
+{
+	int32_t *bucket = &d->buckets[hash & (d->nbuckets - 1)];
+	struct recent *r;
+	int32_t i;
+
+	for (i = *bucket; i >= 0; i = d->ring[i].next) {
+		r = &d->ring[i];
+		/* Copies can arrive slightly out of order */
+		if (r->hash == hash &&
+				(ts >= r->ts ? ts - r->ts : r->ts - ts) <=
+				d->window)
+			return 1;
+	}
+
+	if (d->count == d->capacity)
+		ring_unlink(d, d->head);
+	else
+		d->count++;
+	r = &d->ring[d->head];
+	r->hash = hash;
+	r->ts = ts;
+	r->next = *bucket;
+	*bucket = d->head;
+	d->head = (d->head + 1) & (d->capacity - 1);
+	return 0;
+}
+
+static int dedup_read(pytrace_reader_t *reader, libtrace_packet_t *packet)
+{
+	struct dedup *d = (struct dedup *)reader;
+	pytrace_reader_t *input = d->input;
+	uint64_t hash;
+	int len;
+
+	for (;;) {
+		len = pytrace_reader_read(input, packet);
+		if (len < 0) {
+			if (input->trace && !input->error[0]) {
+				libtrace_err_t err = trace_get_err(input->trace);
+				snprintf(d->base.error, sizeof(d->base.error),
+						"%s", err.problem);
+			} else {
+				snprintf(d->base.error, sizeof(d->base.error),
+						"%s", input->error);
+			}
+			return -1;
+		}
+		if (len == 0)
+			return 0;
+
+		d->stats.packets++;
+		if (!dedup_hash(packet, &hash)) {
+			d->stats.unhashed++;
+			return len;
+		}
+		if (!dedup_check(d, hash, trace_get_erf_timestamp(packet)))
+			return len;
+		d->stats.duplicates++;
+	}
+}
+
+static void dedup_destroy(pytrace_reader_t *reader)
+{
+	struct dedup *d = (struct dedup *)reader;
+
+	free(d->ring);
+	free(d->buckets);
+	free(d);
+}
+
+pytrace_reader_t *pytrace_dedup_create(pytrace_reader_t *input,
+		uint32_t capacity, uint64_t window)
+{
+	struct dedup *d;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return NULL;
+	d->base.read = dedup_read;
+	d->base.destroy = dedup_destroy;
+	d->input = input;
+	d->window = window;
+
+	d->capacity = 16;
+	while (d->capacity < capacity && d->capacity < (1U << 30))
+		d->capacity *= 2;
+	d->nbuckets = d->capacity;
+	d->ring = calloc(d->capacity, sizeof(*d->ring));
+	d->buckets = malloc(d->nbuckets * sizeof(*d->buckets));
+	if (!d->ring || !d->buckets) {
+		dedup_destroy(&d->base);
+		return NULL;
+	}
+	memset(d->buckets, 0xff, d->nbuckets * sizeof(*d->buckets));
+	return &d->base;
+}
+
+void pytrace_dedup_stats(pytrace_reader_t *reader,
+		pytrace_dedup_stats_t *stats)
+{
+	*stats = ((struct dedup *)reader)->stats;
+}
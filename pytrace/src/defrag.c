@@ -0,0 +1,649 @@
+/*
+ * IPv4 and IPv6 fragment reassembly.
+ *
+ * Fragments are copied into a cache keyed on (source, destination,
+ * identification, protocol). Once every byte of a datagram has arrived it
+ * is rebuilt behind its first fragment's headers and returned as a raw IP
+ * packet attached to a dead pcapfile trace, just like the packets of the
+ * native pcap reader.
+ */
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+#include "pcap.h"
+#include "decode.h"
+
+/* The most header bytes kept in front of the fragment data: an IPv4
+ * header with options, or an IPv6 header with its hop-by-hop, routing and
+ * destination options headers */
+#define HEADER_MAX	512
+
+#define SOURCE_BUCKETS	4096
+
+struct frag_key {
+	uint8_t src[16];
+	uint8_t dst[16];
+	uint32_t id;
+	uint8_t proto;
+	uint8_t ip_version;
+	uint8_t pad[2];
+};
+
+/* Where a fragment's pieces are within its packet */
+struct frag_info {
+	struct frag_key key;
+	const unsigned char *l3;
+	uint32_t header_len;	/* Bytes of l3 kept as the datagram's header */
+	uint32_t nxt_pos;	/* IPv6: offset of the next header field that
+				 * points at the fragment header */
+	const unsigned char *data;
+	uint32_t offset;
+	uint32_t len;
+	int more;
+};
+
+struct fragment {
+	struct fragment *next;
+	uint32_t offset;
+	uint32_t len;
+	unsigned char data[];
+};
+
+struct source {
+	struct source *next;
+	uint8_t addr[16];
+	uint8_t ip_version;
+	uint32_t count;		/* Incomplete datagrams from this address */
+};
+
+struct datagram {
+	struct datagram *hnext;	/* Hash chain */
+	struct datagram *prev;	/* Creation order, oldest first */
+	struct datagram *next;
+	struct frag_key key;
+	uint64_t hash;
+	uint64_t first;		/* Timestamp of the first fragment seen */
+	struct source *source;
+	struct fragment *frags;	/* Sorted on offset */
+	uint64_t bytes;
+	uint32_t total;		/* Payload length, once have_last is set */
+	int have_last;
+	uint32_t header_len;	/* 0 until the offset 0 fragment arrives */
+	uint32_t nxt_pos;
+	unsigned char header[HEADER_MAX];
+};
+
+struct defrag {
+	pytrace_reader_t base;
+	pytrace_reader_t *input;
+	libtrace_t *dead;
+	struct pcap_format fmt;
+
+	struct datagram **table;
+	uint32_t nbuckets;	/* Always a power of two */
+	uint64_t ndatagrams;
+	struct datagram *oldest;
+	struct datagram *newest;
+	struct source **sources;
+
+	uint64_t max_bytes;
+	uint32_t max_per_source;
+	uint64_t timeout;
+	uint64_t bytes;
+	pytrace_defrag_stats_t stats;
+};
+
+static int parse_ipv4(const unsigned char *l3, uint32_t remaining,
+		struct frag_info *info)
+{
+	const libtrace_ip_t *ip = (const libtrace_ip_t *)l3;
+	uint32_t hl, total;
+	uint16_t off;
+
+	if (remaining < sizeof(libtrace_ip_t))
+		return 0;
+	hl = ip->ip_hl * 4;
+	off = ntohs(ip->ip_off);
+	if (hl < sizeof(libtrace_ip_t) || (off & 0x3fff) == 0)
+		return 0;
+
+	/* Truncated by the snap length, so the data can't be used */
+	total = ntohs(ip->ip_len);
+	if (total < hl || total > remaining)
+		return -1;
+
+	memcpy(info->key.src, &ip->ip_src, 4);
+	memcpy(info->key.dst, &ip->ip_dst, 4);
+	info->key.id = (uint16_t)ntohs(ip->ip_id);
+	info->key.proto = ip->ip_p;
+	info->key.ip_version = 4;
+	info->header_len = hl;
+	info->nxt_pos = 0;
+	info->data = l3 + hl;
+	info->offset = (off & 0x1fff) * 8;
+	info->len = total - hl;
+	info->more = (off & 0x2000) != 0;
+	return 1;
+}
+
+static int parse_ipv6(const unsigned char *l3, uint32_t remaining,
+		struct frag_info *info)
+{
+	const libtrace_ip6_t *ip6 = (const libtrace_ip6_t *)l3;
+	const libtrace_ip6_frag_t *frag;
+	uint32_t pos = sizeof(libtrace_ip6_t), nxt_pos = 6, end;
+	uint16_t off;
+	uint8_t nxt;
+
+	if (remaining < sizeof(libtrace_ip6_t))
+		return 0;
+
+	/* Hop-by-hop options share number 0 with TRACE_IPPROTO_IP */
+	nxt = ip6->nxt;
+	while (nxt == TRACE_IPPROTO_IP || nxt == TRACE_IPPROTO_ROUTING ||
+			nxt == TRACE_IPPROTO_DSTOPTS) {
+		const libtrace_ip6_ext_t *ext;
+
+		if (pos + sizeof(*ext) > remaining)
+			return 0;
+		ext = (const libtrace_ip6_ext_t *)(l3 + pos);
+		nxt_pos = pos;
+		nxt = ext->nxt;
+		pos += (ext->len + 1) * 8;
+	}
+	if (nxt != TRACE_IPPROTO_FRAGMENT)
+		return 0;
+	if (pos + sizeof(*frag) > remaining)
+		return -1;
+
+	frag = (const libtrace_ip6_frag_t *)(l3 + pos);
+	off = ntohs(frag->frag_off);
+	/* An atomic fragment stands alone (RFC 6946) */
+	if ((off & 0xfff9) == 0)
+		return 0;
+
+	end = sizeof(libtrace_ip6_t) + ntohs(ip6->plen);
+	if (end < pos + sizeof(*frag) || end > remaining || pos > HEADER_MAX)
+		return -1;
+
+	memcpy(info->key.src, &ip6->ip_src, 16);
+	memcpy(info->key.dst, &ip6->ip_dst, 16);
+	info->key.id = ntohl(frag->ident);
+	info->key.proto = frag->nxt;
+	info->key.ip_version = 6;
+	info->header_len = pos;
+	info->nxt_pos = nxt_pos;
+	info->data = l3 + pos + sizeof(*frag);
+	info->offset = off & 0xfff8;
+	info->len = end - pos - sizeof(*frag);
+	info->more = off & 1;
+	return 1;
+}
+
+/* Returns 1 for a fragment, 0 for anything else or -1 for a fragment
+ * that can't be reassembled */
+static int parse_fragment(const libtrace_packet_t *packet,
+		struct frag_info *info)
+{
+	uint16_t ethertype;
+	uint32_t remaining;
+	int ret;
+
+	info->l3 = trace_get_layer3(packet, &ethertype, &remaining);
+	if (!info->l3)
+		return 0;
+
+	memset(&info->key, 0, sizeof(info->key));
+	if (ethertype == TRACE_ETHERTYPE_IP)
+		ret = parse_ipv4(info->l3, remaining, info);
+	else if (ethertype == TRACE_ETHERTYPE_IPV6)
+		ret = parse_ipv6(info->l3, remaining, info);
+	else
+		return 0;
+
+	if (ret > 0 && info->more && (info->len == 0 || info->len % 8))
+		return -1;
+	if (ret > 0 && info->offset + info->len > 65535)
+		return -1;
+	return ret;
+}
+
+static struct source **source_slot(struct defrag *d, const uint8_t *addr,
+		uint8_t ip_version)
+{
+	struct source **p;
+	uint64_t h = hash_bytes(addr, 16, ip_version);
+
+	for (p = &d->sources[h & (SOURCE_BUCKETS - 1)]; *p; p = &(*p)->next) {
+		if ((*p)->ip_version == ip_version &&
+				memcmp((*p)->addr, addr, 16) == 0)
+			break;
+	}
+	return p;
+}
+
+static void source_release(struct defrag *d, struct source *src)
+{
+	struct source **p;
+
+	if (--src->count)
+		return;
+	p = source_slot(d, src->addr, src->ip_version);
+	*p = src->next;
+	free(src);
+}
+
+static void datagram_remove(struct defrag *d, struct datagram *dg)
+{
+	struct datagram **p = &d->table[dg->hash & (d->nbuckets - 1)];
+	struct fragment *f;
+
+	while (*p != dg)
+		p = &(*p)->hnext;
+	*p = dg->hnext;
+
+	if (dg->prev)
+		dg->prev->next = dg->next;
+	else
+		d->oldest = dg->next;
+	if (dg->next)
+		dg->next->prev = dg->prev;
+	else
+		d->newest = dg->prev;
+
+	if (dg->source)
+		source_release(d, dg->source);
+	while ((f = dg->frags)) {
+		dg->frags = f->next;
+		free(f);
+	}
+	d->bytes -= dg->bytes;
+	d->ndatagrams--;
+	free(dg);
+}
+
+static int table_grow(struct defrag *d)
+{
+	uint32_t nbuckets = d->nbuckets * 2;
+	struct datagram **table;
+	struct datagram *dg;
+
+	table = calloc(nbuckets, sizeof(*table));
+	if (!table)
+		return -1;
+	for (dg = d->oldest; dg; dg = dg->next) {
+		dg->hnext = table[dg->hash & (nbuckets - 1)];
+		table[dg->hash & (nbuckets - 1)] = dg;
+	}
+	free(d->table);
+	d->table = table;
+	d->nbuckets = nbuckets;
+	return 0;
+}
+
+static struct datagram *datagram_find(struct defrag *d,
+		const struct frag_key *key, uint64_t hash)
+{
+	struct datagram *dg;
+
+	for (dg = d->table[hash & (d->nbuckets - 1)]; dg; dg = dg->hnext) {
+		if (dg->hash == hash && memcmp(&dg->key, key, sizeof(*key)) == 0)
+			return dg;
+	}
+	return NULL;
+}
+
+/* Returns the new datagram, or NULL with *error set to -1 if allocation
+ * failed or 0 if the source is over its limit */
+static struct datagram *datagram_create(struct defrag *d,
+		const struct frag_key *key, uint64_t hash, uint64_t ts,
+		int *error)
+{
+	struct source **slot = NULL;
+	struct datagram *dg;
+	uint32_t b;
+
+	*error = -1;
+	if (d->max_per_source) {
+		slot = source_slot(d, key->src, key->ip_version);
+		if (*slot && (*slot)->count >= d->max_per_source) {
+			*error = 0;
+			return NULL;
+		}
+		if (!*slot) {
+			*slot = calloc(1, sizeof(**slot));
+			if (!*slot)
+				return NULL;
+			memcpy((*slot)->addr, key->src, 16);
+			(*slot)->ip_version = key->ip_version;
+		}
+		(*slot)->count++;
+	}
+
+	if ((d->ndatagrams >= d->nbuckets && table_grow(d) < 0) ||
+			!(dg = calloc(1, sizeof(*dg)))) {
+		if (slot)
+			source_release(d, *slot);
+		return NULL;
+	}
+
+	dg->key = *key;
+	dg->hash = hash;
+	dg->first = ts;
+	dg->source = slot ? *slot : NULL;
+
+	b = hash & (d->nbuckets - 1);
+	dg->hnext = d->table[b];
+	d->table[b] = dg;
+	dg->prev = d->newest;
+	if (d->newest)
+		d->newest->next = dg;
+	else
+		d->oldest = dg;
+	d->newest = dg;
+	d->ndatagrams++;
+	return dg;
+}
+
+static int datagram_add(struct defrag *d, struct datagram *dg,
+		const struct frag_info *info)
+{
+	struct fragment **pos = &dg->frags;
+	struct fragment *f;
+
+	f = malloc(sizeof(*f) + info->len);
+	if (!f)
+		return -1;
+	f->offset = info->offset;
+	f->len = info->len;
+	memcpy(f->data, info->data, info->len);
+
+	while (*pos && (*pos)->offset <= f->offset)
+		pos = &(*pos)->next;
+	f->next = *pos;
+	*pos = f;
+	dg->bytes += f->len;
+	d->bytes += f->len;
+
+	if (info->offset == 0 && dg->header_len == 0) {
+		memcpy(dg->header, info->l3, info->header_len);
+		dg->header_len = info->header_len;
+		dg->nxt_pos = info->nxt_pos;
+	}
+	if (!info->more && !dg->have_last) {
+		dg->have_last = 1;
+		dg->total = info->offset + info->len;
+	}
+	return 0;
+}
+
+static int datagram_complete(const struct datagram *dg)
+{
+	const struct fragment *f;
+	uint32_t covered = 0;
+
+	if (!dg->have_last || dg->header_len == 0)
+		return 0;
+	for (f = dg->frags; f; f = f->next) {
+		if (f->offset > covered)
+			return 0;
+		if (f->offset + f->len > covered)
+			covered = f->offset + f->len;
+	}
+	return covered >= dg->total;
+}
+
+static uint16_t ip_checksum(const unsigned char *p, uint32_t len)
+{
+	uint32_t sum = 0, i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (p[i] << 8) | p[i + 1];
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return htons(~sum & 0xffff);
+}
+
+/* Rebuild a complete datagram in packet. Returns its length, 0 if it is
+ * too big to represent or -1 if allocation failed. */
+static int datagram_build(struct defrag *d, const struct datagram *dg,
+		libtrace_packet_t *packet, uint64_t ts)
+{
+	struct pcap_record_header *rec;
+	const struct fragment *f;
+	unsigned char *data;
+	uint32_t len = dg->header_len + dg->total;
+
+	if (len > PCAP_MAX_CAPLEN || (dg->key.ip_version == 4 && len > 65535)
+			|| (dg->key.ip_version == 6 &&
+			len - sizeof(libtrace_ip6_t) > 65535))
+		return 0;
+
+	if (packet->buf_control != TRACE_CTRL_PACKET || !packet->buffer) {
+		packet->buffer = malloc(LIBTRACE_PACKET_BUFSIZE);
+		if (!packet->buffer)
+			return -1;
+		packet->buf_control = TRACE_CTRL_PACKET;
+	}
+	rec = packet->buffer;
+	data = (unsigned char *)(rec + 1);
+
+	memcpy(data, dg->header, dg->header_len);
+	for (f = dg->frags; f; f = f->next) {
+		uint32_t n = f->len;
+
+		if (f->offset >= dg->total)
+			break;
+		if (f->offset + n > dg->total)
+			n = dg->total - f->offset;
+		memcpy(data + dg->header_len + f->offset, f->data, n);
+	}
+
+	if (dg->key.ip_version == 4) {
+		libtrace_ip_t *ip = (libtrace_ip_t *)data;
+
+		ip->ip_len = htons(len);
+		ip->ip_off &= htons(0x4000);	/* Keep DF only */
+		ip->ip_sum = 0;
+		ip->ip_sum = ip_checksum(data, dg->header_len);
+	} else {
+		libtrace_ip6_t *ip6 = (libtrace_ip6_t *)data;
+
+		/* The fragment header is gone, so point past it */
+		data[dg->nxt_pos] = dg->key.proto;
+		ip6->plen = htons(len - sizeof(libtrace_ip6_t));
+	}
+
+	rec->ts_sec = ts >> 32;
+	rec->ts_frac = ((ts & 0xffffffff) * 1000000) >> 32;
+	rec->caplen = len;
+	rec->wirelen = len;
+	pcap_prepare_packet(packet, d->dead, &d->fmt, rec, rec + 1);
+	return sizeof(*rec) + len;
+}
+
+static void defrag_expire(struct defrag *d, uint64_t now)
+{
+	while (d->oldest && d->oldest->first + d->timeout <= now) {
+		datagram_remove(d, d->oldest);
+		d->stats.expired++;
+	}
+}
+
+/* Make room for len more bytes, dropping the oldest datagrams. Returns 0
+ * if that would mean dropping dg itself. */
+static int defrag_make_room(struct defrag *d, const struct datagram *dg,
+		uint32_t len)
+{
+	while (d->bytes + len > d->max_bytes) {
+		if (!d->oldest || d->oldest == dg)
+			return 0;
+		datagram_remove(d, d->oldest);
+		d->stats.evicted++;
+	}
+	return 1;
+}
+
+/* Returns 0 to pass the packet on, 1 if it was absorbed, the length of
+ * the rebuilt packet if it completed a datagram, or -1 on error */
+static int defrag_packet(struct defrag *d, libtrace_packet_t *packet)
+{
+	struct frag_info info;
+	struct datagram *dg;
+	uint64_t hash, ts;
+	int ret;
+
+	ret = parse_fragment(packet, &info);
+	if (ret <= 0) {
+		if (ret < 0)
+			d->stats.passed++;
+		return 0;
+	}
+
+	ts = trace_get_erf_timestamp(packet);
+	defrag_expire(d, ts);
+
+	if (info.len > d->max_bytes) {
+		d->stats.passed++;
+		return 0;
+	}
+
+	hash = hash_bytes(&info.key, sizeof(info.key), 0);
+	dg = datagram_find(d, &info.key, hash);
+	if (!defrag_make_room(d, dg, info.len)) {
+		datagram_remove(d, dg);
+		d->stats.evicted++;
+		d->stats.passed++;
+		return 0;
+	}
+	if (!dg) {
+		dg = datagram_create(d, &info.key, hash, ts, &ret);
+		if (!dg) {
+			if (ret == 0) {
+				d->stats.passed++;
+				return 0;
+			}
+			return -1;
+		}
+	}
+	if (datagram_add(d, dg, &info) < 0)
+		return -1;
+	d->stats.fragments++;
+
+	if (!datagram_complete(dg))
+		return 1;
+
+	ret = datagram_build(d, dg, packet, ts);
+	datagram_remove(d, dg);
+	if (ret == 0) {
+		d->stats.invalid++;
+		return 1;
+	}
+	if (ret > 0)
+		d->stats.reassembled++;
+	return ret;
+}
+
+static void defrag_fail(struct defrag *d, const char *what)
+{
+	pytrace_reader_t *input = d->input;
+
+	if (what) {
+		snprintf(d->base.error, sizeof(d->base.error), "%s", what);
+	} else if (input->trace && !input->error[0]) {
+		libtrace_err_t err = trace_get_err(input->trace);
+		snprintf(d->base.error, sizeof(d->base.error), "%s",
+				err.problem);
+	} else {
+		snprintf(d->base.error, sizeof(d->base.error), "%s",
+				input->error);
+	}
+}
+
+static int defrag_read(pytrace_reader_t *reader, libtrace_packet_t *packet)
+{
+	struct defrag *d = (struct defrag *)reader;
+	int ret, len;
+
+	for (;;) {
+		len = pytrace_reader_read(d->input, packet);
+		if (len < 0) {
+			defrag_fail(d, NULL);
+			return -1;
+		}
+		if (len == 0)
+			return 0;
+
+		ret = defrag_packet(d, packet);
+		if (ret < 0) {
+			defrag_fail(d, "Out of memory");
+			return -1;
+		}
+		if (ret == 0)
+			return len;
+		if (ret > 1)
+			return ret;
+	}
+}
+
+static void defrag_destroy(pytrace_reader_t *reader)
+{
+	struct defrag *d = (struct defrag *)reader;
+	int i;
+
+	while (d->oldest)
+		datagram_remove(d, d->oldest);
+	if (d->sources) {
+		for (i = 0; i < SOURCE_BUCKETS; i++) {
+			while (d->sources[i]) {
+				struct source *next = d->sources[i]->next;
+				free(d->sources[i]);
+				d->sources[i] = next;
+			}
+		}
+	}
+	free(d->sources);
+	free(d->table);
+	if (d->dead)
+		trace_destroy_dead(d->dead);
+	free(d);
+}
+
+pytrace_reader_t *pytrace_defrag_create(pytrace_reader_t *input,
+		uint64_t max_bytes, uint32_t max_per_source, uint64_t timeout)
+{
+	struct defrag *d;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return NULL;
+	d->base.read = defrag_read;
+	d->base.destroy = defrag_destroy;
+	d->input = input;
+	d->max_bytes = max_bytes;
+	d->max_per_source = max_per_source;
+	d->timeout = timeout;
+	d->fmt.network = TRACE_DLT_LINKTYPE_RAW;
+
+	d->nbuckets = 1024;
+	d->table = calloc(d->nbuckets, sizeof(*d->table));
+	if (max_per_source)
+		d->sources = calloc(SOURCE_BUCKETS, sizeof(*d->sources));
+	d->dead = trace_create_dead("pcapfile:-");
+	if (!d->table || (max_per_source && !d->sources) || !d->dead) {
+		defrag_destroy(&d->base);
+		return NULL;
+	}
+	return &d->base;
+}
+
+void pytrace_defrag_stats(pytrace_reader_t *reader,
+		pytrace_defrag_stats_t *stats)
+{
+	*stats = ((struct defrag *)reader)->stats;
+}
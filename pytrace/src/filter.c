@@ -0,0 +1,124 @@
+/*
+ * Process-wide cache of compiled BPF filters.
+ *
+ * Jobs tend to use a handful of filter expressions over and over, so each
+ * distinct expression is turned into a libtrace_filter_t once per link
+ * type it meets and kept until the process exits.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+#include "decode.h"
+
+#define CACHE_BUCKETS	64
+
+/* libtrace compiles a filter for the link type of the first packet it is
+ * applied to and keeps that program, so each link type gets its own */
+struct compiled {
+	struct compiled *next;
+	libtrace_linktype_t linktype;
+	libtrace_filter_t *filter;
+};
+
+struct pytrace_filter_t {
+	struct pytrace_filter_t *next;
+	struct compiled *compiled;	/* Only ever prepended to */
+	int (*match)(const libtrace_packet_t *packet);
+	char expr[];
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pytrace_filter_t *cache[CACHE_BUCKETS];
+
+pytrace_filter_t *pytrace_filter_get(const char *expr)
+{
+	size_t len = strlen(expr);
+	pytrace_filter_t **slot, *f;
+
+	slot = &cache[hash_bytes(expr, len, 0) & (CACHE_BUCKETS - 1)];
+
+	pthread_mutex_lock(&cache_lock);
+	for (f = *slot; f; f = f->next) {
+		if (strcmp(f->expr, expr) == 0)
+			break;
+	}
+	if (!f && (f = calloc(1, sizeof(*f) + len + 1))) {
+		memcpy(f->expr, expr, len + 1);
+		f->next = *slot;
+		*slot = f;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return f;
+}
+
+static struct compiled *compiled_find(struct compiled *c,
+		libtrace_linktype_t linktype)
+{
+	for (; c; c = c->next) {
+		if (c->linktype == linktype)
+			return c;
+	}
+	return NULL;
+}
+
+pytrace_filter_t *pytrace_filter_from_function(
+		int (*match)(const libtrace_packet_t *packet))
+{
+	pytrace_filter_t *f;
+
+	f = calloc(1, sizeof(*f) + 1);
+	if (f)
+		f->match = match;
+	return f;
+}
+
+void pytrace_filter_destroy(pytrace_filter_t *f)
+{
+	if (f && f->match)
+		free(f);
+}
+
+int pytrace_filter_apply(pytrace_filter_t *f,
+		const libtrace_packet_t *packet)
+{
+	libtrace_linktype_t linktype;
+	struct compiled *c;
+	int ret;
+
+	if (f->match)
+		return f->match(packet);
+
+	linktype = trace_get_link_type(packet);
+	c = compiled_find(__atomic_load_n(&f->compiled, __ATOMIC_ACQUIRE),
+			linktype);
+	if (c)
+		return trace_apply_filter(c->filter, packet);
+
+	/* The first application compiles the filter inside libtrace, which
+	 * must not happen in two threads at once */
+	pthread_mutex_lock(&cache_lock);
+	c = compiled_find(f->compiled, linktype);
+	if (c) {
+		ret = trace_apply_filter(c->filter, packet);
+	} else if (!(c = calloc(1, sizeof(*c)))) {
+		ret = -1;
+	} else {
+		c->linktype = linktype;
+		c->filter = trace_create_filter(f->expr);
+		ret = c->filter ? trace_apply_filter(c->filter, packet) : -1;
+		if (ret >= 0) {
+			c->next = f->compiled;
+			__atomic_store_n(&f->compiled, c, __ATOMIC_RELEASE);
+		} else {
+			if (c->filter)
+				trace_destroy_filter(c->filter);
+			free(c);
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return ret;
+}
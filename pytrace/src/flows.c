@@ -0,0 +1,362 @@
+/*
+ * Native 5-tuple flow table.
+ *
+ * The hash table uses open addressing over 64-byte buckets. Each bucket
+ * holds 8 slots of (32-bit hash tag, entry number), so a lookup normally
+ * touches a single cache line of the table before going to the one entry
+ * whose tag matches. Entries live in a separate array and are also linked
+ * into a list ordered by last activity, so idle flows are always found at
+ * its head.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+#include "decode.h"
+
+#define BUCKET_SLOTS	8
+#define TAG_EMPTY	0
+#define TAG_DELETED	1
+#define NIL		UINT32_MAX
+
+/* Keep the table at most this full (live and deleted slots) */
+#define MAX_LOAD_NUM	3
+#define MAX_LOAD_DEN	4
+
+struct flow_bucket {
+	uint32_t tags[BUCKET_SLOTS];
+	uint32_t entries[BUCKET_SLOTS];
+} __attribute__((aligned(64)));
+
+struct flow_entry {
+	struct flow_key key;
+	uint64_t hash;
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t first;
+	uint64_t last;
+	uint32_t prev;		/* Activity list, or free list via next */
+	uint32_t next;
+	uint32_t bucket;	/* Where the entry's slot is */
+	uint32_t slot;
+};
+
+struct pytrace_flowtable_t {
+	struct flow_bucket *buckets;
+	uint32_t nbuckets;	/* Always a power of two */
+	uint32_t used;		/* Slots that are live or deleted */
+	uint64_t live;
+
+	struct flow_entry *entries;
+	uint32_t nentries;
+	uint32_t free_list;
+
+	uint32_t oldest;	/* Head of the activity list */
+	uint32_t newest;	/* Tail of the activity list */
+
+	uint64_t idle_timeout;
+	uint64_t now;		/* Timestamp of the latest packet */
+};
+
+static uint32_t hash_tag(uint64_t hash)
+{
+	uint32_t tag = hash >> 32;
+
+	return tag <= TAG_DELETED ? tag + 2 : tag;
+}
+
+static struct flow_bucket *alloc_buckets(uint32_t n)
+{
+	struct flow_bucket *b;
+
+	if (posix_memalign((void **)&b, 64, n * sizeof(*b)) != 0)
+		return NULL;
+	memset(b, 0, n * sizeof(*b));
+	return b;
+}
+
+/* Put entry e into the first free slot of its probe sequence */
+static void table_place(struct flow_bucket *buckets, uint32_t nbuckets,
+		struct flow_entry *entries, uint32_t e)
+{
+	struct flow_entry *entry = &entries[e];
+	uint32_t mask = nbuckets - 1;
+	uint32_t b = entry->hash & mask;
+	int i;
+
+	for (;;) {
+		for (i = 0; i < BUCKET_SLOTS; i++) {
+			if (buckets[b].tags[i] <= TAG_DELETED) {
+				buckets[b].tags[i] = hash_tag(entry->hash);
+				buckets[b].entries[i] = e;
+				entry->bucket = b;
+				entry->slot = i;
+				return;
+			}
+		}
+		b = (b + 1) & mask;
+	}
+}
+
+/* Rebuild the table with nbuckets buckets, dropping deleted slots */
+static int table_rehash(pytrace_flowtable_t *ft, uint32_t nbuckets)
+{
+	struct flow_bucket *buckets;
+	uint32_t e;
+
+	buckets = alloc_buckets(nbuckets);
+	if (!buckets)
+		return -1;
+	for (e = ft->oldest; e != NIL; e = ft->entries[e].next)
+		table_place(buckets, nbuckets, ft->entries, e);
+
+	free(ft->buckets);
+	ft->buckets = buckets;
+	ft->nbuckets = nbuckets;
+	ft->used = ft->live;
+	return 0;
+}
+
+/* Make room for nentries entries, threading the new ones on the free list */
+static int entries_grow(pytrace_flowtable_t *ft, uint32_t nentries)
+{
+	struct flow_entry *entries;
+	uint32_t e;
+
+	entries = realloc(ft->entries, nentries * sizeof(*entries));
+	if (!entries)
+		return -1;
+	for (e = ft->nentries; e < nentries; e++)
+		entries[e].next = e + 1 < nentries ? e + 1 : ft->free_list;
+	ft->free_list = ft->nentries;
+	ft->entries = entries;
+	ft->nentries = nentries;
+	return 0;
+}
+
+pytrace_flowtable_t *pytrace_flowtable_create(uint32_t capacity,
+		uint64_t idle_timeout)
+{
+	pytrace_flowtable_t *ft;
+	uint32_t nbuckets = 16;
+
+	while ((uint64_t)nbuckets * BUCKET_SLOTS * MAX_LOAD_NUM / MAX_LOAD_DEN
+			< capacity)
+		nbuckets *= 2;
+
+	ft = calloc(1, sizeof(*ft));
+	if (!ft)
+		return NULL;
+	ft->free_list = NIL;
+	ft->oldest = NIL;
+	ft->newest = NIL;
+	ft->idle_timeout = idle_timeout;
+
+	ft->buckets = alloc_buckets(nbuckets);
+	if (!ft->buckets || entries_grow(ft, nbuckets * BUCKET_SLOTS *
+				MAX_LOAD_NUM / MAX_LOAD_DEN) < 0) {
+		pytrace_flowtable_destroy(ft);
+		return NULL;
+	}
+	ft->nbuckets = nbuckets;
+	return ft;
+}
+
+void pytrace_flowtable_destroy(pytrace_flowtable_t *ft)
+{
+	if (!ft)
+		return;
+	free(ft->buckets);
+	free(ft->entries);
+	free(ft);
+}
+
+uint64_t pytrace_flowtable_size(const pytrace_flowtable_t *ft)
+{
+	return ft->live;
+}
+
+static void list_unlink(pytrace_flowtable_t *ft, uint32_t e)
+{
+	struct flow_entry *entry = &ft->entries[e];
+
+	if (entry->prev != NIL)
+		ft->entries[entry->prev].next = entry->next;
+	else
+		ft->oldest = entry->next;
+	if (entry->next != NIL)
+		ft->entries[entry->next].prev = entry->prev;
+	else
+		ft->newest = entry->prev;
+}
+
+static void list_append(pytrace_flowtable_t *ft, uint32_t e)
+{
+	struct flow_entry *entry = &ft->entries[e];
+
+	entry->prev = ft->newest;
+	entry->next = NIL;
+	if (ft->newest != NIL)
+		ft->entries[ft->newest].next = e;
+	else
+		ft->oldest = e;
+	ft->newest = e;
+}
+
+/* Find the entry for key, creating it if needed. Returns NIL only if the
+ * table could not grow. */
+static uint32_t table_lookup(pytrace_flowtable_t *ft,
+		const struct flow_key *key, uint64_t hash)
+{
+	uint32_t mask = ft->nbuckets - 1;
+	uint32_t b = hash & mask;
+	uint32_t tag = hash_tag(hash);
+	uint32_t e;
+	int i;
+
+	for (;;) {
+		struct flow_bucket *bucket = &ft->buckets[b];
+		int empty = 0;
+
+		for (i = 0; i < BUCKET_SLOTS; i++) {
+			if (bucket->tags[i] == tag) {
+				e = bucket->entries[i];
+				if (memcmp(&ft->entries[e].key, key,
+						sizeof(*key)) == 0)
+					return e;
+			} else if (bucket->tags[i] == TAG_EMPTY) {
+				empty = 1;
+				break;
+			}
+		}
+		/* An empty slot ends the probe sequence */
+		if (empty)
+			break;
+		b = (b + 1) & mask;
+	}
+
+	if ((uint64_t)(ft->used + 1) * MAX_LOAD_DEN >
+			(uint64_t)ft->nbuckets * BUCKET_SLOTS * MAX_LOAD_NUM) {
+		/* Mostly deleted slots only need a clean-up, not more room */
+		uint32_t n = ft->live * 2 > ft->used ?
+			ft->nbuckets * 2 : ft->nbuckets;
+		if (table_rehash(ft, n) < 0)
+			return NIL;
+	}
+	if (ft->free_list == NIL && entries_grow(ft, ft->nentries * 2) < 0)
+		return NIL;
+
+	e = ft->free_list;
+	ft->free_list = ft->entries[e].next;
+
+	memset(&ft->entries[e], 0, sizeof(ft->entries[e]));
+	ft->entries[e].key = *key;
+	ft->entries[e].hash = hash;
+	table_place(ft->buckets, ft->nbuckets, ft->entries, e);
+	list_append(ft, e);
+	ft->used++;
+	ft->live++;
+	return e;
+}
+
+static void flow_export(const struct flow_entry *entry, pytrace_flow_t *out)
+{
+	memcpy(out->src, entry->key.src, 16);
+	memcpy(out->dst, entry->key.dst, 16);
+	out->src_port = entry->key.src_port;
+	out->dst_port = entry->key.dst_port;
+	out->proto = entry->key.proto;
+	out->ip_version = entry->key.ip_version;
+	out->packets = entry->packets;
+	out->bytes = entry->bytes;
+	out->first = entry->first;
+	out->last = entry->last;
+}
+
+static void flow_remove(pytrace_flowtable_t *ft, uint32_t e)
+{
+	struct flow_entry *entry = &ft->entries[e];
+
+	ft->buckets[entry->bucket].tags[entry->slot] = TAG_DELETED;
+	list_unlink(ft, e);
+	entry->next = ft->free_list;
+	ft->free_list = e;
+	ft->live--;
+}
+
+/* Move idle flows (or every flow, if all is set) into out */
+static int flows_expire(pytrace_flowtable_t *ft, pytrace_flow_t *out,
+		int max, int all)
+{
+	int n = 0;
+
+	while (n < max && ft->oldest != NIL) {
+		struct flow_entry *entry = &ft->entries[ft->oldest];
+
+		if (!all && entry->last + ft->idle_timeout > ft->now)
+			break;
+		flow_export(entry, &out[n++]);
+		flow_remove(ft, ft->oldest);
+	}
+	return n;
+}
+
+static int flows_update(pytrace_flowtable_t *ft, libtrace_packet_t *packet)
+{
+	struct flow_key key;
+	struct flow_entry *entry;
+	uint64_t ts;
+	uint32_t e;
+
+	if (!decode_flow_key(packet, &key))
+		return 0;
+
+	e = table_lookup(ft, &key, flow_key_hash(&key, 0));
+	if (e == NIL)
+		return -1;
+
+	ts = trace_get_erf_timestamp(packet);
+	entry = &ft->entries[e];
+	if (entry->packets == 0)
+		entry->first = ts;
+	entry->last = ts;
+	entry->packets++;
+	entry->bytes += trace_get_wire_length(packet);
+
+	if (ft->newest != e) {
+		list_unlink(ft, e);
+		list_append(ft, e);
+	}
+	if (ts > ft->now)
+		ft->now = ts;
+	return 0;
+}
+
+int pytrace_flowtable_read(pytrace_flowtable_t *ft, pytrace_reader_t *reader,
+		libtrace_packet_t *packet, pytrace_flow_t *out, int max,
+		int *status)
+{
+	int n;
+
+	*status = 1;
+	n = flows_expire(ft, out, max, 0);
+	while (n < max) {
+		*status = pytrace_reader_read(reader, packet);
+		if (*status <= 0)
+			break;
+		if (flows_update(ft, packet) < 0) {
+			*status = -2;
+			break;
+		}
+		n += flows_expire(ft, out + n, max - n, 0);
+	}
+	return n;
+}
+
+int pytrace_flowtable_flush(pytrace_flowtable_t *ft, pytrace_flow_t *out,
+		int max)
+{
+	return flows_expire(ft, out, max, 1);
+}
@@ -0,0 +1,59 @@
+/*
+ * Compact copies of packet headers, for packets kept past their batch.
+ */
+
+#include <string.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+
+/* Everything before the payload, if its start is known. Otherwise the
+ * headers cannot be told apart from the data, and the caller's limit
+ * decides how much is kept. */
+static uint32_t header_length(const pytrace_layers_t *layers,
+		uint32_t captured)
+{
+	if (layers->payload != PYTRACE_DECAP_NONE &&
+			layers->payload < captured)
+		return layers->payload;
+	return captured;
+}
+
+uint64_t pytrace_copy_headers(const pytrace_batch_t *batch,
+		pytrace_header_t *out, unsigned char *arena,
+		uint32_t max_header)
+{
+	pytrace_layers_t layers;
+	libtrace_linktype_t linktype;
+	unsigned char *base;
+	uint32_t captured, length;
+	uint64_t used = 0;
+	int i;
+
+	for (i = 0; i < batch->count; i++) {
+		libtrace_packet_t *packet = batch->packets[i];
+		pytrace_header_t *h = &out[i];
+
+		pytrace_parse_layers(packet, &layers);
+		h->timestamp = layers.timestamp;
+		h->wire_length = layers.wire_length;
+		h->capture_length = layers.capture_length;
+		h->link_type = layers.link_type;
+		h->payload = layers.payload;
+		h->offset = used;
+		h->length = 0;
+		h->pad = 0;
+
+		base = trace_get_packet_buffer(packet, &linktype, &captured);
+		if (!base)
+			continue;
+		h->link_type = linktype;
+		length = header_length(&layers, captured);
+		if (length > max_header)
+			length = max_header;
+		memcpy(arena + used, base, length);
+		h->length = length;
+		used += length;
+	}
+	return used;
+}
@@ -0,0 +1,79 @@
+/*
+ * Offsets of every layer of a packet, gathered in a single call.
+ */
+
+#include <libtrace.h>
+#include "pytrace.h"
+
+static void *payload_of(void *l4, uint8_t proto, uint32_t *remaining)
+{
+	switch (proto) {
+	case TRACE_IPPROTO_TCP:
+		return trace_get_payload_from_tcp(l4, remaining);
+	case TRACE_IPPROTO_UDP:
+		return trace_get_payload_from_udp(l4, remaining);
+	case TRACE_IPPROTO_ICMP:
+		return trace_get_payload_from_icmp(l4, remaining);
+	case TRACE_IPPROTO_ICMPV6:
+		return trace_get_payload_from_icmp6(l4, remaining);
+	}
+	return NULL;
+}
+
+int pytrace_parse_layers(libtrace_packet_t *packet, pytrace_layers_t *out)
+{
+	libtrace_linktype_t linktype;
+	unsigned char *base, *p;
+	uint32_t remaining;
+
+	out->timestamp = trace_get_erf_timestamp(packet);
+	out->capture_length = trace_get_capture_length(packet);
+	out->wire_length = trace_get_wire_length(packet);
+	out->l2 = out->l3 = out->l4 = out->payload = PYTRACE_DECAP_NONE;
+	out->l2_remaining = out->l3_remaining = 0;
+	out->l4_remaining = out->payload_remaining = 0;
+	out->link_type = -1;
+	out->ethertype = 0;
+	out->proto = 0;
+	out->pad = 0;
+
+	base = trace_get_packet_buffer(packet, &linktype, &remaining);
+	if (!base)
+		return 0;
+
+	p = trace_get_layer2(packet, &linktype, &remaining);
+	if (p) {
+		out->l2 = p - base;
+		out->l2_remaining = remaining;
+		out->link_type = linktype;
+	}
+
+	p = trace_get_layer3(packet, &out->ethertype, &remaining);
+	if (!p)
+		return 0;
+	out->l3 = p - base;
+	out->l3_remaining = remaining;
+
+	p = trace_get_transport(packet, &out->proto, &remaining);
+	if (!p)
+		return 1;
+	out->l4 = p - base;
+	out->l4_remaining = remaining;
+
+	p = payload_of(p, out->proto, &remaining);
+	if (p) {
+		out->payload = p - base;
+		out->payload_remaining = remaining;
+	}
+	return 1;
+}
+
+int pytrace_parse_layers_batch(const pytrace_batch_t *batch,
+		pytrace_layers_t *out)
+{
+	int i, n = 0;
+
+	for (i = 0; i < batch->count; i++)
+		n += pytrace_parse_layers(batch->packets[i], &out[i]);
+	return n;
+}
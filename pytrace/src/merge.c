@@ -0,0 +1,184 @@
+/*
+ * Timestamp-ordered k-way merge of several readers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+
+struct merge_input {
+	pytrace_reader_t *reader;
+	pytrace_batch_t *batch;
+	int next;		/* Index of the input's next packet in batch */
+	uint64_t ts;		/* Timestamp of that packet */
+};
+
+struct merger {
+	pytrace_reader_t base;
+	int ninputs;
+	struct merge_input *inputs;
+	int *heap;		/* Input numbers, ordered on their ts */
+	int heap_size;
+	int primed;		/* Every input has had its first batch read */
+};
+
+static int merge_less(struct merger *m, int a, int b)
+{
+	const struct merge_input *x = &m->inputs[a];
+	const struct merge_input *y = &m->inputs[b];
+
+	if (x->ts != y->ts)
+		return x->ts < y->ts;
+	return a < b;
+}
+
+static void heap_sift_down(struct merger *m, int i)
+{
+	int *heap = m->heap;
+	int n = m->heap_size;
+
+	for (;;) {
+		int l = 2 * i + 1, r = l + 1, min = i, tmp;
+
+		if (l < n && merge_less(m, heap[l], heap[min]))
+			min = l;
+		if (r < n && merge_less(m, heap[r], heap[min]))
+			min = r;
+		if (min == i)
+			return;
+		tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+static void merge_fail(struct merger *m, struct merge_input *in)
+{
+	if (in->reader->trace && !in->reader->error[0]) {
+		libtrace_err_t err = trace_get_err(in->reader->trace);
+		snprintf(m->base.error, sizeof(m->base.error), "%s",
+				err.problem);
+	} else {
+		snprintf(m->base.error, sizeof(m->base.error), "%s",
+				in->reader->error);
+	}
+}
+
+/* Make sure an input has a current packet. Returns 1 if it does, 0 if the
+ * input is exhausted or -1 on error. */
+static int merge_advance(struct merger *m, struct merge_input *in)
+{
+	if (in->next >= in->batch->count) {
+		if (pytrace_read_batch(in->reader, in->batch) == 0) {
+			if (in->batch->status < 0) {
+				merge_fail(m, in);
+				return -1;
+			}
+			return 0;
+		}
+		in->next = 0;
+	}
+	in->ts = trace_get_erf_timestamp(in->batch->packets[in->next]);
+	return 1;
+}
+
+static int merge_prime(struct merger *m)
+{
+	int i, ret;
+
+	for (i = 0; i < m->ninputs; i++) {
+		ret = merge_advance(m, &m->inputs[i]);
+		if (ret < 0)
+			return -1;
+		if (ret > 0)
+			m->heap[m->heap_size++] = i;
+	}
+	for (i = m->heap_size / 2 - 1; i >= 0; i--)
+		heap_sift_down(m, i);
+	m->primed = 1;
+	return 0;
+}
+
+static int merge_read(pytrace_reader_t *reader, libtrace_packet_t *packet)
+{
+	struct merger *m = (struct merger *)reader;
+	struct merge_input *in;
+	libtrace_packet_t tmp, *slot;
+	int ret;
+
+	if (!m->primed && merge_prime(m) < 0)
+		return -1;
+	if (m->heap_size == 0)
+		return 0;
+
+	in = &m->inputs[m->heap[0]];
+	slot = in->batch->packets[in->next++];
+
+	/* Hand over the packet by swapping contents: the caller gets the
+	 * input's buffer and the input gets the caller's old one to refill */
+	tmp = *packet;
+	*packet = *slot;
+	*slot = tmp;
+
+	ret = merge_advance(m, in);
+	if (ret < 0)
+		return -1;
+	if (ret == 0)
+		m->heap[0] = m->heap[--m->heap_size];
+	heap_sift_down(m, 0);
+
+	ret = trace_get_framing_length(packet) +
+		trace_get_capture_length(packet);
+	return ret > 0 ? ret : 1;
+}
+
+static void merge_destroy(pytrace_reader_t *reader)
+{
+	struct merger *m = (struct merger *)reader;
+	int i;
+
+	if (m->inputs) {
+		for (i = 0; i < m->ninputs; i++)
+			pytrace_batch_destroy(m->inputs[i].batch);
+	}
+	free(m->inputs);
+	free(m->heap);
+	free(m);
+}
+
+pytrace_reader_t *pytrace_merge_create(pytrace_reader_t **inputs,
+		int ninputs, int batch_size)
+{
+	struct merger *m;
+	int i;
+
+	if (ninputs <= 0)
+		return NULL;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return NULL;
+	m->base.read = merge_read;
+	m->base.destroy = merge_destroy;
+	m->ninputs = ninputs;
+	m->inputs = calloc(ninputs, sizeof(*m->inputs));
+	m->heap = calloc(ninputs, sizeof(*m->heap));
+	if (!m->inputs || !m->heap) {
+		merge_destroy(&m->base);
+		return NULL;
+	}
+
+	for (i = 0; i < ninputs; i++) {
+		m->inputs[i].reader = inputs[i];
+		m->inputs[i].batch = pytrace_batch_create(batch_size);
+		if (!m->inputs[i].batch) {
+			merge_destroy(&m->base);
+			return NULL;
+		}
+	}
+	return &m->base;
+}
@@ -0,0 +1,71 @@
+/*
+ * Internal definitions shared by the native pcap file readers.
+ *
+ * Unlike pytrace.h, this header is never passed to cffi.
+ */
+
+#ifndef PYTRACE_PCAP_H
+#define PYTRACE_PCAP_H
+
+#include <stdint.h>
+
+#include <libtrace.h>
+
+#define PCAP_MAGIC_USEC		0xa1b2c3d4
+#define PCAP_MAGIC_NSEC		0xa1b23c4d
+
+/* Refuse records claiming to be bigger than a libtrace packet buffer */
+#define PCAP_MAX_CAPLEN		(LIBTRACE_PACKET_BUFSIZE - \
+		sizeof(struct pcap_record_header))
+
+/** The global header at the start of every pcap file */
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t network;
+};
+
+/** The header in front of every record in a pcap file */
+struct pcap_record_header {
+	uint32_t ts_sec;
+	uint32_t ts_frac;	/* Microseconds or nanoseconds */
+	uint32_t caplen;
+	uint32_t wirelen;
+};
+
+/** How to interpret the records of a particular pcap file */
+struct pcap_format {
+	int swapped;		/* Written with the opposite byte order */
+	int nanosecond;		/* ts_frac holds nanoseconds */
+	uint32_t snaplen;
+	uint32_t network;	/* LINKTYPE_* value */
+};
+
+/* Parse a global header; returns -1 if it is not a pcap header at all */
+int pcap_parse_file_header(const struct pcap_file_header *hdr,
+		struct pcap_format *fmt);
+
+/* Convert a record header to host byte order and microseconds, which is
+ * the only form libtrace's pcapfile format accepts from a dead trace. */
+void pcap_normalise_record(const struct pcap_format *fmt,
+		const struct pcap_record_header *in,
+		struct pcap_record_header *out);
+
+/* The ERF timestamp of a normalised record header */
+uint64_t pcap_record_erf(const struct pcap_record_header *rec);
+
+/* Whether a normalised record header looks like a genuine record */
+int pcap_record_plausible(const struct pcap_format *fmt,
+		const struct pcap_record_header *rec);
+
+/* Point packet at a normalised record header and its data. The memory
+ * stays owned by the caller; dead must be a trace_create_dead("pcapfile:")
+ * trace that outlives the packet. */
+void pcap_prepare_packet(libtrace_packet_t *packet, libtrace_t *dead,
+		const struct pcap_format *fmt, void *header, void *data);
+
+#endif
@@ -0,0 +1,618 @@
+/*
+ * Native reader and time index for uncompressed pcap files.
+ *
+ * libtrace only ever reads pcap files front to back, so it cannot jump to
+ * a point in time without decoding everything before it. This reader
+ * works on the file directly, which means it always knows the byte offset
+ * of the next record and can be repositioned with a single fseeko().
+ *
+ * Packets are handed to libtrace as if they came from a pcapfile: trace,
+ * attached to a dead pcapfile trace so that all the usual decoding
+ * functions work on them. By default each record is copied into the
+ * packet's own buffer behind a normalised record header. When the file is
+ * mapped instead, packets point straight at the mapping and nothing is
+ * copied at all, leaving the page cache to do the work across runs.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+#include "pcap.h"
+
+#define TINDEX_MAGIC		"PYTRIDX1"
+
+/** Header of a time index file, followed by the checkpoints */
+struct tindex_header {
+	char magic[8];
+	uint32_t interval;	/* Packets between checkpoints */
+	uint32_t reserved;
+	uint64_t file_size;	/* Size of the pcap file when indexed */
+	uint64_t count;		/* Number of checkpoints */
+};
+
+/** A single checkpoint in a time index */
+struct tindex_entry {
+	uint64_t ts;		/* ERF timestamp of the record */
+	uint64_t offset;	/* File offset of the record header */
+};
+
+struct pytrace_tindex_t {
+	uint64_t count;
+	struct tindex_entry *entries;
+};
+
+struct pcap_reader {
+	pytrace_reader_t base;
+	FILE *file;		/* Stream for buffered reads, or NULL */
+	unsigned char *map;	/* The whole file when mapped, or NULL */
+	uint64_t map_size;
+	uint64_t pos;		/* Offset of the next record in map */
+	uint64_t start;		/* Offset of the first record in range */
+	uint64_t end;		/* Offset to stop reading at, or 0 */
+	uint32_t snaplen;	/* Bytes of each record to keep, or 0 */
+	libtrace_t *dead;
+	struct pcap_format fmt;
+};
+
+static uint32_t swap32(uint32_t x)
+{
+	return ((x & 0xff) << 24) | ((x & 0xff00) << 8) |
+		((x >> 8) & 0xff00) | (x >> 24);
+}
+
+int pcap_parse_file_header(const struct pcap_file_header *hdr,
+		struct pcap_format *fmt)
+{
+	switch (hdr->magic) {
+	case PCAP_MAGIC_USEC:
+		fmt->swapped = 0;
+		fmt->nanosecond = 0;
+		break;
+	case PCAP_MAGIC_NSEC:
+		fmt->swapped = 0;
+		fmt->nanosecond = 1;
+		break;
+	default:
+		if (swap32(hdr->magic) == PCAP_MAGIC_USEC) {
+			fmt->swapped = 1;
+			fmt->nanosecond = 0;
+		} else if (swap32(hdr->magic) == PCAP_MAGIC_NSEC) {
+			fmt->swapped = 1;
+			fmt->nanosecond = 1;
+		} else {
+			return -1;
+		}
+	}
+	fmt->snaplen = fmt->swapped ? swap32(hdr->snaplen) : hdr->snaplen;
+	fmt->network = fmt->swapped ? swap32(hdr->network) : hdr->network;
+	return 0;
+}
+
+void pcap_normalise_record(const struct pcap_format *fmt,
+		const struct pcap_record_header *in,
+		struct pcap_record_header *out)
+{
+	if (fmt->swapped) {
+		out->ts_sec = swap32(in->ts_sec);
+		out->ts_frac = swap32(in->ts_frac);
+		out->caplen = swap32(in->caplen);
+		out->wirelen = swap32(in->wirelen);
+	} else {
+		*out = *in;
+	}
+	if (fmt->nanosecond)
+		out->ts_frac /= 1000;
+}
+
+uint64_t pcap_record_erf(const struct pcap_record_header *rec)
+{
+	return ((uint64_t)rec->ts_sec << 32) +
+		(((uint64_t)rec->ts_frac << 32) / 1000000);
+}
+
+int pcap_record_plausible(const struct pcap_format *fmt,
+		const struct pcap_record_header *rec)
+{
+	if (rec->caplen > PCAP_MAX_CAPLEN)
+		return 0;
+	if (fmt->snaplen && rec->caplen > fmt->snaplen)
+		return 0;
+	if (rec->caplen > rec->wirelen)
+		return 0;
+	if (rec->ts_frac >= 1000000)
+		return 0;
+	return 1;
+}
+
+void pcap_prepare_packet(libtrace_packet_t *packet, libtrace_t *dead,
+		const struct pcap_format *fmt, void *header, void *data)
+{
+	packet->trace = dead;
+	packet->header = header;
+	packet->payload = data;
+	packet->type = TRACE_RT_DATA_DLT + fmt->network;
+
+	/* Equivalent to libtrace's internal trace_clear_cache() */
+	packet->capture_length = -1;
+	packet->wire_length = -1;
+	packet->payload_length = -1;
+	packet->l2_header = NULL;
+	packet->link_type = 0;
+	packet->l2_remaining = 0;
+	packet->l3_header = NULL;
+	packet->l3_ethertype = 0;
+	packet->l3_remaining = 0;
+	packet->l4_header = NULL;
+	packet->transport_proto = 0;
+	packet->l4_remaining = 0;
+}
+
+static int pcap_reader_fail(struct pcap_reader *r, const char *what)
+{
+	if (r->file && ferror(r->file))
+		snprintf(r->base.error, sizeof(r->base.error), "%s: %s",
+				what, strerror(errno));
+	else
+		snprintf(r->base.error, sizeof(r->base.error), "%s", what);
+	return -1;
+}
+
+static uint64_t pcap_reader_tell(struct pcap_reader *r)
+{
+	if (r->map)
+		return r->pos;
+	return ftello(r->file);
+}
+
+static int pcap_reader_setpos(struct pcap_reader *r, uint64_t pos)
+{
+	if (r->map) {
+		if (pos > r->map_size)
+			return pcap_reader_fail(r, "Seek past end of file");
+		r->pos = pos;
+		return 0;
+	}
+	clearerr(r->file);
+	if (fseeko(r->file, pos, SEEK_SET) < 0)
+		return pcap_reader_fail(r, "Seek failed");
+	return 0;
+}
+
+/* Read the next record header, normalised into rec. For mapped files,
+ * raw is pointed at the header as it appears in the file. Returns 1, 0 at
+ * EOF or -1. */
+static int pcap_reader_next_header(struct pcap_reader *r,
+		struct pcap_record_header *rec, unsigned char **raw)
+{
+	struct pcap_record_header copy;
+	size_t got;
+
+	if (r->end && pcap_reader_tell(r) >= r->end)
+		return 0;
+
+	if (r->map) {
+		if (r->pos == r->map_size)
+			return 0;
+		if (r->map_size - r->pos < sizeof(copy))
+			return pcap_reader_fail(r,
+					"Truncated pcap record header");
+		*raw = r->map + r->pos;
+		r->pos += sizeof(copy);
+		memcpy(&copy, *raw, sizeof(copy));
+	} else {
+		got = fread(&copy, 1, sizeof(copy), r->file);
+		if (got == 0 && feof(r->file))
+			return 0;
+		if (got != sizeof(copy))
+			return pcap_reader_fail(r,
+					"Truncated pcap record header");
+	}
+
+	pcap_normalise_record(&r->fmt, &copy, rec);
+	if (!pcap_record_plausible(&r->fmt, rec))
+		return pcap_reader_fail(r, "Corrupt pcap record header");
+	return 1;
+}
+
+/* Skip over the data of the record whose header was just read */
+static int pcap_reader_skip(struct pcap_reader *r,
+		const struct pcap_record_header *rec)
+{
+	if (r->map) {
+		if (r->map_size - r->pos < rec->caplen)
+			return pcap_reader_fail(r, "Truncated pcap record");
+		r->pos += rec->caplen;
+		return 0;
+	}
+	if (fseeko(r->file, rec->caplen, SEEK_CUR) < 0)
+		return pcap_reader_fail(r, "Seek failed");
+	return 0;
+}
+
+static int pcap_reader_ensure_buffer(struct pcap_reader *r,
+		libtrace_packet_t *packet)
+{
+	if (packet->buf_control == TRACE_CTRL_PACKET && packet->buffer)
+		return 0;
+	packet->buffer = malloc(LIBTRACE_PACKET_BUFSIZE);
+	if (!packet->buffer) {
+		snprintf(r->base.error, sizeof(r->base.error),
+				"Out of memory");
+		return -1;
+	}
+	packet->buf_control = TRACE_CTRL_PACKET;
+	return 0;
+}
+
+static int pcap_reader_read(pytrace_reader_t *reader,
+		libtrace_packet_t *packet)
+{
+	struct pcap_reader *r = (struct pcap_reader *)reader;
+	struct pcap_record_header rec;
+	unsigned char *raw = NULL;
+	unsigned char *data;
+	uint32_t caplen;
+	char *buffer;
+	int ret;
+
+	ret = pcap_reader_next_header(r, &rec, &raw);
+	if (ret <= 0)
+		return ret;
+	caplen = rec.caplen;
+	if (r->snaplen && rec.caplen > r->snaplen)
+		rec.caplen = r->snaplen;
+
+	if (r->map) {
+		data = r->map + r->pos;
+		if (r->map_size - r->pos < caplen)
+			return pcap_reader_fail(r, "Truncated pcap record");
+		r->pos += caplen;
+
+		/* The data is never copied. The header can be used in place
+		 * too if it is already in the form libtrace expects and is
+		 * suitably aligned; otherwise the normalised copy goes into
+		 * the packet's own buffer. */
+		if (!r->fmt.swapped && !r->fmt.nanosecond &&
+				rec.caplen == caplen &&
+				((uintptr_t)raw & 3) == 0) {
+			pcap_prepare_packet(packet, r->dead, &r->fmt, raw,
+					data);
+		} else {
+			if (pcap_reader_ensure_buffer(r, packet) < 0)
+				return -1;
+			memcpy(packet->buffer, &rec, sizeof(rec));
+			pcap_prepare_packet(packet, r->dead, &r->fmt,
+					packet->buffer, data);
+		}
+		return sizeof(rec) + rec.caplen;
+	}
+
+	if (pcap_reader_ensure_buffer(r, packet) < 0)
+		return -1;
+	buffer = packet->buffer;
+
+	memcpy(buffer, &rec, sizeof(rec));
+	if (fread(buffer + sizeof(rec), 1, rec.caplen, r->file) != rec.caplen)
+		return pcap_reader_fail(r, "Truncated pcap record");
+	if (caplen > rec.caplen &&
+			fseeko(r->file, caplen - rec.caplen, SEEK_CUR) < 0)
+		return pcap_reader_fail(r, "Seek failed");
+
+	pcap_prepare_packet(packet, r->dead, &r->fmt, buffer,
+			buffer + sizeof(rec));
+	return sizeof(rec) + rec.caplen;
+}
+
+static void pcap_reader_destroy(pytrace_reader_t *reader)
+{
+	struct pcap_reader *r = (struct pcap_reader *)reader;
+
+	if (r->map)
+		munmap(r->map, r->map_size);
+	if (r->file)
+		fclose(r->file);
+	if (r->dead)
+		trace_destroy_dead(r->dead);
+	free(r);
+}
+
+/* Open path and parse its global header, leaving the file positioned at
+ * the first record. */
+static FILE *pcap_open_file(const char *path, struct pcap_format *fmt,
+		char *error)
+{
+	struct pcap_file_header hdr;
+	FILE *file;
+
+	file = fopen(path, "rb");
+	if (!file) {
+		snprintf(error, 256, "%s: %s", path, strerror(errno));
+		return NULL;
+	}
+	if (fread(&hdr, 1, sizeof(hdr), file) != sizeof(hdr) ||
+			pcap_parse_file_header(&hdr, fmt) < 0) {
+		snprintf(error, 256, "%s: not an uncompressed pcap file",
+				path);
+		fclose(file);
+		return NULL;
+	}
+	return file;
+}
+
+/* Replace the stdio stream of a freshly opened reader with a mapping of
+ * the whole file. */
+static int pcap_reader_map(struct pcap_reader *r, const char *path,
+		char *error)
+{
+	struct stat st;
+	void *map;
+
+	if (fstat(fileno(r->file), &st) < 0) {
+		snprintf(error, 256, "%s: %s", path, strerror(errno));
+		return -1;
+	}
+	/* Private and writable so that anything libtrace writes back into a
+	 * packet (e.g. trace_set_capture_length) only touches a private copy
+	 * of the page, never the file. */
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			fileno(r->file), 0);
+	if (map == MAP_FAILED) {
+		snprintf(error, 256, "%s: mmap: %s", path, strerror(errno));
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	r->map = map;
+	r->map_size = st.st_size;
+	r->pos = sizeof(struct pcap_file_header);
+	fclose(r->file);
+	r->file = NULL;
+	return 0;
+}
+
+pytrace_reader_t *pytrace_pcap_open(const char *path, int flags, char *error)
+{
+	struct pcap_reader *r;
+
+	r = calloc(1, sizeof(*r));
+	if (!r) {
+		snprintf(error, 256, "Out of memory");
+		return NULL;
+	}
+	r->base.read = pcap_reader_read;
+	r->base.destroy = pcap_reader_destroy;
+
+	r->file = pcap_open_file(path, &r->fmt, error);
+	if (!r->file) {
+		free(r);
+		return NULL;
+	}
+	if ((flags & PYTRACE_PCAP_MMAP) && pcap_reader_map(r, path, error) < 0) {
+		pcap_reader_destroy(&r->base);
+		return NULL;
+	}
+
+	r->dead = trace_create_dead("pcapfile:-");
+	if (!r->dead) {
+		snprintf(error, 256, "Could not create dead pcapfile trace");
+		pcap_reader_destroy(&r->base);
+		return NULL;
+	}
+	return &r->base;
+}
+
+int pytrace_pcap_seek(pytrace_reader_t *reader, uint64_t offset, uint64_t ts)
+{
+	struct pcap_reader *r = (struct pcap_reader *)reader;
+	struct pcap_record_header rec;
+	unsigned char *raw;
+	uint64_t pos;
+	int ret;
+
+	if (offset < sizeof(struct pcap_file_header))
+		offset = sizeof(struct pcap_file_header);
+	/* Records before a byte range belong to another reader */
+	if (offset < r->start)
+		offset = r->start;
+	if (pcap_reader_setpos(r, offset) < 0)
+		return -1;
+
+	for (;;) {
+		pos = pcap_reader_tell(r);
+		ret = pcap_reader_next_header(r, &rec, &raw);
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			return 0;
+		if (pcap_record_erf(&rec) >= ts)
+			break;
+		if (pcap_reader_skip(r, &rec) < 0)
+			return -1;
+	}
+
+	/* Step back so the next read returns the record we stopped on */
+	return pcap_reader_setpos(r, pos);
+}
+
+void pytrace_pcap_set_snaplen(pytrace_reader_t *reader, uint32_t snaplen)
+{
+	((struct pcap_reader *)reader)->snaplen = snaplen;
+}
+
+int pytrace_pcap_set_range(pytrace_reader_t *reader, uint64_t start,
+		uint64_t end)
+{
+	struct pcap_reader *r = (struct pcap_reader *)reader;
+
+	if (start < sizeof(struct pcap_file_header))
+		start = sizeof(struct pcap_file_header);
+	r->start = start;
+	r->end = end;
+	return pcap_reader_setpos(r, start);
+}
+
+int64_t pytrace_tindex_build(const char *path, const char *index_path,
+		uint32_t interval, char *error)
+{
+	struct pcap_format fmt;
+	struct pcap_record_header raw, rec;
+	struct tindex_header hdr;
+	struct tindex_entry entry;
+	struct stat st;
+	FILE *file, *out;
+	uint64_t packets = 0;
+	off_t pos;
+	int64_t ret = -1;
+
+	if (interval == 0)
+		interval = 1;
+
+	file = pcap_open_file(path, &fmt, error);
+	if (!file)
+		return -1;
+	if (fstat(fileno(file), &st) < 0) {
+		snprintf(error, 256, "%s: %s", path, strerror(errno));
+		fclose(file);
+		return -1;
+	}
+
+	out = fopen(index_path, "wb");
+	if (!out) {
+		snprintf(error, 256, "%s: %s", index_path, strerror(errno));
+		fclose(file);
+		return -1;
+	}
+
+	/* Write a placeholder header first; count is filled in at the end */
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TINDEX_MAGIC, sizeof(hdr.magic));
+	hdr.interval = interval;
+	hdr.file_size = st.st_size;
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+		goto write_error;
+
+	for (;;) {
+		pos = ftello(file);
+		if (fread(&raw, 1, sizeof(raw), file) != sizeof(raw))
+			break;
+		pcap_normalise_record(&fmt, &raw, &rec);
+		if (!pcap_record_plausible(&fmt, &rec)) {
+			snprintf(error, 256, "%s: corrupt record at offset %lld",
+					path, (long long)pos);
+			goto out;
+		}
+		if (packets % interval == 0) {
+			entry.ts = pcap_record_erf(&rec);
+			entry.offset = pos;
+			if (fwrite(&entry, sizeof(entry), 1, out) != 1)
+				goto write_error;
+			hdr.count++;
+		}
+		packets++;
+		if (fseeko(file, rec.caplen, SEEK_CUR) < 0)
+			break;
+	}
+
+	if (fseeko(out, 0, SEEK_SET) < 0 ||
+			fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+		goto write_error;
+	ret = hdr.count;
+	goto out;
+
+write_error:
+	snprintf(error, 256, "%s: %s", index_path, strerror(errno));
+out:
+	if (fclose(out) != 0 && ret >= 0) {
+		snprintf(error, 256, "%s: %s", index_path, strerror(errno));
+		ret = -1;
+	}
+	fclose(file);
+	if (ret < 0)
+		remove(index_path);
+	return ret;
+}
+
+pytrace_tindex_t *pytrace_tindex_load(const char *index_path,
+		const char *path, char *error)
+{
+	struct tindex_header hdr;
+	pytrace_tindex_t *index;
+	struct stat st;
+	FILE *file;
+
+	if (stat(path, &st) < 0) {
+		snprintf(error, 256, "%s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	file = fopen(index_path, "rb");
+	if (!file) {
+		snprintf(error, 256, "%s: %s", index_path, strerror(errno));
+		return NULL;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, file) != 1 ||
+			memcmp(hdr.magic, TINDEX_MAGIC, sizeof(hdr.magic))) {
+		snprintf(error, 256, "%s: not a time index", index_path);
+		fclose(file);
+		return NULL;
+	}
+	if (hdr.file_size != (uint64_t)st.st_size) {
+		snprintf(error, 256, "%s: index is stale", index_path);
+		fclose(file);
+		return NULL;
+	}
+
+	index = calloc(1, sizeof(*index));
+	if (index && hdr.count)
+		index->entries = malloc(hdr.count * sizeof(*index->entries));
+	if (!index || (hdr.count && !index->entries)) {
+		snprintf(error, 256, "Out of memory");
+		pytrace_tindex_destroy(index);
+		fclose(file);
+		return NULL;
+	}
+	if (fread(index->entries, sizeof(*index->entries), hdr.count, file)
+			!= hdr.count) {
+		snprintf(error, 256, "%s: truncated time index", index_path);
+		pytrace_tindex_destroy(index);
+		fclose(file);
+		return NULL;
+	}
+	index->count = hdr.count;
+	fclose(file);
+	return index;
+}
+
+uint64_t pytrace_tindex_lookup(const pytrace_tindex_t *index, uint64_t ts)
+{
+	uint64_t lo = 0, hi = index->count;
+
+	/* Find the first checkpoint at or after ts, then step back one, as
+	 * records just before it may share its timestamp */
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (index->entries[mid].ts < ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return 0;
+	return index->entries[lo - 1].offset;
+}
+
+void pytrace_tindex_destroy(pytrace_tindex_t *index)
+{
+	if (!index)
+		return;
+	free(index->entries);
+	free(index);
+}
@@ -0,0 +1,1395 @@
+/** @file
+ *
+ * @brief Native helpers for the pytrace CFFI bindings
+ *
+ * Everything declared here is compiled into the pytrace._trace extension
+ * alongside libtrace itself. The helpers exist to keep hot loops on the C
+ * side of the CFFI boundary, so that Python only pays one call per batch of
+ * packets rather than one (or several) per packet.
+ *
+ * @note This file is also fed verbatim to ffi.cdef(), so it must stay within
+ * the subset of C that cffi understands: no preprocessor directives other
+ * than integer constant #defines, and no inline function bodies.
+ */
+
+/** @name Readers
+ * A reader is the source of packets for every native read loop. The basic
+ * reader simply wraps trace_read_packet(); others read the trace file
+ * themselves, which lets them do things libtrace cannot (e.g. seek to a
+ * byte offset).
+ * @{
+ */
+
+/** A compiled packet filter; see pytrace_filter_get() */
+typedef struct pytrace_filter_t pytrace_filter_t;
+
+/** Sampling state; see pytrace_sampler_init() */
+typedef struct pytrace_sampler_t pytrace_sampler_t;
+
+/** A source of packets. Specific readers extend this structure. */
+typedef struct pytrace_reader_t {
+	/** Read the next packet, returning the same values as
+	 * trace_read_packet() */
+	int (*read)(struct pytrace_reader_t *reader,
+			libtrace_packet_t *packet);
+	/** Free the reader */
+	void (*destroy)(struct pytrace_reader_t *reader);
+	/** The trace to query for errors, or NULL if error is used instead */
+	libtrace_t *trace;
+	/** Description of the last error, if trace is NULL or the error
+	 * came from the filter */
+	char error[256];
+	/** If not NULL, pytrace_reader_read() skips packets that do not
+	 * match this filter */
+	pytrace_filter_t *filter;
+	/** If not NULL, pytrace_reader_read() only returns the packets
+	 * (matching the filter) that this sampler keeps */
+	pytrace_sampler_t *sampler;
+} pytrace_reader_t;
+
+/** Create a reader that reads from a started libtrace input trace
+ * @param trace		The trace to read from; it must outlive the reader
+ * @return A new reader, or NULL if allocation failed
+ */
+pytrace_reader_t *pytrace_reader_from_trace(libtrace_t *trace);
+
+/** Read the next packet from a reader
+ *
+ * Packets rejected by the reader's filter or sampler are skipped here, so
+ * they never reach any of the native read loops.
+ * @param reader	The reader
+ * @param packet	The packet to read into
+ * @return The same values as trace_read_packet(): the number of bytes read,
+ * 0 at the end of the input or -1 on error
+ */
+int pytrace_reader_read(pytrace_reader_t *reader, libtrace_packet_t *packet);
+
+/** Get the next event from a reader
+ *
+ * For a reader made by pytrace_reader_from_trace() this is trace_event(),
+ * which does not block, with packets rejected by the filter or sampler
+ * skipped as in pytrace_reader_read(). Other readers cannot report what
+ * they wait for, so they are read directly with pytrace_reader_read(),
+ * blocking if they wrap a live input, and only report packets and the end
+ * of the input.
+ * @param reader	The reader
+ * @param packet	The packet to read into
+ * @param event		Filled with the event. For TRACE_EVENT_TERMINATE,
+ * size is 0 at the end of the input or -1 on error.
+ * @return event->type
+ */
+int pytrace_reader_event(pytrace_reader_t *reader, libtrace_packet_t *packet,
+		libtrace_eventobj_t *event);
+
+/** Destroy a reader
+ * @param reader	The reader to destroy
+ */
+void pytrace_reader_destroy(pytrace_reader_t *reader);
+
+/*@}*/
+
+/** @name Packet filters
+ * Compiled BPF filters are cached for the life of the process, keyed on
+ * the filter expression, so every trace and thread using the same
+ * expression shares one filter. A filter holds a separate compiled program
+ * for each link type it is applied to, so traces (or stages such as
+ * defragmentation) that mix link types are matched correctly.
+ * @{
+ */
+
+/** Get the filter for a BPF expression, creating it on first use
+ *
+ * libtrace only compiles a filter when it is first applied, so a bad
+ * expression is reported by the first read rather than here.
+ * @param expr		The filter expression
+ * @return The shared filter, or NULL if allocation failed. It must not be
+ * destroyed.
+ */
+pytrace_filter_t *pytrace_filter_get(const char *expr);
+
+/** Wrap a native matching function as a filter
+ *
+ * Such filters are not cached; they let code compiled elsewhere (see
+ * pytrace.predicate) be attached to a reader like a BPF filter.
+ * @param match		Returns >0 for packets that match, 0 for those that
+ * don't and -1 on error
+ * @return The new filter, or NULL if allocation failed
+ */
+pytrace_filter_t *pytrace_filter_from_function(
+		int (*match)(const libtrace_packet_t *packet));
+
+/** Destroy a filter created by pytrace_filter_from_function()
+ * @param filter	The filter to destroy
+ */
+void pytrace_filter_destroy(pytrace_filter_t *filter);
+
+/** Apply a filter to a packet
+ * @param filter	A filter returned by pytrace_filter_get() or
+ * pytrace_filter_from_function()
+ * @param packet	The packet to test
+ * @return >0 if the packet matches, 0 if it doesn't, -1 on error
+ */
+int pytrace_filter_apply(pytrace_filter_t *filter,
+		const libtrace_packet_t *packet);
+
+/*@}*/
+
+/** @name Sampling
+ * Sampling runs inside pytrace_reader_read(), after the filter.
+ * @{
+ */
+
+/** Keep one packet in every rate, counting deterministically */
+#define PYTRACE_SAMPLE_PACKETS 1
+/** Keep every packet of one flow in every rate, chosen by a symmetric hash
+ * of the 5-tuple. The same seed picks the same flows on every tap, in both
+ * directions. Packets that are not IP are dropped. */
+#define PYTRACE_SAMPLE_FLOWS 2
+
+struct pytrace_sampler_t {
+	int mode;			/**< PYTRACE_SAMPLE_* */
+	uint32_t rate;			/**< Keep 1 in rate; 0 or 1 keeps all */
+	uint64_t seed;
+	uint64_t phase;			/**< Packets until the next one kept */
+	uint64_t seen;			/**< Packets offered to the sampler */
+	uint64_t kept;			/**< Packets it kept */
+};
+
+/** Set up a sampler
+ *
+ * In PYTRACE_SAMPLE_PACKETS mode, the seed chooses which packet of each
+ * run of rate is kept.
+ * @param sampler	The sampler to initialise
+ * @param mode		One of the PYTRACE_SAMPLE_* values
+ * @param rate		Keep one packet or flow in this many
+ * @param seed		Varies the selection
+ */
+void pytrace_sampler_init(pytrace_sampler_t *sampler, int mode,
+		uint32_t rate, uint64_t seed);
+
+/** Decide whether to keep a packet
+ * @param sampler	The sampler
+ * @param packet	The packet
+ * @return 1 if the packet is kept, otherwise 0
+ */
+int pytrace_sampler_apply(pytrace_sampler_t *sampler,
+		const libtrace_packet_t *packet);
+
+/*@}*/
+
+/** @name Batched reading and writing
+ * @{
+ */
+
+/** A reusable set of preallocated packets filled by pytrace_read_batch() */
+typedef struct pytrace_batch_t {
+	libtrace_packet_t **packets;	/**< Preallocated packet slots */
+	int capacity;			/**< Number of slots in packets */
+	int count;			/**< Number of slots filled by the last read */
+	int status;			/**< Result of the last read */
+} pytrace_batch_t;
+
+/** Allocate a batch with room for capacity packets
+ * @param capacity	The number of packet slots to preallocate
+ * @return A new batch, or NULL if any allocation failed
+ */
+pytrace_batch_t *pytrace_batch_create(int capacity);
+
+/** Destroy a batch and every packet it owns
+ * @param batch		The batch to destroy
+ */
+void pytrace_batch_destroy(pytrace_batch_t *batch);
+
+/** Read up to batch->capacity packets from a reader in a single call
+ * @param reader	The reader to read from
+ * @param batch		The batch to fill, overwriting any previous contents
+ * @return The number of packets read. 0 means that either the end of the
+ * trace was reached or an error occurred; check batch->status, which holds
+ * the value returned by the final read.
+ *
+ * Packets from a previous fill of the same batch are invalidated.
+ */
+int pytrace_read_batch(pytrace_reader_t *reader, pytrace_batch_t *batch);
+
+/** Write every packet of a batch to an output trace
+ * @param out		A started output trace
+ * @param batch		The batch whose first batch->count packets are written
+ * @return The number of packets written, or -1 if a write failed, in which
+ * case the error is available from trace_get_err_output()
+ */
+int pytrace_write_batch(libtrace_out_t *out, const pytrace_batch_t *batch);
+
+/*@}*/
+
+/** @name Columnar decoding
+ * @{
+ */
+
+/** Column selection flags for pytrace_columns_create() */
+#define PYTRACE_COL_TIMESTAMP		0x0001
+#define PYTRACE_COL_WIRE_LENGTH		0x0002
+#define PYTRACE_COL_CAPTURE_LENGTH	0x0004
+#define PYTRACE_COL_IP_VERSION		0x0008
+#define PYTRACE_COL_SRC_IP		0x0010
+#define PYTRACE_COL_DST_IP		0x0020
+#define PYTRACE_COL_SRC_PORT		0x0040
+#define PYTRACE_COL_DST_PORT		0x0080
+#define PYTRACE_COL_PROTO		0x0100
+#define PYTRACE_COL_TCP_FLAGS		0x0200
+#define PYTRACE_COL_SRC_ADDR		0x0400
+#define PYTRACE_COL_DST_ADDR		0x0800
+#define PYTRACE_COL_VLAN		0x1000
+#define PYTRACE_COL_TUNNEL_TYPE		0x2000
+#define PYTRACE_COL_TUNNEL_ID		0x4000
+
+/** Struct-of-arrays output for a pass over a trace.
+ *
+ * Only the arrays selected by fields are allocated; the rest stay NULL.
+ * src_ip and dst_ip are IPv4 only, in host byte order, and are 0 for any
+ * other network protocol. src_addr and dst_addr hold either version as 16
+ * bytes in network byte order, IPv4 being mapped to ::ffff:a.b.c.d, and
+ * are all zeros for non-IP packets. Ports, protocol, flags, VLAN and
+ * tunnel fields are 0 when absent.
+ */
+typedef struct pytrace_columns_t {
+	uint32_t fields;		/**< PYTRACE_COL_* flags in use */
+	size_t count;			/**< Number of rows stored */
+	size_t capacity;		/**< Number of rows allocated */
+	uint64_t *timestamp;		/**< ERF timestamps */
+	uint32_t *wire_length;		/**< Wire lengths */
+	uint32_t *capture_length;	/**< Capture lengths */
+	uint8_t *ip_version;		/**< 4, 6 or 0 for non-IP */
+	uint32_t *src_ip;		/**< IPv4 source addresses */
+	uint32_t *dst_ip;		/**< IPv4 destination addresses */
+	uint16_t *src_port;		/**< Source ports */
+	uint16_t *dst_port;		/**< Destination ports */
+	uint8_t *proto;			/**< Transport protocols */
+	uint8_t *tcp_flags;		/**< TCP flag byte (CWR..FIN) */
+	uint8_t *src_addr;		/**< 16 bytes per row */
+	uint8_t *dst_addr;		/**< 16 bytes per row */
+	uint16_t *vlan;			/**< Outermost VLAN ID */
+	uint8_t *tunnel_type;		/**< PYTRACE_ENCAP_* of the outermost
+					  encapsulation other than VLAN */
+	uint32_t *tunnel_id;		/**< Its id, as in pytrace_encap_t */
+} pytrace_columns_t;
+
+/** Allocate empty columns
+ * @param fields	The PYTRACE_COL_* flags for the columns to produce
+ * @param capacity	The number of rows to allocate up front
+ * @return The new columns, or NULL if allocation failed
+ */
+pytrace_columns_t *pytrace_columns_create(uint32_t fields, size_t capacity);
+
+/** Free columns and any arrays still attached to them
+ * @param cols		The columns to destroy
+ */
+void pytrace_columns_destroy(pytrace_columns_t *cols);
+
+/** Empty columns so they can be filled again
+ *
+ * Arrays that were detached (set to NULL) are allocated again at the
+ * current capacity, so a trace can be decoded in fixed-size chunks, each
+ * handed over in turn.
+ * @param cols		The columns to reset
+ * @return 0 on success, or -1 if an array could not be allocated
+ */
+int pytrace_columns_reset(pytrace_columns_t *cols);
+
+/** Decode packets from a reader, appending one row per packet
+ * @param reader	The reader to read from
+ * @param packet	A scratch packet to read into
+ * @param cols		The columns to append to; arrays grow as needed
+ * @param limit		Stop after this many rows have been appended, or 0 to
+ * read until the end of the trace
+ * @return 0 at the end of the input, 1 if limit was reached, -1 if reading
+ * failed or -2 if an array could not be grown
+ */
+int pytrace_columns_read(pytrace_reader_t *reader, libtrace_packet_t *packet,
+		pytrace_columns_t *cols, size_t limit);
+
+/** Free memory allocated by a pytrace helper
+ *
+ * Used for arrays that have been detached from their owning structure and
+ * handed over to Python.
+ * @param ptr		The memory to free
+ */
+void pytrace_free(void *ptr);
+
+/** Convert ERF timestamps to nanoseconds since the epoch, in place
+ * @param timestamps	The timestamps to convert
+ * @param count		How many there are
+ */
+void pytrace_erf_to_ns(uint64_t *timestamps, size_t count);
+
+/*@}*/
+
+/** @name Read-ahead
+ * @{
+ */
+
+/** Opaque structure holding a background reader thread and its batches */
+typedef struct pytrace_readahead_t pytrace_readahead_t;
+
+/** Start a thread that reads batches from a reader ahead of the consumer
+ *
+ * The thread owns the reader until pytrace_readahead_stop() returns;
+ * nothing else may read from it in the meantime.
+ * @param reader	The reader to read from
+ * @param depth		The number of batches the thread may fill ahead of the
+ * one currently held by the consumer
+ * @param batch_size	The number of packets per batch
+ * @return The read-ahead state, or NULL if it could not be set up
+ */
+pytrace_readahead_t *pytrace_readahead_start(pytrace_reader_t *reader,
+		int depth, int batch_size);
+
+/** Take the next filled batch, blocking until one is ready
+ *
+ * The batch returned by the previous call is handed back to the reader
+ * thread for refilling, so its packets become invalid.
+ * @param ra		The read-ahead state
+ * @return The next batch. A batch with count 0 marks the end of the trace,
+ * or an error if its status is negative; it is returned again by any
+ * further calls.
+ */
+pytrace_batch_t *pytrace_readahead_next(pytrace_readahead_t *ra);
+
+/** Stop the reader thread and wait for it to exit
+ *
+ * Safe to call more than once. Batches remain allocated until
+ * pytrace_readahead_destroy().
+ * @param ra		The read-ahead state
+ */
+void pytrace_readahead_stop(pytrace_readahead_t *ra);
+
+/** Stop the reader thread if needed and free all batches
+ * @param ra		The read-ahead state to destroy
+ */
+void pytrace_readahead_destroy(pytrace_readahead_t *ra);
+
+/*@}*/
+
+/** @name Uncompressed pcap files
+ * A native reader for uncompressed pcap files that knows the byte offset of
+ * every record, and a sidecar index of (timestamp, offset) checkpoints that
+ * lets it seek by time with a binary search instead of a linear scan.
+ * @{
+ */
+
+/** Flag for pytrace_pcap_open(): map the file into memory.
+ *
+ * Packets then point directly at the mapping instead of being copied into
+ * their own buffers. They are valid for as long as the reader is.
+ */
+#define PYTRACE_PCAP_MMAP	0x1
+
+/** Open an uncompressed pcap file for reading
+ * @param path		The path of the pcap file
+ * @param flags		PYTRACE_PCAP_* flags
+ * @param error		A buffer of at least 256 bytes to describe any failure
+ * @return A new reader positioned at the first record, or NULL on failure
+ */
+pytrace_reader_t *pytrace_pcap_open(const char *path, int flags,
+		char *error);
+
+/** Position a pcap reader at the first record at or after a timestamp
+ *
+ * Reading starts from offset and skips over (without copying) any record
+ * that is older than ts. On a reader restricted by pytrace_pcap_set_range(),
+ * an offset before the start of the range is moved up to it.
+ * @param reader	A reader returned by pytrace_pcap_open()
+ * @param offset	The file offset of a record at or before the target, as
+ * returned by pytrace_tindex_lookup(), or 0 for the first record
+ * @param ts		The target time as an ERF timestamp
+ * @return 0 on success, -1 on error
+ */
+int pytrace_pcap_seek(pytrace_reader_t *reader, uint64_t offset, uint64_t ts);
+
+/** Restrict a pcap reader to a byte range of its file
+ *
+ * The reader is positioned at start, and reports the end of input once it
+ * reaches a record at or beyond end.
+ * @param reader	A reader returned by pytrace_pcap_open()
+ * @param start		The offset of a record header, e.g. from
+ * pytrace_pcap_split()
+ * @param end		The offset to stop at, or 0 for the end of the file
+ * @return 0 on success, -1 on error
+ */
+int pytrace_pcap_set_range(pytrace_reader_t *reader, uint64_t start,
+		uint64_t end);
+
+/** Truncate the records returned by a pcap reader
+ *
+ * This is the native reader's equivalent of TRACE_OPTION_SNAPLEN: the
+ * capture length of each packet is limited to snaplen and the rest of the
+ * record is skipped, while the wire length is left alone.
+ * @param reader	A reader returned by pytrace_pcap_open()
+ * @param snaplen	The most bytes of a packet to return, or 0 for all
+ */
+void pytrace_pcap_set_snaplen(pytrace_reader_t *reader, uint32_t snaplen);
+
+/** Split a pcap file into byte ranges that start on record boundaries
+ *
+ * The file is cut into parts roughly equal pieces. Each cut is moved
+ * forward to the first offset where a run of consecutive, plausible
+ * record headers can be parsed, so every range can be read independently.
+ * @param path		The path of the pcap file
+ * @param parts		The number of ranges wanted
+ * @param offsets	Filled with parts + 1 offsets; range i covers
+ * offsets[i] up to offsets[i + 1]. Ranges may be empty if no boundary
+ * could be found near a cut.
+ * @param error		A buffer of at least 256 bytes to describe any failure
+ * @return 0 on success, -1 on failure
+ */
+int pytrace_pcap_split(const char *path, int parts, uint64_t *offsets,
+		char *error);
+
+/** Opaque structure holding a loaded time index */
+typedef struct pytrace_tindex_t pytrace_tindex_t;
+
+/** Scan a pcap file and write a time index for it
+ * @param path		The path of the pcap file
+ * @param index_path	The path of the index file to write
+ * @param interval	Record a checkpoint every interval packets
+ * @param error		A buffer of at least 256 bytes to describe any failure
+ * @return The number of checkpoints written, or -1 on failure
+ */
+int64_t pytrace_tindex_build(const char *path, const char *index_path,
+		uint32_t interval, char *error);
+
+/** Load a time index
+ * @param index_path	The path of the index file
+ * @param path		The pcap file the index must describe; an index built
+ * for a file of a different size is rejected as stale
+ * @param error		A buffer of at least 256 bytes to describe any failure
+ * @return The loaded index, or NULL on failure
+ */
+pytrace_tindex_t *pytrace_tindex_load(const char *index_path,
+		const char *path, char *error);
+
+/** Find the last checkpoint strictly before a timestamp
+ * @param index		The loaded index
+ * @param ts		The target time as an ERF timestamp
+ * @return The file offset of the checkpoint, or 0 (meaning the first
+ * record) if no checkpoint is older than the target
+ */
+uint64_t pytrace_tindex_lookup(const pytrace_tindex_t *index, uint64_t ts);
+
+/** Free a loaded time index
+ * @param index		The index to free
+ */
+void pytrace_tindex_destroy(pytrace_tindex_t *index);
+
+/*@}*/
+
+/** @name Merging
+ * @{
+ */
+
+/** Create a reader that interleaves several readers by timestamp
+ *
+ * Every input is read ahead in batches, and a binary min-heap keyed on
+ * the ERF timestamp of each input's next packet picks which one to return.
+ * Packets are handed over by swapping them with the caller's packet, so
+ * no packet data is copied. Inputs with equal timestamps are returned in
+ * input order.
+ * @param inputs	The readers to merge; they must outlive the merger
+ * @param ninputs	The number of readers in inputs
+ * @param batch_size	The number of packets to read from an input at once
+ * @return A new reader, or NULL if allocation failed
+ */
+pytrace_reader_t *pytrace_merge_create(pytrace_reader_t **inputs,
+		int ninputs, int batch_size);
+
+/*@}*/
+
+/** @name Flow table
+ * @{
+ */
+
+/** A unidirectional flow, as reported by the flow table */
+typedef struct pytrace_flow_t {
+	uint8_t src[16];	/**< Source address (IPv4 uses 4 bytes) */
+	uint8_t dst[16];	/**< Destination address */
+	uint16_t src_port;	/**< Source port, or 0 */
+	uint16_t dst_port;	/**< Destination port, or 0 */
+	uint8_t proto;		/**< Transport protocol */
+	uint8_t ip_version;	/**< 4 or 6 */
+	uint64_t packets;	/**< Packets seen */
+	uint64_t bytes;		/**< Sum of the packets' wire lengths */
+	uint64_t first;		/**< ERF timestamp of the first packet */
+	uint64_t last;		/**< ERF timestamp of the last packet */
+} pytrace_flow_t;
+
+/** Opaque structure holding a flow table */
+typedef struct pytrace_flowtable_t pytrace_flowtable_t;
+
+/** Create a flow table
+ * @param capacity	The number of flows to size the table for initially;
+ * it grows as needed
+ * @param idle_timeout	Expire flows that have seen no packet for this long,
+ * as an ERF timestamp difference
+ * @return The new table, or NULL if allocation failed
+ */
+pytrace_flowtable_t *pytrace_flowtable_create(uint32_t capacity,
+		uint64_t idle_timeout);
+
+/** Destroy a flow table
+ * @param ft		The table to destroy
+ */
+void pytrace_flowtable_destroy(pytrace_flowtable_t *ft);
+
+/** Aggregate packets from a reader until some flows have expired
+ *
+ * Idle time is measured against the timestamps of the packets themselves,
+ * so expiry works the same on live captures and archived traces.
+ * @param ft		The flow table
+ * @param reader	The reader to take packets from
+ * @param packet	A scratch packet to read into
+ * @param out		Filled with expired flows
+ * @param max		The size of out; reading stops once it is full
+ * @param status	Set to the result of the last read: 0 at the end of
+ * the input, -1 on a read error or -2 if the table could not grow
+ * @return The number of flows written to out
+ */
+int pytrace_flowtable_read(pytrace_flowtable_t *ft, pytrace_reader_t *reader,
+		libtrace_packet_t *packet, pytrace_flow_t *out, int max,
+		int *status);
+
+/** Expire every remaining flow, oldest first
+ * @param ft		The flow table
+ * @param out		Filled with expired flows
+ * @param max		The size of out
+ * @return The number of flows written to out; 0 once the table is empty
+ */
+int pytrace_flowtable_flush(pytrace_flowtable_t *ft, pytrace_flow_t *out,
+		int max);
+
+/** Get the number of flows currently in a table
+ * @param ft		The flow table
+ * @return The number of active flows
+ */
+uint64_t pytrace_flowtable_size(const pytrace_flowtable_t *ft);
+
+/*@}*/
+
+/** @name TCP stream reassembly
+ * @{
+ */
+
+/** The first chunk of a new stream; it carries no data */
+#define PYTRACE_TCP_START	0x01
+/** Data was skipped before this chunk (lost, or dropped to stay within
+ * the memory caps). Bytes cut off by the capture are not reported this
+ * way; see PYTRACE_TCP_TRUNCATED. */
+#define PYTRACE_TCP_GAP		0x02
+/** The segment was truncated by the capture. The chunk holds only the
+ * captured bytes; the rest of the segment is missing after them, and the
+ * next chunk of the stream starts after the whole segment, without
+ * PYTRACE_TCP_GAP */
+#define PYTRACE_TCP_TRUNCATED	0x04
+/** The stream ended with a FIN; this is its last chunk */
+#define PYTRACE_TCP_FIN		0x08
+/** The stream ended with a RST; this is its last chunk */
+#define PYTRACE_TCP_RST		0x10
+/** The stream ended by going idle, or at the end of the input */
+#define PYTRACE_TCP_CLOSED	0x20
+
+/** A run of in-order bytes from one direction of a TCP connection */
+typedef struct pytrace_tcp_chunk_t {
+	uint64_t stream;	/**< Identifies the stream within a reassembler */
+	uint8_t src[16];	/**< Source address (IPv4 uses 4 bytes) */
+	uint8_t dst[16];	/**< Destination address */
+	uint16_t src_port;	/**< Source port */
+	uint16_t dst_port;	/**< Destination port */
+	uint8_t ip_version;	/**< 4 or 6 */
+	uint8_t flags;		/**< PYTRACE_TCP_* flags */
+	uint64_t ts;		/**< ERF timestamp of the latest segment used */
+	uint64_t offset;	/**< Start of the data in pytrace_tcp_data() */
+	uint32_t length;	/**< Length of the data */
+} pytrace_tcp_chunk_t;
+
+/** Opaque structure holding a TCP reassembler */
+typedef struct pytrace_tcp_t pytrace_tcp_t;
+
+/** Create a TCP reassembler
+ * @param stream_cap	The most out-of-order data buffered per stream, in
+ * bytes
+ * @param total_cap	The most out-of-order data buffered in total
+ * @param idle_timeout	Close streams that have seen no segment for this
+ * long, as an ERF timestamp difference
+ * @return The new reassembler, or NULL if allocation failed
+ */
+pytrace_tcp_t *pytrace_tcp_create(uint64_t stream_cap, uint64_t total_cap,
+		uint64_t idle_timeout);
+
+/** Destroy a TCP reassembler and every stream it holds
+ * @param tcp		The reassembler to destroy
+ */
+void pytrace_tcp_destroy(pytrace_tcp_t *tcp);
+
+/** Feed packets from a reader through the reassembler
+ *
+ * The previous output is discarded first. Reading stops after
+ * max_packets packets, or once max_chunks chunks have been produced.
+ * @param tcp		The reassembler
+ * @param reader	The reader to take packets from
+ * @param packet	A scratch packet to read into
+ * @param max_packets	The most packets to read
+ * @param max_chunks	Stop reading once this many chunks are ready
+ * @param status	Set to the result of the last read: 1 if more may
+ * follow, 0 at the end of the input, -1 on a read error or -2 if memory ran
+ * out
+ * @return The number of chunks now available from pytrace_tcp_chunks()
+ */
+int pytrace_tcp_read(pytrace_tcp_t *tcp, pytrace_reader_t *reader,
+		libtrace_packet_t *packet, int max_packets, int max_chunks,
+		int *status);
+
+/** Close every remaining stream, delivering any buffered data
+ *
+ * The previous output is discarded first.
+ * @param tcp		The reassembler
+ * @return The number of chunks now available from pytrace_tcp_chunks(), or
+ * -1 if memory ran out
+ */
+int pytrace_tcp_flush(pytrace_tcp_t *tcp);
+
+/** Get the chunks produced by the last read or flush
+ * @param tcp		The reassembler
+ * @return An array of chunks, valid until the next read or flush
+ */
+const pytrace_tcp_chunk_t *pytrace_tcp_chunks(const pytrace_tcp_t *tcp);
+
+/** Get the data referred to by the chunks of the last read or flush
+ * @param tcp		The reassembler
+ * @param length	Set to the total length of the data
+ * @return The data, valid until the next read or flush
+ */
+const unsigned char *pytrace_tcp_data(const pytrace_tcp_t *tcp,
+		uint64_t *length);
+
+/*@}*/
+
+/** @name IP defragmentation
+ * @{
+ */
+
+/** Counters kept by a defragmenting reader */
+typedef struct pytrace_defrag_stats_t {
+	uint64_t fragments;	/**< Fragments taken into the cache */
+	uint64_t reassembled;	/**< Datagrams completed and returned */
+	uint64_t expired;	/**< Incomplete datagrams that timed out */
+	uint64_t evicted;	/**< Incomplete datagrams dropped for space */
+	uint64_t invalid;	/**< Datagrams dropped as oversized */
+	uint64_t passed;	/**< Fragments returned untouched */
+} pytrace_defrag_stats_t;
+
+/** Create a reader that reassembles fragmented IPv4 and IPv6 datagrams
+ *
+ * Packets that are not fragments are returned unchanged. Fragments are
+ * held in a cache until their datagram is complete, which is then
+ * returned as a single raw IP packet (TRACE_TYPE_NONE) carrying the
+ * timestamp of its last fragment. Fragments that cannot be cached, such
+ * as ones truncated by the capture snap length, are returned untouched.
+ * @param input		The reader to take packets from; it is not owned and
+ * must outlive the new reader
+ * @param max_bytes	The most fragment data to hold; the oldest datagrams
+ * are dropped to make room
+ * @param max_per_source The most incomplete datagrams to hold for any one
+ * source address, or 0 for no limit
+ * @param timeout	Drop incomplete datagrams this long after their first
+ * fragment, as an ERF timestamp difference
+ * @return A new reader, or NULL if allocation failed
+ */
+pytrace_reader_t *pytrace_defrag_create(pytrace_reader_t *input,
+		uint64_t max_bytes, uint32_t max_per_source, uint64_t timeout);
+
+/** Get the counters of a defragmenting reader
+ * @param reader	A reader returned by pytrace_defrag_create()
+ * @param stats		Filled with the current counters
+ */
+void pytrace_defrag_stats(pytrace_reader_t *reader,
+		pytrace_defrag_stats_t *stats);
+
+/*@}*/
+
+/** @name Duplicate removal
+ * @{
+ */
+
+/** Counters kept by a deduplicating reader */
+typedef struct pytrace_dedup_stats_t {
+	uint64_t packets;	/**< Packets read from the input */
+	uint64_t duplicates;	/**< Packets dropped as copies */
+	uint64_t unhashed;	/**< Packets without a layer 3 header, which
+				  are always passed on */
+} pytrace_dedup_stats_t;
+
+/** Create a reader that drops duplicated packets
+ *
+ * A packet is a duplicate if one with the same layer 3 header and payload
+ * was seen within window of it. The IPv4 TTL and checksum and the IPv6 hop
+ * limit are left out of the comparison, as is the link layer.
+ * @param input		The reader to take packets from; it is not owned and
+ * must outlive the new reader
+ * @param capacity	The number of recent packets remembered, rounded up
+ * to a power of two
+ * @param window	How far apart copies may be, as an ERF timestamp
+ * difference
+ * @return A new reader, or NULL if allocation failed
+ */
+pytrace_reader_t *pytrace_dedup_create(pytrace_reader_t *input,
+		uint32_t capacity, uint64_t window);
+
+/** Get the counters of a deduplicating reader
+ * @param reader	A reader returned by pytrace_dedup_create()
+ * @param stats		Filled with the current counters
+ */
+void pytrace_dedup_stats(pytrace_reader_t *reader,
+		pytrace_dedup_stats_t *stats);
+
+/*@}*/
+
+/** @name Multi-filter classification
+ * A classifier tests every packet of a batch against many rules at once.
+ * Every rule is a BPF filter. Rules simple enough to be expressed as a
+ * pytrace_match_t are instead checked against the packet's 5-tuple, which
+ * is decoded only once per packet, but only for untagged IP packets that
+ * BPF would decode the same way; other packets still go through BPF.
+ * @{
+ */
+
+/** Which tests of a pytrace_match_t apply; a packet matches when every
+ * selected test passes */
+#define PYTRACE_MATCH_VERSION	0x01	/**< ip_version */
+#define PYTRACE_MATCH_PROTO	0x02	/**< proto */
+#define PYTRACE_MATCH_SRC_NET	0x04	/**< src/src_len */
+#define PYTRACE_MATCH_DST_NET	0x08	/**< dst/dst_len */
+#define PYTRACE_MATCH_NET	0x10	/**< Either address in net/net_len */
+#define PYTRACE_MATCH_SRC_PORT	0x20	/**< src_port */
+#define PYTRACE_MATCH_DST_PORT	0x40	/**< dst_port */
+#define PYTRACE_MATCH_PORT	0x80	/**< Either port equal to port */
+
+/** A rule evaluated natively on the decoded 5-tuple. Address tests only
+ * apply to packets of the rule's ip_version, and port tests only to TCP,
+ * UDP and SCTP, as in BPF. */
+typedef struct pytrace_match_t {
+	uint32_t tests;		/**< PYTRACE_MATCH_* flags */
+	uint8_t ip_version;
+	uint8_t proto;
+	uint16_t src_port;	/**< Host byte order, as are the others */
+	uint16_t dst_port;
+	uint16_t port;
+	uint8_t src_len;	/**< Prefix lengths in bits */
+	uint8_t dst_len;
+	uint8_t net_len;
+	uint8_t src[16];	/**< Network byte order */
+	uint8_t dst[16];
+	uint8_t net[16];
+} pytrace_match_t;
+
+/** Opaque structure holding a classifier */
+typedef struct pytrace_classifier_t pytrace_classifier_t;
+
+/** Create a classifier
+ * @param nrules	The number of rules; each must be set with
+ * pytrace_classifier_set_filter() before use
+ * @return The new classifier, or NULL if allocation failed
+ */
+pytrace_classifier_t *pytrace_classifier_create(int nrules);
+
+/** Destroy a classifier
+ * @param c		The classifier to destroy
+ */
+void pytrace_classifier_destroy(pytrace_classifier_t *c);
+
+/** Let a rule be matched natively where BPF would agree
+ * @param c		The classifier
+ * @param rule		The rule number
+ * @param match		The tests equivalent to the rule's filter; copied
+ */
+void pytrace_classifier_set_match(pytrace_classifier_t *c, int rule,
+		const pytrace_match_t *match);
+
+/** Set the BPF filter of a rule
+ * @param c		The classifier
+ * @param rule		The rule number
+ * @param filter	A filter returned by pytrace_filter_get()
+ */
+void pytrace_classifier_set_filter(pytrace_classifier_t *c, int rule,
+		pytrace_filter_t *filter);
+
+/** Get the number of 64 bit words in the mask of one packet
+ * @param c		The classifier
+ * @return (nrules + 63) / 64
+ */
+int pytrace_classifier_words(const pytrace_classifier_t *c);
+
+/** Classify every packet of a batch
+ *
+ * The per-rule packet and byte counters are updated as a side effect.
+ * @param c		The classifier
+ * @param batch		The packets to classify
+ * @param masks		NULL, or filled with batch->count masks of
+ * pytrace_classifier_words() words each; bit r % 64 of word r / 64 is set
+ * if the packet matched rule r
+ * @return 0 on success, or -1 if a BPF filter could not be applied
+ */
+int pytrace_classifier_batch(pytrace_classifier_t *c,
+		const pytrace_batch_t *batch, uint64_t *masks);
+
+/** Get the number of packets that matched each rule
+ * @param c		The classifier
+ * @return An array of nrules counters
+ */
+const uint64_t *pytrace_classifier_packets(const pytrace_classifier_t *c);
+
+/** Get the wire length of the packets that matched each rule
+ * @param c		The classifier
+ * @return An array of nrules counters
+ */
+const uint64_t *pytrace_classifier_bytes(const pytrace_classifier_t *c);
+
+/** Zero the per-rule counters
+ * @param c		The classifier
+ */
+void pytrace_classifier_reset(pytrace_classifier_t *c);
+
+/*@}*/
+
+/** @name Tunnel decapsulation
+ * @{
+ */
+
+/** Offset value for a header that was not found */
+#define PYTRACE_DECAP_NONE	0xffffffff
+
+/** @name Encapsulation types reported by pytrace_decap()
+ * @{ */
+#define PYTRACE_ENCAP_VLAN	1	/**< 802.1Q/802.1ad tag; id is the VID */
+#define PYTRACE_ENCAP_MPLS	2	/**< id is the label */
+#define PYTRACE_ENCAP_PPPOE	3	/**< id is the session ID */
+#define PYTRACE_ENCAP_GRE	4	/**< id is the key, or 0 */
+#define PYTRACE_ENCAP_VXLAN	5	/**< id is the VNI */
+#define PYTRACE_ENCAP_IPIP	6	/**< IPv4 or IPv6 directly in IP */
+/*@}*/
+
+/** One level of encapsulation */
+typedef struct pytrace_encap_t {
+	uint32_t type;		/**< PYTRACE_ENCAP_* */
+	uint32_t id;
+	uint32_t offset;	/**< Offset of the header from layer 2 */
+} pytrace_encap_t;
+
+/** Everything pytrace_decap() finds in a packet. Offsets are from the
+ * start of the layer 2 header returned by trace_get_layer2(). */
+typedef struct pytrace_decap_t {
+	uint32_t outer_l3;	/**< Outermost IP header */
+	uint32_t inner_l3;	/**< Innermost IP header */
+	uint32_t inner_l4;	/**< Transport header after inner_l3 */
+	uint16_t outer_ethertype;
+	uint16_t inner_ethertype;
+	int nencaps;		/**< Entries used in encaps, outermost first */
+	pytrace_encap_t encaps[8];
+	/** The innermost 5-tuple, laid out as in pytrace_flow_t */
+	uint8_t src[16];
+	uint8_t dst[16];
+	uint16_t src_port;
+	uint16_t dst_port;
+	uint8_t proto;
+	uint8_t ip_version;	/**< 4 or 6, or 0 if no IP header was found */
+} pytrace_decap_t;
+
+/** Walk every encapsulation layer of a packet in one call
+ *
+ * VLAN, MPLS (including Ethernet pseudowires), PPPoE, GRE (including
+ * transparent Ethernet bridging), VXLAN on UDP port 4789 and IP-in-IP
+ * are unwrapped, up to 8 levels.
+ * @param packet	The packet to decode
+ * @param out		Filled with the headers found
+ * @return 1 if an IP header was found, otherwise 0
+ */
+int pytrace_decap(const libtrace_packet_t *packet, pytrace_decap_t *out);
+
+/** Run pytrace_decap() over every packet of a batch
+ * @param batch		The packets to decode
+ * @param out		An array of batch->count results
+ * @return The number of packets in which an IP header was found
+ */
+int pytrace_decap_batch(const pytrace_batch_t *batch, pytrace_decap_t *out);
+
+/*@}*/
+
+/** @name Layer parsing
+ * @{
+ */
+
+/** Where each layer of a packet starts, as filled by
+ * pytrace_parse_layers(). Offsets are from the start of the buffer
+ * returned by trace_get_packet_buffer(), and are PYTRACE_DECAP_NONE for
+ * layers that are missing; each *_remaining is the number of captured
+ * bytes from that offset onwards. */
+typedef struct pytrace_layers_t {
+	uint64_t timestamp;		/**< ERF timestamp */
+	uint32_t capture_length;
+	uint32_t wire_length;
+	uint32_t l2;
+	uint32_t l2_remaining;
+	uint32_t l3;
+	uint32_t l3_remaining;
+	uint32_t l4;
+	uint32_t l4_remaining;
+	uint32_t payload;		/**< After a TCP, UDP or ICMP header */
+	uint32_t payload_remaining;
+	int32_t link_type;		/**< libtrace_linktype_t */
+	uint16_t ethertype;		/**< Of the layer 3 header */
+	uint8_t proto;			/**< Of the layer 4 header */
+	uint8_t pad;
+} pytrace_layers_t;
+
+/** Locate every layer of a packet in one call
+ *
+ * This goes through libtrace's own decoding, so the header pointers it
+ * caches in the packet are filled in as a side effect.
+ * @param packet	The packet to parse
+ * @param out		Filled with the offsets found
+ * @return 1 if the packet has a layer 3 header, otherwise 0
+ */
+int pytrace_parse_layers(libtrace_packet_t *packet, pytrace_layers_t *out);
+
+/** Run pytrace_parse_layers() over every packet of a batch
+ * @param batch		The packets to parse
+ * @param out		An array of batch->count results
+ * @return The number of packets with a layer 3 header
+ */
+int pytrace_parse_layers_batch(const pytrace_batch_t *batch,
+		pytrace_layers_t *out);
+
+/*@}*/
+
+/** @name Header retention
+ * @{
+ */
+
+/** Where pytrace_copy_headers() put the headers of one packet, along with
+ * the metadata needed once the packet itself has gone */
+typedef struct pytrace_header_t {
+	uint64_t timestamp;		/**< ERF timestamp */
+	uint64_t offset;		/**< Of the copied headers in the arena */
+	uint32_t length;		/**< Number of bytes copied */
+	uint32_t payload;		/**< Payload offset, or PYTRACE_DECAP_NONE */
+	uint32_t capture_length;
+	uint32_t wire_length;
+	int32_t link_type;		/**< Of the copied bytes */
+	uint32_t pad;
+} pytrace_header_t;
+
+/** Copy the headers of every packet of a batch into one arena
+ *
+ * For each packet, the bytes from the start of trace_get_packet_buffer()
+ * up to the transport payload are copied, or the whole capture if the
+ * payload cannot be found, in either case limited to max_header bytes.
+ * The copies are packed back to back.
+ * @param batch		The packets to copy from
+ * @param out		An array of batch->count results
+ * @param arena		At least batch->count * max_header bytes
+ * @param max_header	The most bytes to copy from each packet
+ * @return The number of bytes of the arena used
+ */
+uint64_t pytrace_copy_headers(const pytrace_batch_t *batch,
+		pytrace_header_t *out, unsigned char *arena,
+		uint32_t max_header);
+
+/*@}*/
+
+/** @name Windowed counters
+ * @{
+ */
+
+/** Count every packet under one key, 0 */
+#define PYTRACE_WINDOW_TOTAL	0
+/** Count per IP protocol */
+#define PYTRACE_WINDOW_PROTO	1
+/** Count per protocol and source port, as proto << 16 | port */
+#define PYTRACE_WINDOW_SRC_PORT	2
+/** Count per protocol and destination port, as proto << 16 | port */
+#define PYTRACE_WINDOW_DST_PORT	3
+/** Count per protocol and the lower of the two ports, which is usually
+ * the service port, as proto << 16 | port */
+#define PYTRACE_WINDOW_PORT	4
+/** The key of packets without a transport header, except with
+ * PYTRACE_WINDOW_TOTAL */
+#define PYTRACE_WINDOW_OTHER	0xffffffff
+
+/** The counters of one key over one closed window */
+typedef struct pytrace_window_t {
+	uint64_t start;		/**< ERF timestamp of the start of the window */
+	uint64_t end;		/**< ERF timestamp just after the window */
+	uint64_t packets;
+	uint64_t bytes;		/**< Wire length of the packets */
+	uint32_t key;		/**< Depends on the PYTRACE_WINDOW_* key type */
+	uint32_t pad;
+} pytrace_window_t;
+
+/** Opaque structure holding a window aggregator */
+typedef struct pytrace_windows_t pytrace_windows_t;
+
+/** Create a window aggregator
+ *
+ * Windows are width long and start every step, at multiples of step
+ * since the ERF epoch; width == step gives tumbling windows. Only windows
+ * that saw packets are reported. Packets whose timestamp goes backwards
+ * are counted in the latest window they could belong to.
+ * @param key		One of the PYTRACE_WINDOW_* key types
+ * @param width		The length of a window, as an ERF timestamp
+ * difference
+ * @param step		How far apart windows start; width must be a
+ * multiple of it
+ * @return The new aggregator, or NULL if the sizes are invalid or
+ * allocation failed
+ */
+pytrace_windows_t *pytrace_windows_create(int key, uint64_t width,
+		uint64_t step);
+
+/** Destroy a window aggregator
+ * @param w		The aggregator to destroy
+ */
+void pytrace_windows_destroy(pytrace_windows_t *w);
+
+/** Feed packets from a reader through the aggregator
+ *
+ * The previous output is discarded first. Reading stops after
+ * max_packets packets, or once max_rows rows have been produced.
+ * @param w		The aggregator
+ * @param reader	The reader to take packets from
+ * @param packet	A scratch packet to read into
+ * @param max_packets	The most packets to read
+ * @param max_rows	Stop reading once this many rows are ready
+ * @param status	Set to the result of the last read: 1 if more may
+ * follow, 0 at the end of the input, -1 on a read error or -2 if memory ran
+ * out
+ * @return The number of rows now available from pytrace_windows_rows()
+ */
+int pytrace_windows_read(pytrace_windows_t *w, pytrace_reader_t *reader,
+		libtrace_packet_t *packet, int max_packets, int max_rows,
+		int *status);
+
+/** Close every window still holding packets, at the end of the input
+ *
+ * Like the first windows of the input, the last sliding windows may only
+ * be partly covered by it. The previous output is discarded first.
+ * @param w		The aggregator
+ * @return The number of rows now available from pytrace_windows_rows(), or
+ * -1 if memory ran out
+ */
+int pytrace_windows_flush(pytrace_windows_t *w);
+
+/** Get the rows produced by the last read or flush
+ *
+ * Rows come window by window in time order, sorted by key within a
+ * window.
+ * @param w		The aggregator
+ * @return An array of rows, valid until the next read or flush
+ */
+const pytrace_window_t *pytrace_windows_rows(const pytrace_windows_t *w);
+
+/*@}*/
+
+/** @name Sketches
+ * Fixed-memory summaries of the packets' 5-tuples, which can be saved and
+ * merged across inputs.
+ * @{
+ */
+
+/** Estimates the total weight of any key */
+#define PYTRACE_SKETCH_COUNT_MIN	1
+/** Estimates the number of distinct keys (HyperLogLog) */
+#define PYTRACE_SKETCH_HLL		2
+/** Tracks the width keys of largest weight (SpaceSaving) */
+#define PYTRACE_SKETCH_TOP_K		3
+
+/** Fields a sketch key is made of */
+#define PYTRACE_SKETCH_SRC		0x01
+#define PYTRACE_SKETCH_DST		0x02
+#define PYTRACE_SKETCH_SRC_PORT		0x04
+#define PYTRACE_SKETCH_DST_PORT		0x08
+#define PYTRACE_SKETCH_PROTO		0x10
+
+/** What each packet adds to its key */
+#define PYTRACE_SKETCH_PACKETS		0
+#define PYTRACE_SKETCH_BYTES		1	/**< Its wire length */
+
+/** The parameters of a sketch. Only sketches with identical parameters
+ * can be merged. */
+typedef struct pytrace_sketch_config_t {
+	uint32_t kind;		/**< PYTRACE_SKETCH_COUNT_MIN, _HLL or _TOP_K */
+	uint32_t key;		/**< PYTRACE_SKETCH_* fields of the key */
+	uint32_t distinct;	/**< Top-k only: fields whose distinct values
+				  are estimated for each entry, or 0 */
+	uint32_t weight;	/**< PYTRACE_SKETCH_PACKETS or _BYTES */
+	uint8_t prefix4;	/**< Leading bits of IPv4 addresses kept */
+	uint8_t prefix6;	/**< Leading bits of IPv6 addresses kept */
+	uint8_t precision;	/**< log2 of the HyperLogLog registers, 4-18
+				  (4-12 for the per-entry ones of top-k) */
+	uint8_t pad;
+	uint32_t width;		/**< Count-Min counters per row; top-k entries */
+	uint32_t depth;		/**< Count-Min rows */
+	uint64_t seed;
+} pytrace_sketch_config_t;
+
+/** A sketch key; fields that are not part of the key are zero */
+typedef struct pytrace_sketch_key_t {
+	uint8_t src[16];	/**< IPv4 uses the first 4 bytes */
+	uint8_t dst[16];
+	uint16_t src_port;
+	uint16_t dst_port;
+	uint8_t proto;
+	uint8_t ip_version;	/**< 4 or 6 if the key has an address */
+	uint8_t pad[2];
+} pytrace_sketch_key_t;
+
+/** One entry of a top-k sketch */
+typedef struct pytrace_sketch_entry_t {
+	pytrace_sketch_key_t key;
+	uint64_t count;		/**< Never less than the true weight */
+	uint64_t error;		/**< The most count can exceed it by */
+	double distinct;	/**< Estimated distinct values of the config's
+				  distinct fields, or 0 */
+} pytrace_sketch_entry_t;
+
+/** Opaque structure holding a sketch */
+typedef struct pytrace_sketch_t pytrace_sketch_t;
+
+/** Create an empty sketch
+ * @param config	Its parameters
+ * @return The new sketch, or NULL if the parameters are invalid or
+ * allocation failed
+ */
+pytrace_sketch_t *pytrace_sketch_create(const pytrace_sketch_config_t *config);
+
+/** Destroy a sketch
+ * @param s		The sketch to destroy
+ */
+void pytrace_sketch_destroy(pytrace_sketch_t *s);
+
+/** Get the parameters of a sketch
+ * @param s		The sketch
+ * @return Its parameters
+ */
+const pytrace_sketch_config_t *pytrace_sketch_config(
+		const pytrace_sketch_t *s);
+
+/** Get the total weight counted by a sketch
+ * @param s		The sketch
+ * @return The sum of the weights of every packet added
+ */
+uint64_t pytrace_sketch_total(const pytrace_sketch_t *s);
+
+/** Add every IP packet of a batch to several sketches
+ *
+ * Each packet's 5-tuple is decoded once for all of the sketches.
+ * @param sketches	The sketches to update
+ * @param nsketches	The number of sketches
+ * @param batch		The packets to add
+ * @return The number of packets added
+ */
+int pytrace_sketch_update(pytrace_sketch_t **sketches, int nsketches,
+		const pytrace_batch_t *batch);
+
+/** Estimate the weight of a key
+ * @param s		A Count-Min or top-k sketch
+ * @param key		The key; fields outside the sketch's key and
+ * address bits past its prefix are ignored
+ * @return The estimated weight, never less than the true one for
+ * Count-Min; 0 for keys a top-k sketch does not track
+ */
+uint64_t pytrace_sketch_query(const pytrace_sketch_t *s,
+		const pytrace_sketch_key_t *key);
+
+/** Estimate the number of distinct keys
+ * @param s		A HyperLogLog sketch
+ * @return The estimate, or 0 for other kinds of sketch
+ */
+double pytrace_sketch_distinct(const pytrace_sketch_t *s);
+
+/** Get the entries of a top-k sketch
+ * @param s		A top-k sketch
+ * @param out		Room for config.width entries; filled largest
+ * count first
+ * @return The number of entries filled
+ */
+int pytrace_sketch_top(const pytrace_sketch_t *s, pytrace_sketch_entry_t *out);
+
+/** Merge one sketch into another
+ * @param dst		The sketch to update
+ * @param src		The sketch to add to it
+ * @return 0 on success, -1 if the sketches' parameters differ or -2 if
+ * memory ran out
+ */
+int pytrace_sketch_merge(pytrace_sketch_t *dst, const pytrace_sketch_t *src);
+
+/** Get the size of a sketch as saved by pytrace_sketch_save()
+ * @param s		The sketch
+ * @return The size in bytes
+ */
+uint64_t pytrace_sketch_size(const pytrace_sketch_t *s);
+
+/** Save a sketch
+ *
+ * The state is written in host byte order, so it can only be loaded on a
+ * machine of the same endianness.
+ * @param s		The sketch
+ * @param out		pytrace_sketch_size() bytes to write to
+ */
+void pytrace_sketch_save(const pytrace_sketch_t *s, unsigned char *out);
+
+/** Load a sketch saved by pytrace_sketch_save()
+ * @param data		The saved sketch
+ * @param length	Its size in bytes
+ * @return The loaded sketch, or NULL if the data is not a valid sketch or
+ * allocation failed
+ */
+pytrace_sketch_t *pytrace_sketch_load(const unsigned char *data,
+		uint64_t length);
+
+/*@}*/
+
+/** @name Anonymisation
+ * @{
+ */
+
+/** Prefix-preserving address anonymisation state */
+typedef struct pytrace_anon_t pytrace_anon_t;
+
+/** Counters kept by an anonymiser */
+typedef struct pytrace_anon_stats_t {
+	uint64_t packets;	/**< Packets passed to pytrace_anon_packet() */
+	uint64_t rewritten;	/**< Packets whose addresses were rewritten */
+	uint64_t encryptions;	/**< AES blocks encrypted */
+	uint64_t hits;		/**< Prefixes found in the cache */
+} pytrace_anon_stats_t;
+
+/** Create a CryptoPAn anonymiser
+ *
+ * Addresses sharing a prefix of n bits are mapped to addresses that share
+ * a prefix of n bits, and the same key always gives the same mapping. The
+ * key should be kept secret, as it is enough to undo the mapping.
+ * @param key		32 bytes: the AES key, then the secret for the pad
+ * @return A new anonymiser, or NULL if allocation failed
+ */
+pytrace_anon_t *pytrace_anon_create(const uint8_t *key);
+
+/** Destroy an anonymiser
+ * @param a		The anonymiser to destroy
+ */
+void pytrace_anon_destroy(pytrace_anon_t *a);
+
+/** Check whether an anonymiser uses the CPU's AES instructions
+ * @param a		The anonymiser
+ * @return 1 if it does, 0 if it encrypts in software
+ */
+int pytrace_anon_hardware(const pytrace_anon_t *a);
+
+/** Get the counters of an anonymiser
+ * @param a		The anonymiser
+ * @param stats		Filled with the current counters
+ */
+void pytrace_anon_stats(const pytrace_anon_t *a, pytrace_anon_stats_t *stats);
+
+/** Anonymise a single address
+ * @param a		The anonymiser
+ * @param in		The address in network byte order
+ * @param out		Filled with the anonymised address; may be in
+ * @param ip_version	4 for a 4 byte address, 6 for a 16 byte one
+ */
+void pytrace_anon_address(pytrace_anon_t *a, const uint8_t *in,
+		uint8_t *out, int ip_version);
+
+/** Anonymise the addresses of a packet in place
+ *
+ * The source and destination of the outermost IPv4 or IPv6 header are
+ * rewritten, and the IPv4 header checksum and any TCP, UDP or ICMPv6
+ * checksum are updated to match. Addresses inside tunnels or quoted in
+ * ICMP errors are left alone.
+ * @param a		The anonymiser
+ * @param packet	The packet to rewrite
+ * @return 1 if the packet was rewritten, 0 if it has no IP header
+ */
+int pytrace_anon_packet(pytrace_anon_t *a, libtrace_packet_t *packet);
+
+/** Anonymise every packet of a batch in place
+ * @param a		The anonymiser
+ * @param batch		The batch whose first batch->count packets are
+ * rewritten
+ * @return The number of packets rewritten
+ */
+int pytrace_anon_batch(pytrace_anon_t *a, const pytrace_batch_t *batch);
+
+/** Create a reader that anonymises the packets of another
+ * @param input		The reader to take packets from; it is not owned and
+ * must outlive the new reader
+ * @param anon		The anonymiser to apply; it is not owned either
+ * @return A new reader, or NULL if allocation failed
+ */
+pytrace_reader_t *pytrace_anon_reader_create(pytrace_reader_t *input,
+		pytrace_anon_t *anon);
+
+/*@}*/
+
+/** @name Checksum validation
+ * @{
+ */
+
+/** @name Per-packet results of pytrace_checksum_packet(), as flags
+ * A packet with neither flag of a layer had no such checksum to check.
+ * @{
+ */
+#define PYTRACE_CHECKSUM_L3_GOOD	0x01
+#define PYTRACE_CHECKSUM_L3_BAD		0x02
+#define PYTRACE_CHECKSUM_L4_GOOD	0x04
+#define PYTRACE_CHECKSUM_L4_BAD		0x08
+/** The transport checksum was not checked because the datagram is not
+ * all there: it was cut short by the snap length, is a fragment, or its
+ * lengths do not add up */
+#define PYTRACE_CHECKSUM_TRUNCATED	0x10
+/*@}*/
+
+/** Counters of checksums checked and failed. They are added to, never
+ * reset, so one set can cover a whole trace. ICMPv6 counts as ICMP. */
+typedef struct pytrace_checksum_stats_t {
+	uint64_t packets;
+	uint64_t ip_checked;
+	uint64_t ip_failed;
+	uint64_t tcp_checked;
+	uint64_t tcp_failed;
+	uint64_t udp_checked;
+	uint64_t udp_failed;
+	uint64_t icmp_checked;
+	uint64_t icmp_failed;
+	uint64_t truncated;	/**< Packets flagged PYTRACE_CHECKSUM_TRUNCATED */
+} pytrace_checksum_stats_t;
+
+/** Validate the checksums of a packet
+ *
+ * The IPv4 header checksum and the TCP, UDP, ICMP or ICMPv6 checksum of
+ * the outermost IP header are checked, the same ones as
+ * trace_checksum_layer3() and trace_checksum_transport(). A UDP checksum
+ * of zero over IPv4 means there is none, and is not checked.
+ * @param packet	The packet to check
+ * @param stats		Counters to add the results to
+ * @return A combination of the PYTRACE_CHECKSUM_* flags
+ */
+int pytrace_checksum_packet(libtrace_packet_t *packet,
+		pytrace_checksum_stats_t *stats);
+
+/** Run pytrace_checksum_packet() over every packet of a batch
+ * @param batch		The packets to check
+ * @param status	An array of batch->count results
+ * @param stats		Counters to add the results to
+ * @return The number of packets with a bad checksum
+ */
+int pytrace_checksum_batch(const pytrace_batch_t *batch, uint8_t *status,
+		pytrace_checksum_stats_t *stats);
+
+/*@}*/
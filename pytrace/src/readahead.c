@@ -0,0 +1,173 @@
+/*
+ * Background read-ahead.
+ *
+ * A reader thread fills a ring of batches while the consumer works through
+ * the one it was handed last. Each slot is either free (owned by the
+ * reader) or ready (filled, waiting for or held by the consumer), so the
+ * reader and the consumer never touch the same packets at the same time.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+
+enum slot_state {
+	SLOT_FREE,
+	SLOT_READY
+};
+
+struct pytrace_readahead_t {
+	pytrace_reader_t *reader;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int nslots;
+	pytrace_batch_t **batches;
+	enum slot_state *states;
+	int head;		/* Next slot the reader will fill */
+	int tail;		/* Next slot the consumer will take */
+	int held;		/* Slot held by the consumer, or -1 */
+	int stopping;		/* The reader has been asked to exit */
+	int running;		/* The thread has been started and not joined */
+};
+
+static void *readahead_main(void *arg)
+{
+	pytrace_readahead_t *ra = arg;
+	pytrace_batch_t *batch;
+	int slot;
+
+	for (;;) {
+		pthread_mutex_lock(&ra->lock);
+		slot = ra->head;
+		while (ra->states[slot] != SLOT_FREE && !ra->stopping)
+			pthread_cond_wait(&ra->cond, &ra->lock);
+		if (ra->stopping) {
+			pthread_mutex_unlock(&ra->lock);
+			break;
+		}
+		pthread_mutex_unlock(&ra->lock);
+
+		batch = ra->batches[slot];
+		pytrace_read_batch(ra->reader, batch);
+
+		pthread_mutex_lock(&ra->lock);
+		ra->states[slot] = SLOT_READY;
+		ra->head = (slot + 1) % ra->nslots;
+		pthread_cond_broadcast(&ra->cond);
+		pthread_mutex_unlock(&ra->lock);
+
+		if (batch->count == 0)
+			break;
+	}
+	return NULL;
+}
+
+static void readahead_free(pytrace_readahead_t *ra)
+{
+	int i;
+
+	if (ra->batches) {
+		for (i = 0; i < ra->nslots; i++)
+			pytrace_batch_destroy(ra->batches[i]);
+	}
+	free(ra->batches);
+	free(ra->states);
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->lock);
+	free(ra);
+}
+
+pytrace_readahead_t *pytrace_readahead_start(pytrace_reader_t *reader,
+		int depth, int batch_size)
+{
+	pytrace_readahead_t *ra;
+	int i;
+
+	if (depth <= 0 || batch_size <= 0)
+		return NULL;
+
+	ra = calloc(1, sizeof(*ra));
+	if (!ra)
+		return NULL;
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+	ra->reader = reader;
+	ra->held = -1;
+
+	/* One extra slot for the batch the consumer is holding */
+	ra->nslots = depth + 1;
+	ra->batches = calloc(ra->nslots, sizeof(*ra->batches));
+	ra->states = calloc(ra->nslots, sizeof(*ra->states));
+	if (!ra->batches || !ra->states) {
+		readahead_free(ra);
+		return NULL;
+	}
+	for (i = 0; i < ra->nslots; i++) {
+		ra->batches[i] = pytrace_batch_create(batch_size);
+		if (!ra->batches[i]) {
+			readahead_free(ra);
+			return NULL;
+		}
+		ra->states[i] = SLOT_FREE;
+	}
+
+	if (pthread_create(&ra->thread, NULL, readahead_main, ra) != 0) {
+		readahead_free(ra);
+		return NULL;
+	}
+	ra->running = 1;
+	return ra;
+}
+
+pytrace_batch_t *pytrace_readahead_next(pytrace_readahead_t *ra)
+{
+	pytrace_batch_t *batch;
+	int slot;
+
+	pthread_mutex_lock(&ra->lock);
+	if (ra->held >= 0) {
+		batch = ra->batches[ra->held];
+		if (batch->count == 0) {
+			/* The final batch stays with the consumer */
+			pthread_mutex_unlock(&ra->lock);
+			return batch;
+		}
+		ra->states[ra->held] = SLOT_FREE;
+		ra->held = -1;
+		pthread_cond_broadcast(&ra->cond);
+	}
+
+	slot = ra->tail;
+	while (ra->states[slot] != SLOT_READY)
+		pthread_cond_wait(&ra->cond, &ra->lock);
+	ra->tail = (slot + 1) % ra->nslots;
+	ra->held = slot;
+	pthread_mutex_unlock(&ra->lock);
+
+	return ra->batches[slot];
+}
+
+void pytrace_readahead_stop(pytrace_readahead_t *ra)
+{
+	if (!ra->running)
+		return;
+
+	pthread_mutex_lock(&ra->lock);
+	ra->stopping = 1;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+
+	pthread_join(ra->thread, NULL);
+	ra->running = 0;
+}
+
+void pytrace_readahead_destroy(pytrace_readahead_t *ra)
+{
+	if (!ra)
+		return;
+	pytrace_readahead_stop(ra);
+	readahead_free(ra);
+}
@@ -0,0 +1,116 @@
+/*
+ * Generic packet readers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+
+static int trace_reader_read(pytrace_reader_t *reader,
+		libtrace_packet_t *packet)
+{
+	return trace_read_packet(reader->trace, packet);
+}
+
+static void trace_reader_destroy(pytrace_reader_t *reader)
+{
+	free(reader);
+}
+
+pytrace_reader_t *pytrace_reader_from_trace(libtrace_t *trace)
+{
+	pytrace_reader_t *reader;
+
+	reader = calloc(1, sizeof(*reader));
+	if (!reader)
+		return NULL;
+	reader->read = trace_reader_read;
+	reader->destroy = trace_reader_destroy;
+	reader->trace = trace;
+	return reader;
+}
+
+/* Run a packet that was read past the filter and sampler. Returns 1 to
+ * keep it, 0 to skip it or -1 on error. */
+static int reader_accept(pytrace_reader_t *reader, libtrace_packet_t *packet)
+{
+	int match;
+
+	if (reader->filter) {
+		match = pytrace_filter_apply(reader->filter, packet);
+		if (match < 0) {
+			snprintf(reader->error, sizeof(reader->error),
+					"Could not apply packet filter");
+			return -1;
+		}
+		if (match == 0)
+			return 0;
+	}
+	if (reader->sampler && !pytrace_sampler_apply(reader->sampler, packet))
+		return 0;
+	return 1;
+}
+
+int pytrace_reader_read(pytrace_reader_t *reader, libtrace_packet_t *packet)
+{
+	int ret, accept;
+
+	for (;;) {
+		ret = reader->read(reader, packet);
+		if (ret <= 0)
+			return ret;
+		accept = reader_accept(reader, packet);
+		if (accept != 0)
+			return accept < 0 ? -1 : ret;
+	}
+}
+
+int pytrace_reader_event(pytrace_reader_t *reader, libtrace_packet_t *packet,
+		libtrace_eventobj_t *event)
+{
+	int accept;
+
+	memset(event, 0, sizeof(*event));
+
+	/* Only a plain libtrace input can say what it waits for; anything
+	 * else is read directly, which blocks if it wraps a live input */
+	if (reader->read != trace_reader_read) {
+		event->size = pytrace_reader_read(reader, packet);
+		event->type = event->size > 0 ? TRACE_EVENT_PACKET :
+			TRACE_EVENT_TERMINATE;
+		return event->type;
+	}
+
+	for (;;) {
+		*event = trace_event(reader->trace, packet);
+		if (event->type == TRACE_EVENT_TERMINATE) {
+			event->size = trace_is_err(reader->trace) ? -1 : 0;
+			return event->type;
+		}
+		if (event->type != TRACE_EVENT_PACKET)
+			return event->type;
+		if (event->size <= 0) {
+			event->type = TRACE_EVENT_TERMINATE;
+			event->size = event->size < 0 ? -1 : 0;
+			return event->type;
+		}
+
+		accept = reader_accept(reader, packet);
+		if (accept < 0) {
+			event->type = TRACE_EVENT_TERMINATE;
+			event->size = -1;
+			return event->type;
+		}
+		if (accept)
+			return event->type;
+	}
+}
+
+void pytrace_reader_destroy(pytrace_reader_t *reader)
+{
+	if (reader)
+		reader->destroy(reader);
+}
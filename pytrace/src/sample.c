@@ -0,0 +1,42 @@
+/*
+ * Packet and flow sampling inside the native read loop.
+ */
+
+#include <libtrace.h>
+#include "pytrace.h"
+#include "decode.h"
+
+void pytrace_sampler_init(pytrace_sampler_t *sampler, int mode,
+		uint32_t rate, uint64_t seed)
+{
+	sampler->mode = mode;
+	sampler->rate = rate > 1 ? rate : 1;
+	sampler->seed = seed;
+	sampler->phase = seed % sampler->rate;
+	sampler->seen = 0;
+	sampler->kept = 0;
+}
+
+int pytrace_sampler_apply(pytrace_sampler_t *sampler,
+		const libtrace_packet_t *packet)
+{
+	struct flow_key key;
+	int keep;
+
+	sampler->seen++;
+	if (sampler->rate == 1) {
+		keep = 1;
+	} else if (sampler->mode == PYTRACE_SAMPLE_FLOWS) {
+		keep = decode_flow_key(packet, &key) &&
+			flow_key_symmetric_hash(&key, sampler->seed) %
+				sampler->rate == 0;
+	} else if (sampler->phase) {
+		sampler->phase--;
+		keep = 0;
+	} else {
+		sampler->phase = sampler->rate - 1;
+		keep = 1;
+	}
+	sampler->kept += keep;
+	return keep;
+}
@@ -0,0 +1,800 @@
+/*
+ * Fixed-memory sketches: Count-Min, HyperLogLog and SpaceSaving top-k.
+ *
+ * Every sketch is keyed on some of the fields of the packet's 5-tuple,
+ * with addresses optionally cut down to a prefix, and hashes that key
+ * with flow_key_hash(). Sketches built with the same configuration can
+ * be merged, and are saved as a header followed by their raw state.
+ *
+ * The top-k sketch is SpaceSaving: it tracks at most k keys, and a key
+ * that is not tracked replaces the one with the smallest count, taking
+ * over that count as its error. A min-heap on the counts finds that key.
+ * Each entry can carry a small HyperLogLog estimating the distinct values
+ * of other fields for that key (e.g. destinations per source).
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+#include "decode.h"
+
+#define SKETCH_MAGIC		"PYTRSKT1"
+
+/* Seed tweak for the hash of the distinct fields of a top-k entry */
+#define DISTINCT_SEED		0x5851f42d4c957f2dULL
+
+/** Header of a saved sketch, followed by its state */
+struct sketch_header {
+	char magic[8];
+	pytrace_sketch_config_t config;
+	uint64_t count;		/* Entries of a top-k sketch */
+	uint64_t total;		/* Weight of everything counted */
+};
+
+struct topk_entry {
+	struct flow_key key;
+	uint64_t hash;
+	uint64_t count;
+	uint64_t error;
+	int32_t next;		/* Hash chain, or -1 */
+	uint32_t pos;		/* Position in the heap */
+};
+
+struct pytrace_sketch_t {
+	pytrace_sketch_config_t config;
+	uint64_t total;
+
+	/* Count-Min: depth rows of width counters */
+	uint64_t *counters;
+
+	/* HyperLogLog registers; for top-k, one set per entry */
+	uint8_t *registers;
+	uint32_t nregisters;
+
+	/* Top-k */
+	struct topk_entry *entries;
+	uint32_t nentries;
+	uint32_t *heap;		/* Entry indexes, smallest count first */
+	int32_t *buckets;
+	uint32_t nbuckets;	/* Always a power of two */
+};
+
+/* Cut the fields of a 5-tuple down to those in fields */
+static void sketch_key(const pytrace_sketch_config_t *config, uint32_t fields,
+		const struct flow_key *in, struct flow_key *out)
+{
+	uint32_t bits = in->ip_version == 4 ? config->prefix4 : config->prefix6;
+	uint32_t len = in->ip_version == 4 ? 4 : 16;
+	uint32_t i;
+
+	memset(out, 0, sizeof(*out));
+	if (fields & (PYTRACE_SKETCH_SRC | PYTRACE_SKETCH_DST)) {
+		out->ip_version = in->ip_version;
+		for (i = 0; i < len && bits; i++) {
+			uint8_t mask = bits >= 8 ? 0xff : 0xff << (8 - bits);
+
+			if (fields & PYTRACE_SKETCH_SRC)
+				out->src[i] = in->src[i] & mask;
+			if (fields & PYTRACE_SKETCH_DST)
+				out->dst[i] = in->dst[i] & mask;
+			bits -= bits >= 8 ? 8 : bits;
+		}
+	}
+	if (fields & PYTRACE_SKETCH_SRC_PORT)
+		out->src_port = in->src_port;
+	if (fields & PYTRACE_SKETCH_DST_PORT)
+		out->dst_port = in->dst_port;
+	if (fields & PYTRACE_SKETCH_PROTO)
+		out->proto = in->proto;
+}
+
+static void key_from_public(const pytrace_sketch_key_t *in,
+		struct flow_key *out)
+{
+	memset(out, 0, sizeof(*out));
+	memcpy(out->src, in->src, sizeof(out->src));
+	memcpy(out->dst, in->dst, sizeof(out->dst));
+	out->src_port = in->src_port;
+	out->dst_port = in->dst_port;
+	out->proto = in->proto;
+	out->ip_version = in->ip_version;
+}
+
+static void key_to_public(const struct flow_key *in,
+		pytrace_sketch_key_t *out)
+{
+	memset(out, 0, sizeof(*out));
+	memcpy(out->src, in->src, sizeof(out->src));
+	memcpy(out->dst, in->dst, sizeof(out->dst));
+	out->src_port = in->src_port;
+	out->dst_port = in->dst_port;
+	out->proto = in->proto;
+	out->ip_version = in->ip_version;
+}
+
+static int config_valid(const pytrace_sketch_config_t *c)
+{
+	if (!c->key || c->prefix4 > 32 || c->prefix6 > 128)
+		return 0;
+	switch (c->kind) {
+	case PYTRACE_SKETCH_COUNT_MIN:
+		return c->width > 0 && c->depth > 0 &&
+			(uint64_t)c->width * c->depth <= (1ULL << 32);
+	case PYTRACE_SKETCH_HLL:
+		return c->precision >= 4 && c->precision <= 18;
+	case PYTRACE_SKETCH_TOP_K:
+		return c->width > 0 && c->width <= (1U << 24) &&
+			(!c->distinct ||
+			 (c->precision >= 4 && c->precision <= 12));
+	}
+	return 0;
+}
+
+static uint64_t registers_size(const pytrace_sketch_t *s)
+{
+	switch (s->config.kind) {
+	case PYTRACE_SKETCH_HLL:
+		return s->nregisters;
+	case PYTRACE_SKETCH_TOP_K:
+		return (uint64_t)s->nregisters * s->config.width;
+	}
+	return 0;
+}
+
+pytrace_sketch_t *pytrace_sketch_create(const pytrace_sketch_config_t *config)
+{
+	pytrace_sketch_t *s;
+
+	if (!config_valid(config))
+		return NULL;
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->config = *config;
+	s->config.pad = 0;
+	if (config->kind != PYTRACE_SKETCH_TOP_K || config->distinct)
+		s->nregisters = 1U << config->precision;
+
+	switch (config->kind) {
+	case PYTRACE_SKETCH_COUNT_MIN:
+		s->counters = calloc((uint64_t)config->width * config->depth,
+				sizeof(*s->counters));
+		if (!s->counters)
+			goto fail;
+		break;
+	case PYTRACE_SKETCH_HLL:
+		s->registers = calloc(1, registers_size(s));
+		if (!s->registers)
+			goto fail;
+		break;
+	case PYTRACE_SKETCH_TOP_K:
+		s->nbuckets = 16;
+		while (s->nbuckets < config->width * 2)
+			s->nbuckets *= 2;
+		s->entries = calloc(config->width, sizeof(*s->entries));
+		s->heap = calloc(config->width, sizeof(*s->heap));
+		s->buckets = malloc(s->nbuckets * sizeof(*s->buckets));
+		if (!s->entries || !s->heap || !s->buckets)
+			goto fail;
+		memset(s->buckets, 0xff, s->nbuckets * sizeof(*s->buckets));
+		if (config->distinct &&
+				!(s->registers = calloc(1, registers_size(s))))
+			goto fail;
+		break;
+	}
+	return s;
+
+fail:
+	pytrace_sketch_destroy(s);
+	return NULL;
+}
+
+void pytrace_sketch_destroy(pytrace_sketch_t *s)
+{
+	if (!s)
+		return;
+	free(s->counters);
+	free(s->registers);
+	free(s->entries);
+	free(s->heap);
+	free(s->buckets);
+	free(s);
+}
+
+const pytrace_sketch_config_t *pytrace_sketch_config(
+		const pytrace_sketch_t *s)
+{
+	return &s->config;
+}
+
+uint64_t pytrace_sketch_total(const pytrace_sketch_t *s)
+{
+	return s->total;
+}
+
+/* HyperLogLog */
+
+static void hll_add(uint8_t *registers, uint32_t precision, uint64_t hash)
+{
+	uint32_t index = hash >> (64 - precision);
+	uint64_t rest = (hash << precision) | (1ULL << (precision - 1));
+	uint8_t rank = __builtin_clzll(rest) + 1;
+
+	if (registers[index] < rank)
+		registers[index] = rank;
+}
+
+static double hll_estimate(const uint8_t *registers, uint32_t precision)
+{
+	uint32_t m = 1U << precision;
+	uint32_t i, zeros = 0;
+	double sum = 0, alpha, estimate;
+
+	for (i = 0; i < m; i++) {
+		sum += 1.0 / (double)(1ULL << registers[i]);
+		zeros += registers[i] == 0;
+	}
+	switch (m) {
+	case 16:
+		alpha = 0.673;
+		break;
+	case 32:
+		alpha = 0.697;
+		break;
+	case 64:
+		alpha = 0.709;
+		break;
+	default:
+		alpha = 0.7213 / (1 + 1.079 / m);
+	}
+	estimate = alpha * m * m / sum;
+
+	/* Linear counting is more accurate while registers are still empty */
+	if (estimate <= 2.5 * m && zeros)
+		estimate = m * log((double)m / zeros);
+	return estimate;
+}
+
+static void hll_merge(uint8_t *dst, const uint8_t *src, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		if (dst[i] < src[i])
+			dst[i] = src[i];
+	}
+}
+
+/* Top-k: SpaceSaving */
+
+static void heap_swap(pytrace_sketch_t *s, uint32_t a, uint32_t b)
+{
+	uint32_t t = s->heap[a];
+
+	s->heap[a] = s->heap[b];
+	s->heap[b] = t;
+	s->entries[s->heap[a]].pos = a;
+	s->entries[s->heap[b]].pos = b;
+}
+
+static uint64_t heap_count(const pytrace_sketch_t *s, uint32_t pos)
+{
+	return s->entries[s->heap[pos]].count;
+}
+
+static void heap_down(pytrace_sketch_t *s, uint32_t pos)
+{
+	uint32_t n = s->nentries, child;
+
+	while ((child = pos * 2 + 1) < n) {
+		if (child + 1 < n &&
+				heap_count(s, child + 1) < heap_count(s, child))
+			child++;
+		if (heap_count(s, pos) <= heap_count(s, child))
+			break;
+		heap_swap(s, pos, child);
+		pos = child;
+	}
+}
+
+static void heap_up(pytrace_sketch_t *s, uint32_t pos)
+{
+	while (pos > 0 && heap_count(s, pos) < heap_count(s, (pos - 1) / 2)) {
+		heap_swap(s, pos, (pos - 1) / 2);
+		pos = (pos - 1) / 2;
+	}
+}
+
+static struct topk_entry *topk_find(const pytrace_sketch_t *s,
+		const struct flow_key *key, uint64_t hash)
+{
+	int32_t i;
+
+	for (i = s->buckets[hash & (s->nbuckets - 1)]; i >= 0;
+			i = s->entries[i].next) {
+		struct topk_entry *e = &s->entries[i];
+
+		if (e->hash == hash && memcmp(&e->key, key, sizeof(*key)) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static void topk_link(pytrace_sketch_t *s, uint32_t index)
+{
+	struct topk_entry *e = &s->entries[index];
+	int32_t *bucket = &s->buckets[e->hash & (s->nbuckets - 1)];
+
+	e->next = *bucket;
+	*bucket = index;
+}
+
+static void topk_unlink(pytrace_sketch_t *s, uint32_t index)
+{
+	struct topk_entry *e = &s->entries[index];
+	int32_t *p = &s->buckets[e->hash & (s->nbuckets - 1)];
+
+	while (*p != (int32_t)index)
+		p = &s->entries[*p].next;
+	*p = e->next;
+}
+
+static uint8_t *topk_registers(const pytrace_sketch_t *s, uint32_t index)
+{
+	return s->registers + (uint64_t)index * s->nregisters;
+}
+
+/* Find the entry for a key, taking over the smallest one if the key is
+ * not tracked yet */
+static uint32_t topk_slot(pytrace_sketch_t *s, const struct flow_key *key,
+		uint64_t hash)
+{
+	struct topk_entry *e = topk_find(s, key, hash);
+	uint32_t index;
+
+	if (e)
+		return e - s->entries;
+
+	if (s->nentries < s->config.width) {
+		index = s->nentries++;
+		e = &s->entries[index];
+		e->pos = index;
+		s->heap[index] = index;
+	} else {
+		index = s->heap[0];
+		e = &s->entries[index];
+		topk_unlink(s, index);
+		e->error = e->count;
+		if (s->registers)
+			memset(topk_registers(s, index), 0, s->nregisters);
+	}
+	e->key = *key;
+	e->hash = hash;
+	topk_link(s, index);
+	return index;
+}
+
+static void topk_add(pytrace_sketch_t *s, const struct flow_key *key,
+		uint64_t hash, uint64_t weight, const struct flow_key *full)
+{
+	uint32_t index = topk_slot(s, key, hash);
+	struct topk_entry *e = &s->entries[index];
+	struct flow_key distinct;
+
+	/* A new entry at the end of the heap may need to move up; a larger
+	 * count otherwise only ever moves an entry down */
+	e->count += weight;
+	heap_up(s, e->pos);
+	heap_down(s, e->pos);
+
+	if (s->registers) {
+		sketch_key(&s->config, s->config.distinct, full, &distinct);
+		hll_add(topk_registers(s, index), s->config.precision,
+				flow_key_hash(&distinct,
+					s->config.seed ^ DISTINCT_SEED));
+	}
+}
+
+static void sketch_add(pytrace_sketch_t *s, const struct flow_key *full,
+		uint64_t length)
+{
+	uint64_t weight = s->config.weight == PYTRACE_SKETCH_BYTES ?
+		length : 1;
+	struct flow_key key;
+	uint64_t hash;
+	uint32_t i;
+
+	sketch_key(&s->config, s->config.key, full, &key);
+	hash = flow_key_hash(&key, s->config.seed);
+	s->total += weight;
+
+	switch (s->config.kind) {
+	case PYTRACE_SKETCH_COUNT_MIN:
+		for (i = 0; i < s->config.depth; i++) {
+			uint32_t col = ((hash & 0xffffffff) + i * (hash >> 32)) %
+				s->config.width;
+
+			s->counters[(uint64_t)i * s->config.width + col] +=
+				weight;
+		}
+		break;
+	case PYTRACE_SKETCH_HLL:
+		hll_add(s->registers, s->config.precision, hash);
+		break;
+	case PYTRACE_SKETCH_TOP_K:
+		topk_add(s, &key, hash, weight, full);
+		break;
+	}
+}
+
+int pytrace_sketch_update(pytrace_sketch_t **sketches, int nsketches,
+		const pytrace_batch_t *batch)
+{
+	struct flow_key key;
+	uint64_t length;
+	int i, j, n = 0;
+
+	for (i = 0; i < batch->count; i++) {
+		libtrace_packet_t *packet = batch->packets[i];
+
+		if (!decode_flow_key(packet, &key))
+			continue;
+		length = trace_get_wire_length(packet);
+		for (j = 0; j < nsketches; j++)
+			sketch_add(sketches[j], &key, length);
+		n++;
+	}
+	return n;
+}
+
+uint64_t pytrace_sketch_query(const pytrace_sketch_t *s,
+		const pytrace_sketch_key_t *key)
+{
+	struct flow_key full, k;
+	const struct topk_entry *e;
+	uint64_t hash, best = UINT64_MAX;
+	uint32_t i;
+
+	key_from_public(key, &full);
+	sketch_key(&s->config, s->config.key, &full, &k);
+	hash = flow_key_hash(&k, s->config.seed);
+
+	switch (s->config.kind) {
+	case PYTRACE_SKETCH_COUNT_MIN:
+		for (i = 0; i < s->config.depth; i++) {
+			uint32_t col = ((hash & 0xffffffff) + i * (hash >> 32)) %
+				s->config.width;
+			uint64_t c = s->counters[(uint64_t)i * s->config.width +
+				col];
+
+			if (c < best)
+				best = c;
+		}
+		return best;
+	case PYTRACE_SKETCH_TOP_K:
+		e = topk_find(s, &k, hash);
+		return e ? e->count : 0;
+	}
+	return 0;
+}
+
+double pytrace_sketch_distinct(const pytrace_sketch_t *s)
+{
+	if (s->config.kind != PYTRACE_SKETCH_HLL)
+		return 0;
+	return hll_estimate(s->registers, s->config.precision);
+}
+
+static int entry_compare(const void *a, const void *b)
+{
+	const pytrace_sketch_entry_t *x = a, *y = b;
+
+	if (x->count != y->count)
+		return x->count < y->count ? 1 : -1;
+	return memcmp(&x->key, &y->key, sizeof(x->key));
+}
+
+int pytrace_sketch_top(const pytrace_sketch_t *s, pytrace_sketch_entry_t *out)
+{
+	uint32_t i;
+
+	if (s->config.kind != PYTRACE_SKETCH_TOP_K)
+		return 0;
+	for (i = 0; i < s->nentries; i++) {
+		const struct topk_entry *e = &s->entries[i];
+
+		key_to_public(&e->key, &out[i].key);
+		out[i].count = e->count;
+		out[i].error = e->error;
+		out[i].distinct = s->registers ?
+			hll_estimate(topk_registers(s, i), s->config.precision) :
+			0;
+	}
+	qsort(out, s->nentries, sizeof(*out), entry_compare);
+	return s->nentries;
+}
+
+/* Reset a top-k sketch and fill it from entries (and their registers, if
+ * any), which must not hold more than width entries */
+static void topk_fill(pytrace_sketch_t *s, const struct topk_entry *entries,
+		const uint8_t *registers, uint32_t n)
+{
+	uint32_t i;
+
+	memset(s->buckets, 0xff, s->nbuckets * sizeof(*s->buckets));
+	s->nentries = n;
+	for (i = 0; i < n; i++) {
+		s->entries[i] = entries[i];
+		s->entries[i].pos = i;
+		s->heap[i] = i;
+		topk_link(s, i);
+		if (s->registers)
+			memcpy(topk_registers(s, i),
+					registers + (uint64_t)i * s->nregisters,
+					s->nregisters);
+	}
+	for (i = n / 2; i-- > 0; )
+		heap_down(s, i);
+}
+
+struct merge_item {
+	struct topk_entry entry;
+	uint32_t from;		/* Index into the merged registers */
+};
+
+static int merge_compare(const void *a, const void *b)
+{
+	const struct merge_item *x = a, *y = b;
+
+	if (x->entry.count != y->entry.count)
+		return x->entry.count < y->entry.count ? 1 : -1;
+	return memcmp(&x->entry.key, &y->entry.key, sizeof(x->entry.key));
+}
+
+/* The count a full sketch implies for any key it does not track */
+static uint64_t topk_floor(const pytrace_sketch_t *s)
+{
+	return s->nentries == s->config.width ? heap_count(s, 0) : 0;
+}
+
+/* Mergeable SpaceSaving: a key missing from one side may have had up to
+ * that side's smallest count, so that is added to both its count and its
+ * error; the largest k of the union are kept. */
+static int topk_merge(pytrace_sketch_t *dst, const pytrace_sketch_t *src)
+{
+	uint32_t n = dst->nentries + src->nentries, count = 0, i, k;
+	uint64_t dst_floor = topk_floor(dst), src_floor = topk_floor(src);
+	struct topk_entry *entries = NULL;
+	struct merge_item *items;
+	uint8_t *registers = NULL;
+	const struct topk_entry *e;
+	int ret = -2;
+
+	items = calloc(n ? n : 1, sizeof(*items));
+	if (!items)
+		return -2;
+	if (dst->registers &&
+			!(registers = malloc((uint64_t)n * dst->nregisters)))
+		goto out;
+
+	for (i = 0; i < dst->nentries; i++) {
+		struct merge_item *m = &items[count];
+
+		m->entry = dst->entries[i];
+		m->from = count;
+		e = topk_find(src, &m->entry.key, m->entry.hash);
+		if (e) {
+			m->entry.count += e->count;
+			m->entry.error += e->error;
+		} else {
+			m->entry.count += src_floor;
+			m->entry.error += src_floor;
+		}
+		if (registers) {
+			memcpy(registers + (uint64_t)count * dst->nregisters,
+					topk_registers(dst, i), dst->nregisters);
+			if (e)
+				hll_merge(registers +
+						(uint64_t)count *
+						dst->nregisters,
+						topk_registers(src,
+							e - src->entries),
+						dst->nregisters);
+		}
+		count++;
+	}
+	for (i = 0; i < src->nentries; i++) {
+		struct merge_item *m = &items[count];
+
+		e = &src->entries[i];
+		if (topk_find(dst, &e->key, e->hash))
+			continue;
+		m->entry = *e;
+		m->entry.count += dst_floor;
+		m->entry.error += dst_floor;
+		m->from = count;
+		if (registers)
+			memcpy(registers + (uint64_t)count * dst->nregisters,
+					topk_registers(src, i), dst->nregisters);
+		count++;
+	}
+
+	qsort(items, count, sizeof(*items), merge_compare);
+	k = count < dst->config.width ? count : dst->config.width;
+	entries = malloc((k ? k : 1) * sizeof(*entries));
+	if (!entries)
+		goto out;
+	if (registers) {
+		/* Reorder the registers to match the kept entries */
+		uint8_t *kept = malloc((uint64_t)(k ? k : 1) *
+				dst->nregisters);
+
+		if (!kept)
+			goto out;
+		for (i = 0; i < k; i++)
+			memcpy(kept + (uint64_t)i * dst->nregisters,
+					registers + (uint64_t)items[i].from *
+					dst->nregisters, dst->nregisters);
+		free(registers);
+		registers = kept;
+	}
+	for (i = 0; i < k; i++)
+		entries[i] = items[i].entry;
+	topk_fill(dst, entries, registers, k);
+	ret = 0;
+
+out:
+	free(entries);
+	free(registers);
+	free(items);
+	return ret;
+}
+
+int pytrace_sketch_merge(pytrace_sketch_t *dst, const pytrace_sketch_t *src)
+{
+	uint64_t i, n;
+
+	if (memcmp(&dst->config, &src->config, sizeof(dst->config)) != 0)
+		return -1;
+
+	switch (dst->config.kind) {
+	case PYTRACE_SKETCH_COUNT_MIN:
+		n = (uint64_t)dst->config.width * dst->config.depth;
+		for (i = 0; i < n; i++)
+			dst->counters[i] += src->counters[i];
+		break;
+	case PYTRACE_SKETCH_HLL:
+		hll_merge(dst->registers, src->registers, dst->nregisters);
+		break;
+	case PYTRACE_SKETCH_TOP_K:
+		if (topk_merge(dst, src) < 0)
+			return -2;
+		break;
+	}
+	dst->total += src->total;
+	return 0;
+}
+
+/* A saved top-k entry */
+struct saved_entry {
+	struct flow_key key;
+	uint64_t count;
+	uint64_t error;
+};
+
+uint64_t pytrace_sketch_size(const pytrace_sketch_t *s)
+{
+	uint64_t size = sizeof(struct sketch_header);
+
+	switch (s->config.kind) {
+	case PYTRACE_SKETCH_COUNT_MIN:
+		return size + (uint64_t)s->config.width * s->config.depth *
+			sizeof(*s->counters);
+	case PYTRACE_SKETCH_HLL:
+		return size + s->nregisters;
+	case PYTRACE_SKETCH_TOP_K:
+		return size + s->nentries * (sizeof(struct saved_entry) +
+				(uint64_t)s->nregisters);
+	}
+	return size;
+}
+
+void pytrace_sketch_save(const pytrace_sketch_t *s, unsigned char *out)
+{
+	struct sketch_header hdr;
+	struct saved_entry saved;
+	uint64_t size;
+	uint32_t i;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SKETCH_MAGIC, sizeof(hdr.magic));
+	hdr.config = s->config;
+	hdr.count = s->nentries;
+	hdr.total = s->total;
+	memcpy(out, &hdr, sizeof(hdr));
+	out += sizeof(hdr);
+
+	switch (s->config.kind) {
+	case PYTRACE_SKETCH_COUNT_MIN:
+		size = (uint64_t)s->config.width * s->config.depth *
+			sizeof(*s->counters);
+		memcpy(out, s->counters, size);
+		break;
+	case PYTRACE_SKETCH_HLL:
+		memcpy(out, s->registers, s->nregisters);
+		break;
+	case PYTRACE_SKETCH_TOP_K:
+		for (i = 0; i < s->nentries; i++) {
+			saved.key = s->entries[i].key;
+			saved.count = s->entries[i].count;
+			saved.error = s->entries[i].error;
+			memcpy(out, &saved, sizeof(saved));
+			out += sizeof(saved);
+		}
+		if (s->registers)
+			memcpy(out, s->registers,
+					(uint64_t)s->nentries * s->nregisters);
+		break;
+	}
+}
+
+pytrace_sketch_t *pytrace_sketch_load(const unsigned char *data,
+		uint64_t length)
+{
+	struct sketch_header hdr;
+	struct saved_entry saved;
+	struct topk_entry *entries;
+	pytrace_sketch_t *s;
+	uint32_t i;
+
+	if (length < sizeof(hdr))
+		return NULL;
+	memcpy(&hdr, data, sizeof(hdr));
+	if (memcmp(hdr.magic, SKETCH_MAGIC, sizeof(hdr.magic)) != 0)
+		return NULL;
+	s = pytrace_sketch_create(&hdr.config);
+	if (!s)
+		return NULL;
+	if (hdr.config.kind == PYTRACE_SKETCH_TOP_K) {
+		if (hdr.count > hdr.config.width)
+			goto fail;
+		s->nentries = hdr.count;
+	}
+	if (length != pytrace_sketch_size(s))
+		goto fail;
+	s->total = hdr.total;
+	data += sizeof(hdr);
+
+	switch (s->config.kind) {
+	case PYTRACE_SKETCH_COUNT_MIN:
+		memcpy(s->counters, data, length - sizeof(hdr));
+		break;
+	case PYTRACE_SKETCH_HLL:
+		memcpy(s->registers, data, s->nregisters);
+		break;
+	case PYTRACE_SKETCH_TOP_K:
+		entries = calloc(hdr.count ? hdr.count : 1, sizeof(*entries));
+		if (!entries)
+			goto fail;
+		for (i = 0; i < hdr.count; i++) {
+			memcpy(&saved, data, sizeof(saved));
+			data += sizeof(saved);
+			entries[i].key = saved.key;
+			entries[i].hash = flow_key_hash(&saved.key,
+					s->config.seed);
+			entries[i].count = saved.count;
+			entries[i].error = saved.error;
+		}
+		topk_fill(s, entries, data, hdr.count);
+		free(entries);
+		break;
+	}
+	return s;
+
+fail:
+	pytrace_sketch_destroy(s);
+	return NULL;
+}
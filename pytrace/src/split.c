@@ -0,0 +1,145 @@
+/*
+ * Splitting pcap files into independently readable byte ranges.
+ *
+ * pcap records carry no sync marker, so a cut at an arbitrary offset has
+ * to be moved forward to something that looks like a record header. A
+ * single header is easy to fake with payload bytes, so a candidate is
+ * only accepted if a whole run of headers chains from it, each one
+ * plausible on its own and close in time to the one before.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+#include "pcap.h"
+
+/* Number of consecutive headers that must parse from a candidate */
+#define RESYNC_RECORDS		8
+/* Largest gap in seconds allowed between neighbouring records */
+#define RESYNC_MAX_GAP		3600
+/* Largest wire length believed; covers jumbo frames and TSO segments */
+#define RESYNC_MAX_WIRELEN	262144
+/* How far past a cut to look for a boundary before giving up */
+#define RESYNC_SCAN_LIMIT	(4 * LIBTRACE_PACKET_BUFSIZE)
+
+static int chain_ok(const unsigned char *map, uint64_t size, uint64_t pos,
+		const struct pcap_format *fmt)
+{
+	struct pcap_record_header raw, rec;
+	uint32_t prev_sec = 0;
+	int n;
+
+	for (n = 0; n < RESYNC_RECORDS; n++) {
+		if (pos == size)
+			return n > 0;
+		if (size - pos < sizeof(raw))
+			return 0;
+
+		memcpy(&raw, map + pos, sizeof(raw));
+		pcap_normalise_record(fmt, &raw, &rec);
+		if (!pcap_record_plausible(fmt, &rec))
+			return 0;
+		/* Real records are never empty, but runs of zero bytes in a
+		 * payload would otherwise chain as if they were */
+		if (rec.caplen == 0 || rec.wirelen > RESYNC_MAX_WIRELEN)
+			return 0;
+		if (n > 0) {
+			uint32_t gap = rec.ts_sec > prev_sec ?
+				rec.ts_sec - prev_sec : prev_sec - rec.ts_sec;
+			if (gap > RESYNC_MAX_GAP)
+				return 0;
+		}
+		prev_sec = rec.ts_sec;
+
+		pos += sizeof(raw);
+		if (size - pos < rec.caplen)
+			return 0;
+		pos += rec.caplen;
+	}
+	return 1;
+}
+
+static uint64_t resync(const unsigned char *map, uint64_t size,
+		uint64_t from, const struct pcap_format *fmt)
+{
+	uint64_t limit = from + RESYNC_SCAN_LIMIT;
+	uint64_t pos;
+
+	if (limit > size)
+		limit = size;
+	for (pos = from; pos < limit; pos++) {
+		if (chain_ok(map, size, pos, fmt))
+			return pos;
+	}
+	return size;
+}
+
+int pytrace_pcap_split(const char *path, int parts, uint64_t *offsets,
+		char *error)
+{
+	struct pcap_file_header hdr;
+	struct pcap_format fmt;
+	struct stat st;
+	unsigned char *map;
+	uint64_t size, first, cut;
+	int fd, i;
+
+	if (parts <= 0) {
+		snprintf(error, 256, "parts must be positive");
+		return -1;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		snprintf(error, 256, "%s: %s", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		snprintf(error, 256, "%s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	size = st.st_size;
+	if (size < sizeof(hdr)) {
+		snprintf(error, 256, "%s: not an uncompressed pcap file", path);
+		close(fd);
+		return -1;
+	}
+
+	/* Only the pages around each cut are ever touched */
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		snprintf(error, 256, "%s: mmap: %s", path, strerror(errno));
+		return -1;
+	}
+
+	memcpy(&hdr, map, sizeof(hdr));
+	if (pcap_parse_file_header(&hdr, &fmt) < 0) {
+		snprintf(error, 256, "%s: not an uncompressed pcap file", path);
+		munmap(map, size);
+		return -1;
+	}
+
+	first = sizeof(hdr);
+	offsets[0] = first;
+	for (i = 1; i < parts; i++) {
+		cut = first + (size - first) * i / parts;
+		if (cut < offsets[i - 1])
+			cut = offsets[i - 1];
+		offsets[i] = resync(map, size, cut, &fmt);
+	}
+	offsets[parts] = size;
+
+	munmap(map, size);
+	return 0;
+}
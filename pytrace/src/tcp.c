@@ -0,0 +1,527 @@
+/*
+ * TCP stream reassembly.
+ *
+ * Each direction of a connection is a separate stream. In-order segments
+ * are copied straight to the output; segments that arrive early are kept
+ * on a per-stream list sorted by sequence number until the hole in front
+ * of them is filled. If that list grows past the per-stream or global
+ * memory cap, the reassembler stops waiting: it records a gap and carries
+ * on from the earliest buffered segment.
+ *
+ * Output is a flat array of chunks pointing into a single data buffer, so
+ * Python can pick up a whole batch of reassembled data at once.
+ * Consecutive in-order data for a stream is merged into one chunk.
+ */
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+#include "decode.h"
+
+struct segment {
+	struct segment *next;
+	uint32_t seq;
+	uint32_t len;		/* Length on the wire */
+	uint32_t caplen;	/* Bytes of it that were captured */
+	uint64_t ts;
+	unsigned char data[];
+};
+
+struct stream {
+	struct stream *hnext;	/* Hash chain */
+	struct stream *prev;	/* Activity list, oldest first */
+	struct stream *next;
+	struct flow_key key;
+	uint64_t hash;
+	uint64_t id;
+	uint64_t last;		/* Timestamp of the latest segment */
+	uint32_t next_seq;	/* Sequence number of the next byte wanted */
+	uint32_t fin_seq;	/* Sequence number after the FIN's data */
+	int fin_seen;
+	int gap_pending;	/* The next chunk must carry PYTRACE_TCP_GAP */
+	struct segment *ooo;	/* Out-of-order segments, sorted by seq */
+	uint64_t ooo_bytes;
+};
+
+struct pytrace_tcp_t {
+	struct stream **table;
+	uint32_t nbuckets;	/* Always a power of two */
+	uint64_t nstreams;
+	struct stream *oldest;
+	struct stream *newest;
+	uint64_t next_id;
+
+	uint64_t stream_cap;
+	uint64_t total_cap;
+	uint64_t ooo_bytes;
+	uint64_t idle_timeout;
+	uint64_t now;
+
+	pytrace_tcp_chunk_t *chunks;
+	int nchunks;
+	int chunk_cap;
+	unsigned char *data;
+	uint64_t data_len;
+	uint64_t data_cap;
+};
+
+/* Sequence number comparison, modulo 2^32 */
+static int seq_lt(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) < 0;
+}
+
+pytrace_tcp_t *pytrace_tcp_create(uint64_t stream_cap, uint64_t total_cap,
+		uint64_t idle_timeout)
+{
+	pytrace_tcp_t *tcp;
+
+	tcp = calloc(1, sizeof(*tcp));
+	if (!tcp)
+		return NULL;
+	tcp->nbuckets = 1024;
+	tcp->table = calloc(tcp->nbuckets, sizeof(*tcp->table));
+	if (!tcp->table) {
+		free(tcp);
+		return NULL;
+	}
+	tcp->stream_cap = stream_cap;
+	tcp->total_cap = total_cap;
+	tcp->idle_timeout = idle_timeout;
+	return tcp;
+}
+
+static void stream_free(pytrace_tcp_t *tcp, struct stream *s)
+{
+	struct segment *seg;
+
+	while ((seg = s->ooo)) {
+		s->ooo = seg->next;
+		free(seg);
+	}
+	tcp->ooo_bytes -= s->ooo_bytes;
+	free(s);
+}
+
+void pytrace_tcp_destroy(pytrace_tcp_t *tcp)
+{
+	struct stream *s, *next;
+
+	if (!tcp)
+		return;
+	for (s = tcp->oldest; s; s = next) {
+		next = s->next;
+		stream_free(tcp, s);
+	}
+	free(tcp->table);
+	free(tcp->chunks);
+	free(tcp->data);
+	free(tcp);
+}
+
+static void output_reset(pytrace_tcp_t *tcp)
+{
+	tcp->nchunks = 0;
+	tcp->data_len = 0;
+}
+
+/* Append data for a stream to the output, merging with the previous chunk
+ * when it continues the same run of bytes. */
+static int emit(pytrace_tcp_t *tcp, struct stream *s, int flags,
+		const unsigned char *data, uint32_t len, uint64_t ts)
+{
+	pytrace_tcp_chunk_t *chunk;
+
+	if (s->gap_pending) {
+		flags |= PYTRACE_TCP_GAP;
+		s->gap_pending = 0;
+	}
+
+	if (tcp->data_len + len > tcp->data_cap) {
+		uint64_t cap = tcp->data_cap ? tcp->data_cap : 65536;
+		unsigned char *p;
+
+		while (cap < tcp->data_len + len)
+			cap *= 2;
+		p = realloc(tcp->data, cap);
+		if (!p)
+			return -1;
+		tcp->data = p;
+		tcp->data_cap = cap;
+	}
+
+	chunk = tcp->nchunks ? &tcp->chunks[tcp->nchunks - 1] : NULL;
+	if (chunk && chunk->stream == s->id && flags == 0 && len > 0 &&
+			(chunk->flags & ~PYTRACE_TCP_GAP) == 0 &&
+			chunk->offset + chunk->length == tcp->data_len) {
+		memcpy(tcp->data + tcp->data_len, data, len);
+		tcp->data_len += len;
+		chunk->length += len;
+		chunk->ts = ts;
+		return 0;
+	}
+
+	if (tcp->nchunks == tcp->chunk_cap) {
+		int cap = tcp->chunk_cap ? tcp->chunk_cap * 2 : 256;
+		pytrace_tcp_chunk_t *p;
+
+		p = realloc(tcp->chunks, cap * sizeof(*p));
+		if (!p)
+			return -1;
+		tcp->chunks = p;
+		tcp->chunk_cap = cap;
+	}
+
+	chunk = &tcp->chunks[tcp->nchunks++];
+	chunk->stream = s->id;
+	memcpy(chunk->src, s->key.src, 16);
+	memcpy(chunk->dst, s->key.dst, 16);
+	chunk->src_port = s->key.src_port;
+	chunk->dst_port = s->key.dst_port;
+	chunk->ip_version = s->key.ip_version;
+	chunk->flags = flags;
+	chunk->ts = ts;
+	chunk->offset = tcp->data_len;
+	chunk->length = len;
+	if (len) {
+		memcpy(tcp->data + tcp->data_len, data, len);
+		tcp->data_len += len;
+	}
+	return 0;
+}
+
+/* Output a segment that starts exactly at next_seq */
+static int deliver(pytrace_tcp_t *tcp, struct stream *s,
+		const unsigned char *data, uint32_t caplen, uint32_t len,
+		uint64_t ts)
+{
+	int flags = caplen < len ? PYTRACE_TCP_TRUNCATED : 0;
+
+	if (emit(tcp, s, flags, data, caplen, ts) < 0)
+		return -1;
+	s->next_seq += len;
+	return 0;
+}
+
+/* Output the part of a segment beyond next_seq, if any */
+static int deliver_from(pytrace_tcp_t *tcp, struct stream *s, uint32_t seq,
+		const unsigned char *data, uint32_t caplen, uint32_t len,
+		uint64_t ts)
+{
+	uint32_t skip = s->next_seq - seq;
+
+	if (seq_lt(seq, s->next_seq)) {
+		if (skip >= len)
+			return 0;
+		len -= skip;
+		data += skip < caplen ? skip : caplen;
+		caplen = skip < caplen ? caplen - skip : 0;
+	}
+	return deliver(tcp, s, data, caplen, len, ts);
+}
+
+/* Output buffered segments that have become contiguous */
+static int drain(pytrace_tcp_t *tcp, struct stream *s)
+{
+	struct segment *seg;
+	int ret = 0;
+
+	while ((seg = s->ooo) && !seq_lt(s->next_seq, seg->seq)) {
+		s->ooo = seg->next;
+		s->ooo_bytes -= seg->caplen;
+		tcp->ooo_bytes -= seg->caplen;
+		if (ret == 0)
+			ret = deliver_from(tcp, s, seg->seq, seg->data,
+					seg->caplen, seg->len, seg->ts);
+		free(seg);
+	}
+	return ret;
+}
+
+static int buffer_segment(pytrace_tcp_t *tcp, struct stream *s, uint32_t seq,
+		const unsigned char *data, uint32_t caplen, uint32_t len,
+		uint64_t ts)
+{
+	struct segment **pos = &s->ooo;
+	struct segment *seg;
+
+	while (*pos && seq_lt((*pos)->seq, seq))
+		pos = &(*pos)->next;
+	/* A retransmission of something already buffered */
+	if (*pos && (*pos)->seq == seq && (*pos)->len >= len)
+		return 0;
+
+	seg = malloc(sizeof(*seg) + caplen);
+	if (!seg)
+		return -1;
+	seg->seq = seq;
+	seg->len = len;
+	seg->caplen = caplen;
+	seg->ts = ts;
+	memcpy(seg->data, data, caplen);
+	seg->next = *pos;
+	*pos = seg;
+	s->ooo_bytes += caplen;
+	tcp->ooo_bytes += caplen;
+	return 0;
+}
+
+static int stream_data(pytrace_tcp_t *tcp, struct stream *s, uint32_t seq,
+		const unsigned char *data, uint32_t caplen, uint32_t len,
+		uint64_t ts)
+{
+	while (seq_lt(s->next_seq, seq)) {
+		if (s->ooo_bytes + caplen <= tcp->stream_cap &&
+				tcp->ooo_bytes + caplen <= tcp->total_cap)
+			return buffer_segment(tcp, s, seq, data, caplen, len,
+					ts);
+
+		/* Over the cap: give up on the hole and resume from the
+		 * earliest data we have */
+		s->gap_pending = 1;
+		if (s->ooo && seq_lt(s->ooo->seq, seq))
+			s->next_seq = s->ooo->seq;
+		else
+			s->next_seq = seq;
+		if (drain(tcp, s) < 0)
+			return -1;
+	}
+
+	if (deliver_from(tcp, s, seq, data, caplen, len, ts) < 0)
+		return -1;
+	return drain(tcp, s);
+}
+
+static void list_unlink(pytrace_tcp_t *tcp, struct stream *s)
+{
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		tcp->oldest = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	else
+		tcp->newest = s->prev;
+}
+
+static void list_append(pytrace_tcp_t *tcp, struct stream *s)
+{
+	s->prev = tcp->newest;
+	s->next = NULL;
+	if (tcp->newest)
+		tcp->newest->next = s;
+	else
+		tcp->oldest = s;
+	tcp->newest = s;
+}
+
+static struct stream *stream_find(pytrace_tcp_t *tcp,
+		const struct flow_key *key, uint64_t hash)
+{
+	struct stream *s;
+
+	for (s = tcp->table[hash & (tcp->nbuckets - 1)]; s; s = s->hnext) {
+		if (s->hash == hash && memcmp(&s->key, key, sizeof(*key)) == 0)
+			return s;
+	}
+	return NULL;
+}
+
+static int table_grow(pytrace_tcp_t *tcp)
+{
+	uint32_t nbuckets = tcp->nbuckets * 2;
+	struct stream **table;
+	struct stream *s;
+
+	table = calloc(nbuckets, sizeof(*table));
+	if (!table)
+		return -1;
+	for (s = tcp->oldest; s; s = s->next) {
+		s->hnext = table[s->hash & (nbuckets - 1)];
+		table[s->hash & (nbuckets - 1)] = s;
+	}
+	free(tcp->table);
+	tcp->table = table;
+	tcp->nbuckets = nbuckets;
+	return 0;
+}
+
+static struct stream *stream_create(pytrace_tcp_t *tcp,
+		const struct flow_key *key, uint64_t hash)
+{
+	struct stream *s;
+	uint32_t b;
+
+	if (tcp->nstreams >= tcp->nbuckets && table_grow(tcp) < 0)
+		return NULL;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->key = *key;
+	s->hash = hash;
+	s->id = tcp->next_id++;
+
+	b = hash & (tcp->nbuckets - 1);
+	s->hnext = tcp->table[b];
+	tcp->table[b] = s;
+	list_append(tcp, s);
+	tcp->nstreams++;
+	return s;
+}
+
+static void stream_remove(pytrace_tcp_t *tcp, struct stream *s)
+{
+	struct stream **p = &tcp->table[s->hash & (tcp->nbuckets - 1)];
+
+	while (*p != s)
+		p = &(*p)->hnext;
+	*p = s->hnext;
+	list_unlink(tcp, s);
+	tcp->nstreams--;
+	stream_free(tcp, s);
+}
+
+/* Deliver whatever is buffered, skipping over holes, then end the stream */
+static int stream_close(pytrace_tcp_t *tcp, struct stream *s, int flags)
+{
+	struct segment *seg;
+
+	while ((seg = s->ooo)) {
+		if (seq_lt(s->next_seq, seg->seq)) {
+			s->gap_pending = 1;
+			s->next_seq = seg->seq;
+		}
+		if (drain(tcp, s) < 0)
+			return -1;
+	}
+	if (emit(tcp, s, flags, NULL, 0, s->last) < 0)
+		return -1;
+	stream_remove(tcp, s);
+	return 0;
+}
+
+static int tcp_segment(pytrace_tcp_t *tcp, libtrace_packet_t *packet)
+{
+	struct flow_key key;
+	struct stream *s;
+	libtrace_tcp_t *th;
+	unsigned char *payload;
+	uint32_t remaining, seq, caplen, len;
+	uint64_t hash, ts;
+	uint8_t proto;
+
+	th = trace_get_transport(packet, &proto, &remaining);
+	if (!th || proto != TRACE_IPPROTO_TCP ||
+			remaining < sizeof(libtrace_tcp_t))
+		return 0;
+	if (!decode_flow_key(packet, &key))
+		return 0;
+
+	ts = trace_get_erf_timestamp(packet);
+	if (ts > tcp->now)
+		tcp->now = ts;
+
+	payload = trace_get_payload_from_tcp(th, &remaining);
+	caplen = payload ? remaining : 0;
+	/* The captured bytes may include link layer padding, so the IP
+	 * header has the last word on the length */
+	len = trace_get_payload_length(packet);
+	if (caplen > len)
+		caplen = len;
+
+	seq = ntohl(th->seq);
+	if (th->syn)
+		seq++;
+
+	hash = flow_key_hash(&key, 0);
+	s = stream_find(tcp, &key, hash);
+	if (!s) {
+		/* Don't start streams on bare ACKs, FINs or resets, such as
+		 * retransmissions for a stream that has already closed */
+		if (th->rst || (!th->syn && len == 0))
+			return 0;
+		s = stream_create(tcp, &key, hash);
+		if (!s)
+			return -1;
+		s->next_seq = seq;
+		s->last = ts;
+		if (emit(tcp, s, PYTRACE_TCP_START, NULL, 0, ts) < 0)
+			return -1;
+	}
+
+	s->last = ts;
+	if (tcp->newest != s) {
+		list_unlink(tcp, s);
+		list_append(tcp, s);
+	}
+
+	if (th->rst)
+		return stream_close(tcp, s, PYTRACE_TCP_RST);
+
+	if (len && stream_data(tcp, s, seq, payload, caplen, len, ts) < 0)
+		return -1;
+
+	if (th->fin) {
+		s->fin_seen = 1;
+		s->fin_seq = seq + len;
+	}
+	if (s->fin_seen && !seq_lt(s->next_seq, s->fin_seq))
+		return stream_close(tcp, s, PYTRACE_TCP_FIN);
+	return 0;
+}
+
+static int expire_idle(pytrace_tcp_t *tcp)
+{
+	while (tcp->oldest &&
+			tcp->oldest->last + tcp->idle_timeout <= tcp->now) {
+		if (stream_close(tcp, tcp->oldest, PYTRACE_TCP_CLOSED) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+int pytrace_tcp_read(pytrace_tcp_t *tcp, pytrace_reader_t *reader,
+		libtrace_packet_t *packet, int max_packets, int max_chunks,
+		int *status)
+{
+	int n;
+
+	output_reset(tcp);
+	*status = 1;
+	for (n = 0; n < max_packets && tcp->nchunks < max_chunks; n++) {
+		*status = pytrace_reader_read(reader, packet);
+		if (*status <= 0)
+			break;
+		if (tcp_segment(tcp, packet) < 0 || expire_idle(tcp) < 0) {
+			*status = -2;
+			break;
+		}
+	}
+	return tcp->nchunks;
+}
+
+int pytrace_tcp_flush(pytrace_tcp_t *tcp)
+{
+	output_reset(tcp);
+	while (tcp->oldest) {
+		if (stream_close(tcp, tcp->oldest, PYTRACE_TCP_CLOSED) < 0)
+			return -1;
+	}
+	return tcp->nchunks;
+}
+
+const pytrace_tcp_chunk_t *pytrace_tcp_chunks(const pytrace_tcp_t *tcp)
+{
+	return tcp->chunks;
+}
+
+const unsigned char *pytrace_tcp_data(const pytrace_tcp_t *tcp,
+		uint64_t *length)
+{
+	*length = tcp->data_len;
+	return tcp->data;
+}
@@ -0,0 +1,319 @@
+/*
+ * Tumbling and sliding window counters.
+ *
+ * Time is cut into slots of one step each, aligned to the ERF epoch. A
+ * window is a run of consecutive slots, so a sliding window that moves by
+ * one step keeps width / step slots in a ring, and a tumbling window is
+ * the special case of a ring of one. Each slot counts packets and bytes
+ * per key in a small open addressing table. When a packet arrives in a
+ * later slot, every window that ended before it is summed from the ring
+ * and written out, and the slots that have left the window are cleared.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libtrace.h>
+#include "pytrace.h"
+
+struct counter {
+	uint64_t packets;	/* 0 marks an empty entry */
+	uint64_t bytes;
+	uint32_t key;
+};
+
+struct slot {
+	struct counter *table;
+	uint32_t size;		/* Always a power of two */
+	uint32_t count;
+};
+
+struct pytrace_windows_t {
+	int key;
+	uint64_t step;
+	uint32_t nslots;
+	struct slot *slots;	/* Slot s lives at slots[s % nslots] */
+	uint32_t filled;	/* Slots with a count */
+	uint64_t cur;		/* The latest slot seen */
+	int started;
+	struct slot sum;	/* Scratch space for closing a window */
+
+	pytrace_window_t *rows;
+	int nrows;
+	int row_cap;
+};
+
+static int slot_init(struct slot *s, uint32_t size)
+{
+	s->table = calloc(size, sizeof(*s->table));
+	s->size = size;
+	s->count = 0;
+	return s->table ? 0 : -1;
+}
+
+static void slot_clear(struct slot *s)
+{
+	if (s->count) {
+		memset(s->table, 0, s->size * sizeof(*s->table));
+		s->count = 0;
+	}
+}
+
+static struct counter *slot_find(struct slot *s, uint32_t key)
+{
+	uint32_t mask = s->size - 1;
+	uint32_t i = (uint32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+
+	while (s->table[i].packets && s->table[i].key != key)
+		i = (i + 1) & mask;
+	return &s->table[i];
+}
+
+static int slot_grow(struct slot *s)
+{
+	struct slot bigger;
+	uint32_t i;
+
+	if (slot_init(&bigger, s->size * 2) < 0)
+		return -1;
+	for (i = 0; i < s->size; i++) {
+		if (s->table[i].packets)
+			*slot_find(&bigger, s->table[i].key) = s->table[i];
+	}
+	bigger.count = s->count;
+	free(s->table);
+	*s = bigger;
+	return 0;
+}
+
+/* Returns 1 if a new key was added, 0 if an existing one was updated and
+ * -1 if memory ran out */
+static int slot_add(struct slot *s, uint32_t key, uint64_t packets,
+		uint64_t bytes)
+{
+	struct counter *c;
+
+	if (s->count * 2 >= s->size && slot_grow(s) < 0)
+		return -1;
+	c = slot_find(s, key);
+	if (c->packets) {
+		c->packets += packets;
+		c->bytes += bytes;
+		return 0;
+	}
+	c->key = key;
+	c->packets = packets;
+	c->bytes = bytes;
+	s->count++;
+	return 1;
+}
+
+pytrace_windows_t *pytrace_windows_create(int key, uint64_t width,
+		uint64_t step)
+{
+	pytrace_windows_t *w;
+	uint32_t i;
+
+	if (step == 0 || width < step || width % step)
+		return NULL;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+	w->key = key;
+	w->step = step;
+	w->nslots = width / step;
+	w->slots = calloc(w->nslots, sizeof(*w->slots));
+	if (!w->slots || slot_init(&w->sum, 16) < 0)
+		goto fail;
+	for (i = 0; i < w->nslots; i++) {
+		if (slot_init(&w->slots[i], 16) < 0)
+			goto fail;
+	}
+	return w;
+
+fail:
+	pytrace_windows_destroy(w);
+	return NULL;
+}
+
+void pytrace_windows_destroy(pytrace_windows_t *w)
+{
+	uint32_t i;
+
+	if (!w)
+		return;
+	if (w->slots) {
+		for (i = 0; i < w->nslots; i++)
+			free(w->slots[i].table);
+		free(w->slots);
+	}
+	free(w->sum.table);
+	free(w->rows);
+	free(w);
+}
+
+static int row_compare(const void *a, const void *b)
+{
+	uint32_t x = ((const pytrace_window_t *)a)->key;
+	uint32_t y = ((const pytrace_window_t *)b)->key;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Write out the window made of the slots before end, which are exactly
+ * the ones in the ring */
+static int window_close(pytrace_windows_t *w, uint64_t end)
+{
+	struct slot *sum = &w->sum;
+	struct counter *c;
+	pytrace_window_t *row;
+	uint32_t i, j;
+	int first;
+
+	if (!w->filled)
+		return 0;
+
+	slot_clear(sum);
+	for (i = 0; i < w->nslots; i++) {
+		struct slot *s = &w->slots[i];
+
+		for (j = 0; s->count && j < s->size; j++) {
+			c = &s->table[j];
+			if (c->packets && slot_add(sum, c->key, c->packets,
+						c->bytes) < 0)
+				return -1;
+		}
+	}
+
+	if (w->nrows + sum->count > (uint32_t)w->row_cap) {
+		int cap = w->row_cap ? w->row_cap : 256;
+		pytrace_window_t *p;
+
+		while ((uint32_t)cap < w->nrows + sum->count)
+			cap *= 2;
+		p = realloc(w->rows, cap * sizeof(*p));
+		if (!p)
+			return -1;
+		w->rows = p;
+		w->row_cap = cap;
+	}
+
+	first = w->nrows;
+	for (j = 0; j < sum->size; j++) {
+		c = &sum->table[j];
+		if (!c->packets)
+			continue;
+		row = &w->rows[w->nrows++];
+		row->start = end >= w->nslots ? (end - w->nslots) * w->step : 0;
+		row->end = end * w->step;
+		row->packets = c->packets;
+		row->bytes = c->bytes;
+		row->key = c->key;
+		row->pad = 0;
+	}
+	qsort(w->rows + first, w->nrows - first, sizeof(*w->rows),
+			row_compare);
+	return 0;
+}
+
+/* Close every window that ends at or before slot, making it the latest */
+static int advance(pytrace_windows_t *w, uint64_t slot)
+{
+	struct slot *s;
+
+	while (w->cur < slot) {
+		if (!w->filled) {
+			/* Nothing is left to close, so skip straight there */
+			w->cur = slot;
+			break;
+		}
+		if (window_close(w, w->cur + 1) < 0)
+			return -1;
+		w->cur++;
+		s = &w->slots[w->cur % w->nslots];
+		if (s->count)
+			w->filled--;
+		slot_clear(s);
+	}
+	return 0;
+}
+
+static uint32_t packet_key(int key, const libtrace_packet_t *packet)
+{
+	uint8_t proto;
+	uint16_t src, dst;
+	uint32_t remaining;
+
+	if (key == PYTRACE_WINDOW_TOTAL)
+		return 0;
+	if (!trace_get_transport(packet, &proto, &remaining))
+		return PYTRACE_WINDOW_OTHER;
+	if (key == PYTRACE_WINDOW_PROTO)
+		return proto;
+
+	src = trace_get_source_port(packet);
+	dst = trace_get_destination_port(packet);
+	switch (key) {
+	case PYTRACE_WINDOW_SRC_PORT:
+		return (uint32_t)proto << 16 | src;
+	case PYTRACE_WINDOW_DST_PORT:
+		return (uint32_t)proto << 16 | dst;
+	}
+	return (uint32_t)proto << 16 | (src < dst ? src : dst);
+}
+
+static int windows_add(pytrace_windows_t *w, libtrace_packet_t *packet)
+{
+	uint64_t slot = trace_get_erf_timestamp(packet) / w->step;
+	struct slot *s;
+	int ret;
+
+	if (!w->started) {
+		w->cur = slot;
+		w->started = 1;
+	} else if (slot > w->cur && advance(w, slot) < 0) {
+		return -1;
+	}
+
+	/* Packets that are out of order count towards the latest slot */
+	s = &w->slots[w->cur % w->nslots];
+	ret = slot_add(s, packet_key(w->key, packet), 1,
+			trace_get_wire_length(packet));
+	if (ret > 0 && s->count == 1)
+		w->filled++;
+	return ret < 0 ? -1 : 0;
+}
+
+int pytrace_windows_read(pytrace_windows_t *w, pytrace_reader_t *reader,
+		libtrace_packet_t *packet, int max_packets, int max_rows,
+		int *status)
+{
+	int n;
+
+	w->nrows = 0;
+	*status = 1;
+	for (n = 0; n < max_packets && w->nrows < max_rows; n++) {
+		*status = pytrace_reader_read(reader, packet);
+		if (*status <= 0)
+			break;
+		if (windows_add(w, packet) < 0) {
+			*status = -2;
+			break;
+		}
+	}
+	return w->nrows;
+}
+
+int pytrace_windows_flush(pytrace_windows_t *w)
+{
+	w->nrows = 0;
+	if (w->started && advance(w, w->cur + w->nslots) < 0)
+		return -1;
+	return w->nrows;
+}
+
+const pytrace_window_t *pytrace_windows_rows(const pytrace_windows_t *w)
+{
+	return w->rows;
+}
@@ -20,7 +20,12 @@ setup(
         "License :: OSI Approved :: BSD License",
     ],
     packages=find_packages(),
+    python_requires=">=3.8",
     install_requires=["cffi>=1.0.0"],
+    extras_require={
+        "numpy": ["numpy"],
+        "arrow": ["pyarrow"],
+    },
     setup_requires=["cffi>=1.0.0"],
     cffi_modules=[
         "./pytrace/build_pytrace.py:ffi",